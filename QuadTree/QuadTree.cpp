@@ -4,11 +4,58 @@
  */
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <memory>
 #include <vector>
 #include <cstdint>
+#include <cstddef>
 #include <cassert>
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+#include <iomanip>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUADTREE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Static tracepoints for bpftrace / SystemTap, e.g. bpftrace -e 'usdt:./QuadTree:prqt:insert__return { @splits = hist(arg4); }'
+// Only compiled in when QUADTREE_USDT is defined and <sys/sdt.h> exists. An unattached probe is a single nop, and
+// without QUADTREE_USDT the probes and their arguments are not compiled at all.
+#if defined(QUADTREE_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define QUADTREE_PROBES 1
+#endif
+#endif
+
+#if QUADTREE_PROBES
+#define QUADTREE_PROBE1(name, a1) DTRACE_PROBE1(prqt, name, a1)
+#define QUADTREE_PROBE2(name, a1, a2) DTRACE_PROBE2(prqt, name, a1, a2)
+#define QUADTREE_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(prqt, name, a1, a2, a3, a4)
+#define QUADTREE_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(prqt, name, a1, a2, a3, a4, a5)
+#else
+#define QUADTREE_PROBE1(name, a1) ((void)0)
+#define QUADTREE_PROBE2(name, a1, a2) ((void)0)
+#define QUADTREE_PROBE4(name, a1, a2, a3, a4) ((void)0)
+#define QUADTREE_PROBE5(name, a1, a2, a3, a4, a5) ((void)0)
+#endif
+
+template<typename TRecord> class CIngestPipeline;
+class CWorkloadRecorder;
+class CQuadTreeForest;
 
  // A Point Region Quadtree
 class CQuadTree
@@ -18,23 +65,59 @@ public:
 	class CCoordinate
 	{
 	public:
-		CCoordinate();
-		CCoordinate(TScalar _x, TScalar _y);
+		constexpr CCoordinate();
+		constexpr CCoordinate(TScalar _x, TScalar _y);
 
-		inline bool operator==(const CCoordinate& rhs) const;
-		inline bool operator!=(const CCoordinate& rhs) const;
-		inline CCoordinate operator/(const CCoordinate& rhs) const;
-		inline CCoordinate operator+(const CCoordinate& rhs) const;
-		inline CCoordinate operator-(const CCoordinate& rhs) const;
+		constexpr bool operator==(const CCoordinate& rhs) const;
+		constexpr bool operator!=(const CCoordinate& rhs) const;
+		constexpr CCoordinate operator/(const CCoordinate& rhs) const;
+		constexpr CCoordinate operator+(const CCoordinate& rhs) const;
+		constexpr CCoordinate operator-(const CCoordinate& rhs) const;
 
 		TScalar x, y;
 	};
 
+	// Where a split cuts the region from min to max: the north west quadrant ends at the center, so a point lies west
+	// while x <= center.x and north while y <= center.y. Shared with CStaticQuadTree.
+	static constexpr CCoordinate SplitCenter(const CCoordinate& min, const CCoordinate& max);
+
+	// 128 bit Z-order key, x bits interleaved into the even positions and y bits into the odd positions.
+	// Each pair of key bits selects the quadrant a point falls into at the matching depth of the tree.
+	class CMortonKey
+	{
+	public:
+		CMortonKey();
+		CMortonKey(TScalar _high, TScalar _low);
+
+		static inline CMortonKey FromCoordinate(const CCoordinate& point);
+		inline CCoordinate ToCoordinate() const;
+		inline uint8_t TopLevelQuadrant() const;
+
+		inline bool operator==(const CMortonKey& rhs) const;
+		inline bool operator!=(const CMortonKey& rhs) const;
+		inline bool operator<(const CMortonKey& rhs) const;
+
+		TScalar high, low;
+	};
+
+	class CKeyedCoordinate
+	{
+	public:
+		CKeyedCoordinate() = default;
+		explicit CKeyedCoordinate(const CCoordinate& _point);
+
+		inline bool operator<(const CKeyedCoordinate& rhs) const;
+
+		CMortonKey key;
+		CCoordinate point;
+	};
+
 	enum class EInsertResult : uint8_t
 	{
 		OutOfRegionBounds,
 		DuplicateEntry,
-		Success
+		Success,
+		OutOfMemory // The memory budget has no room for the nodes the point needs
 	};
 
 	enum class EFindResult : uint8_t
@@ -44,14 +127,173 @@ public:
 		Success
 	};
 
-	CQuadTree(size_t pageSize);
+	enum class EEraseResult : uint8_t
+	{
+		OutOfRegionBounds,
+		NoEntry,
+		Success
+	};
+
+	enum class ELoadResult : uint8_t
+	{
+		InvalidFormat,
+		Truncated,
+		OutOfMemory, // the memory budget cannot hold the loaded points
+		Success
+	};
+
+	// Operation counters accumulate from construction, the gauges describe the committed tree when the snapshot was taken
+	class CMetrics
+	{
+	public:
+		enum class EOperation : uint8_t
+		{
+			Insert,
+			Find,
+			Erase,
+			Reset,
+			Count
+		};
+
+		static constexpr size_t kTimedOperationCount = 3; // Insert, Find and Erase have latency histograms
+		static constexpr size_t kLatencyBucketCount = 24; // bucket i counts operations under 2^(i + 4)ns, the last is unbounded
+
+		void WritePrometheus(std::ostream& stream) const; // text exposition format
+
+		uint64_t pointCount = 0; // including the write buffer
+		uint64_t overflowPointCount = 0; // held in leaves' buckets
+		uint64_t nodeCount = 0; // reachable from the committed root
+		uint64_t pageCount = 0;
+		uint64_t freeNodeCount = 0; // left in the pool before another page is allocated
+		uint64_t allocatedBytes = 0;
+		uint32_t maxDepth = 0;
+		uint64_t operationCounts[static_cast<size_t>(EOperation::Count)] = {};
+		uint64_t latencyBuckets[kTimedOperationCount][kLatencyBucketCount] = {};
+		uint64_t latencySumsNs[kTimedOperationCount] = {};
+	};
+
+	// With an inline capacity the tree starts out without a node pool, keeping up to inlineCapacity points in a flat
+	// array that Find scans with SIMD compares. The pool and node tree are built once the points outgrow the array, or
+	// for an operation that needs nodes (batches, checkpoints, the ingest pipeline), and the tree then stays built.
+	// Building that tree is not held to the memory budget.
+	CQuadTree(size_t pageSize, size_t inlineCapacity = 0); // pageSize nodes in the first page of the pool
+	~CQuadTree();
 
 	EInsertResult Insert(const CCoordinate& point);
+	size_t InsertBatch(const CCoordinate* pPoints, size_t count); // returns the number of points inserted
 	EFindResult Find(const CCoordinate& point);
+	EEraseResult Erase(const CCoordinate& point);
 	void Reset();
 	void SanityCheck() const;
 
+	template<typename TFunction>
+	void ForEachPoint(TFunction function) const; // committed points, including any still in the write buffer
+
+	// Snapshots store the points sorted in Z-order as varint deltas of their Morton keys, in independently
+	// decodable blocks. The topology is not stored, Deserialize rebuilds the tree through the sorted batch path.
+	// Deserialize decodes and checks the whole snapshot before it replaces the tree, a failed load leaves it as it was.
+	// Under a memory budget it keeps the previous points aside and puts them back when the budget refuses the snapshot.
+	void Serialize(std::ostream& stream) const;
+	ELoadResult Deserialize(std::istream& stream);
+
+	// Checkpoints write pool slots as varint records, every slot in use when full is set and otherwise only the slots
+	// changed since the previous checkpoint. Slots past the pool head's high water mark are never written. Recovery
+	// applies the last full checkpoint followed by each later incremental one, ApplyCheckpoint reads and checks the
+	// whole checkpoint, including that its links form a tree, before it changes the pool. A failed apply leaves the
+	// tree as it was, as does one whose pages the memory budget cannot hold.
+	void Checkpoint(std::ostream& stream, bool full);
+	ELoadResult ApplyCheckpoint(std::istream& stream);
+
+	// Every operation is appended to the recorder's trace while one is set, pass nullptr to stop recording.
+	// Set it while no other thread is using the tree. Inserts made by a CIngestPipeline are not recorded, as its
+	// insert threads run concurrently and a trace is a single ordered stream.
+	void SetRecorder(CWorkloadRecorder* pRecorder) { m_pRecorder = pRecorder; }
+
+	size_t GetAllocatedBytes() const; // node pool plus write buffer, inline points and leaf cache
+
+	// Walks the committed tree and the pool, take snapshots from the writing thread or while no thread is writing.
+	// Latency histograms are off by default as they read the clock twice per operation, the counters are always kept.
+	// Points a CIngestPipeline inserts, duplicates included, count as Insert operations but are not timed.
+	CMetrics GetMetrics() const;
+	void EnableLatencyHistograms(bool enable) { m_latencyHistograms = enable; }
+
+	// Page growth: each new page holds growthFactor times the nodes of the page before it, between the constructor's
+	// page size and maxPageSize. The default factor of 1 keeps every page at the constructor's size.
+	void SetPageGrowth(size_t growthFactor, size_t maxPageSize);
+
+	// Page refill: a background thread keeps reservePages pages built and faulted in ahead of time, and the pool
+	// takes its next page from them through a lock free queue. A page is only built in place when the thread has
+	// fallen behind. The thread follows the page growth set when it was enabled, and queued pages are not counted
+	// against the memory budget.
+	void EnablePageRefill(size_t reservePages);
+	void DisablePageRefill(); // stops the thread, queued pages are released
+
+	// Allocates up front the nodes expectedPoints are estimated to need, so a build does not stop for new pages.
+	// The nodes per point are measured by building the sample into a scratch tree, in two halves so the estimate
+	// follows the nodes each further point adds as clustered points get denser. Without a sample the estimate is the
+	// roughly three nodes per point of uniformly spread points. The reservation stays within the memory budget.
+	void Reserve(size_t expectedPoints, const CCoordinate* pSample = nullptr, size_t sampleCount = 0);
+
+	// Memory budget: with a budget set, Insert returns OutOfMemory rather than grow the node pool past budgetBytes.
+	// Once the pool reaches pressureFraction of the budget the pressure callback runs after every new page and every
+	// refused insert, and with a degradation depth set, no leaf splits below that depth and further points join the
+	// leaf's bucket. The callback runs on the allocating thread, possibly an ingest thread, and must not use
+	// the tree. The ingest pipeline reserves nodes in chunks and may overshoot the budget by a chunk per thread.
+	void SetMemoryBudget(size_t budgetBytes, double pressureFraction = 0.9); // 0 removes the budget
+	void SetMemoryPressureCallback(std::function<void(size_t poolBytes, size_t budgetBytes)> callback);
+	void SetDegradationDepth(uint32_t depth) { m_degradationDepth = depth; } // 0 disables degradation, the default
+
+	// Bitmap leaves: once the subtree over an 8 x 8 cell block holds densityThreshold points it collapses into a single
+	// leaf with one bit per cell, and once erases leave fewer than half the threshold it expands back into nodes, if
+	// the budget has room for them. Only points packed at unit spacing fill a block. The dropped nodes are reclaimed by
+	// Reset or CompactPool. 0 disables it, the default, and existing bitmap leaves then only go once they are empty.
+	void SetBitmapLeafThreshold(size_t densityThreshold) { m_bitmapLeafThreshold = densityThreshold; }
+
+	// Compaction: moves live nodes from the end of the pool into the slots of erased and replaced nodes nearer the
+	// front, then releases the pages left empty at the end. Each call examines at most maxNodes pool slots and returns
+	// true once a pass has finished, so a pass can be spread across frames. Nodes move, so no other thread may use the
+	// tree during a call, and not during a batch or while an ingest pipeline runs. Take a full checkpoint, or apply
+	// incremental ones in order, as released pages shrink the page count.
+	bool CompactPool(size_t maxNodes);
+
+	// Hot path relayout: while an access profile runs, every sampleInterval-th Find counts the nodes on its path.
+	// RelayoutHotPaths ends the profile and moves the hotNodeCount most visited nodes to the front of the pool, each hot
+	// path depth first with the more visited children first, so the paths of the busiest regions share a few pages.
+	// The nodes found there are swapped out to the slots the hot nodes left. Counts follow node addresses, so changes
+	// to the tree during the profile skew them. Nodes move, so the restrictions of CompactPool apply, and the profile is
+	// begun while no other thread uses the tree. Returns the number of nodes laid out in the hot region.
+	void BeginAccessProfile(uint32_t sampleInterval);
+	size_t RelayoutHotPaths(size_t hotNodeCount);
+
+	// Batches: between BeginBatch and Commit, Insert and Erase build a copy on write version of the tree while
+	// Find keeps reading the last committed version, so readers on other threads see the whole batch or none of it.
+	// Abort rewinds the pool to where the batch began. Nodes a commit replaces are reused once no Find that may still
+	// read them is running, which BeginBatch and Commit check through the count of Finds begun in each read epoch.
+	void BeginBatch();
+	void Commit();
+	void Abort();
+	bool InBatch() const { return m_pBatchRoot != nullptr; }
+
+	// Write buffer: Insert checks the buffer and the tree for the point, then appends it to a small unsorted buffer
+	// which is merged in Z-order once it reaches mergeThreshold points. Find checks the buffer before descending the
+	// tree. Under memory pressure Insert flushes the buffer and inserts directly, so OutOfMemory reaches the caller;
+	// points the budget still refuses at a merge are reported to the pressure callback and counted by FlushWriteBuffer.
+	void EnableWriteBuffer(size_t mergeThreshold);
+	void DisableWriteBuffer(); // merges anything still buffered
+	size_t FlushWriteBuffer(); // returns the number of buffered points the memory budget refused
+
+	// Leaf cache: Find first probes a table of setCount sets for the node it found the point in last time, and only
+	// descends from the root on a miss. Each set is one cache line holding the two points found most recently among
+	// those hashed to it. Entries carry the version of the tree's structure, which splits, merges and node moves advance,
+	// so any such change invalidates them all at once. Finds on several threads fill a set one at a time through its
+	// sequence word, a Find that finds the set busy skips the fill and a probe that overlaps a fill counts as a miss.
+	// Enable and disable the cache while no other thread uses the tree.
+	void EnableLeafCache(size_t setCount); // rounded up to a power of two
+	void DisableLeafCache();
+
 private:
+	template<typename TRecord> friend class CIngestPipeline;
+	friend class CQuadTreeForest;
 
 	class CBounds
 	{
@@ -60,503 +302,7845 @@ private:
 		CBounds(const CCoordinate& _min, const CCoordinate& _max);
 
 		inline bool Contains(const CCoordinate& point) const;
+		inline bool IsAlignedSquare() const;
+		inline uint32_t Depth() const;
 		inline bool operator==(const CBounds& rhs) const;
 		inline bool operator!=(const CBounds& rhs) const;
 
 		CCoordinate min, max;
 	};
 
+	class CPage;
+	class CPageRefill;
+	class CLeafCacheSet;
+
 	class CNode
 	{
 	public:
 		void InitializeAsLeaf(const CCoordinate& _point, const CBounds& _regionBounds);
 		void InitializeAsRegion(const CBounds& _regionBounds);
 		EFindResult Find(const CCoordinate& point, CNode** pFoundNode);
-		void Split(CQuadTree& quadTree);
+		template<typename TAllocator>
+		void Split(TAllocator& allocator);
 		CNode* ContainingSubRegion(const CCoordinate& point);
+		inline CNode* ChildContaining(const CCoordinate& point) const;
+		inline uint8_t QuadrantContaining(const CCoordinate& point) const;
+		static inline void PrefetchDescentState(const CNode* pNode);
+		CNode** ContainingSubRegionLink(const CCoordinate& point);
+		inline CNode* QuadrantChild(uint8_t quadrant) const;
+		inline CNode* const* QuadrantLink(uint8_t quadrant) const;
+		inline bool HasChildren() const;
+		inline uint64_t CellBit(const CCoordinate& point) const;
+		inline CCoordinate CellPoint(uint32_t cell) const;
+		inline uint32_t BucketWidth() const;
+		inline uint32_t BucketCapacity() const;
+		inline CCoordinate BucketPoint(uint32_t index) const;
+		inline void SetBucketPoint(uint32_t index, const CCoordinate& point);
+		inline uint32_t FindBucketPoint(const CCoordinate& point) const;
+		inline CBounds RegionBounds() const;
+		inline TScalar RegionExtent() const; // max less min on either axis
+		inline uint32_t RegionDepth() const { return m_regionDepth; }
+		inline void SetRegionBounds(const CBounds& regionBounds);
+		inline void MarkDirty();
+		inline void ResetNodeState();
+		inline void CopyNodeState(const CNode& source);
 
 		enum class EType : uint8_t
 		{
 			Leaf,
 			Region,
-			Undefined
+			Undefined,
+			Bitmap, // a leaf over an 8 x 8 cell block, m_point.x holds one bit per cell, appended to keep checkpointed values
+			Bucket // a node of a deep or degraded leaf's bucket, m_point packs the points relative to the region, see BucketPoint
 		};
 
-		//// Node state
-		CBounds m_regionBounds; // The entire region this quad node can contain
-		CCoordinate m_point;
-		CNode* m_pNorthWest = nullptr;
+		//// Descent state, the 56 bytes read at each level on the way down, kept ahead of the colder state
+		CNode* m_pNorthWest = nullptr; // the child links are in quadrant order, see QuadrantLink
 		CNode* m_pNorthEast = nullptr;
-		CNode* m_pSouthEast = nullptr;
 		CNode* m_pSouthWest = nullptr;
+		CNode* m_pSouthEast = nullptr;
+		CCoordinate m_regionMin; // Regions are bit aligned squares, so the corner and the depth give the entire region
+		uint8_t m_regionDepth = 64; // this quad node can contain, see RegionBounds. Free nodes hold the single cell at 0.
 		EType m_nodeType = EType::Undefined;
+		uint8_t m_bucketCount = 0; // points packed into a bucket node
+		bool m_dirty = true; // changed since the last checkpoint
+		uint32_t m_batchGeneration = 0; // batch that allocated this node, 0 outside of batches
+
+		//// Node state
+		CCoordinate m_point;
+		CNode* m_pOverflow = nullptr; // next node of a leaf's bucket
 
 		//// Memory pool state
-		CNode* pPoolNext = nullptr; // intrusive pointer for pool allocation
+		CNode* pPoolNext = nullptr; // intrusive pointer for pool allocation, the page a node lives in is found by address
+	};
+
+	// Two ways of 24 bytes behind a sequence word and the version both ways were filled in, so a set fills one cache
+	// line. Fields are read and written relaxed, the sequence word orders them the way a seqlock does.
+	class CLeafCacheSet
+	{
+	public:
+		CNode* Probe(const CCoordinate& point, uint64_t version) const; // null on a miss
+		void Fill(const CCoordinate& point, CNode* pNode, uint64_t version);
+
+	private:
+		std::atomic<uint64_t> m_sequence; // odd while a Find fills the set
+		std::atomic<uint64_t> m_version; // 0 for an empty set, the structure version starts at 1
+		std::atomic<TScalar> m_coordinates[4]; // x and y of each way, the most recent first
+		std::atomic<CNode*> m_pNodes[2]; // null for an empty way
+	};
+
+	class CPage
+	{
+	public:
+		CNode* m_pNodes = nullptr;
+		size_t m_nodeCount = 0;
+		size_t m_index = 0; // position in m_pages
+		std::unique_ptr<CNode[]> m_pStorage; // holds m_pNodes, null for a run carved out of a forest's slab
+	};
+
+	// A pool slot as a checkpoint stores it. Slots are numbered across the pool, page after page, and links hold the
+	// slot they point to plus one, 0 for null. A pristine slot is one a new page starts with.
+	class CCheckpointRecord
+	{
+	public:
+		static CCheckpointRecord Pristine(uint64_t slot, uint64_t slotCount);
+		bool IsPristine(uint64_t slotCount) const;
+		TScalar RegionExtent() const { return m_regionDepth < 64 ? ~TScalar(0) >> m_regionDepth : 0; }
+		void Write(std::string& buffer, uint64_t previousSlot) const;
+		bool Read(const uint8_t*& pCursor, const uint8_t* pEnd, uint64_t previousSlot, uint64_t pageEnd, uint64_t slotCount);
+
+		uint64_t m_slot = 0;
+		uint8_t m_nodeType = static_cast<uint8_t>(CNode::EType::Undefined);
+		uint8_t m_bucketCount = 0;
+		uint8_t m_regionDepth = 64;
+		CCoordinate m_regionMin;
+		CCoordinate m_point; // relative to the region for a leaf
+		uint64_t m_links[6] = {}; // children in quadrant order, overflow, pool next
+	};
+
+	// Counts an operation and, with latency histograms enabled, adds the time until it leaves scope to its histogram
+	class COperationScope
+	{
+	public:
+		COperationScope(CQuadTree& quadTree, CMetrics::EOperation operation);
+		~COperationScope();
+
+	private:
+		CQuadTree& m_quadTree;
+		CMetrics::EOperation m_operation;
+		bool m_timed;
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	// Counts a Find among the readers of the read epoch it began in until it leaves scope
+	class CReadScope
+	{
+	public:
+		explicit CReadScope(CQuadTree& quadTree);
+		~CReadScope();
+
+	private:
+		std::atomic<uint64_t>& m_readerCount;
+	};
+
+	// Hands out nodes from a chunk reserved from the pool, so that several threads can build disjoint subtrees at once
+	class CNodeReservation
+	{
+	public:
+		CNodeReservation(CQuadTree& quadTree, size_t chunkSize);
+
+		~CNodeReservation();
+
+		CNode* AllocateRegionNode(const CBounds& regionBounds);
+		bool CanAllocateNodes(size_t count) const;
+		void RetireNode(CNode* pNode) { m_retiredNodes.push_back(pNode); } // handed to the tree's retired nodes at the end
+
+	private:
+		CQuadTree& m_quadTree;
+		size_t m_chunkSize;
+		size_t m_remaining;
+		CNode* m_pNext;
+		std::vector<CNode*> m_retiredNodes;
 	};
 
+	template<typename TAllocator>
+	EInsertResult InsertAt(CNode* pRoot, const CCoordinate& point, TAllocator& allocator);
+	template<typename TAllocator>
+	size_t InsertSorted(CNode* pRoot, const CKeyedCoordinate* pEntries, size_t count, TAllocator& allocator);
+	CQuadTree(CQuadTreeForest* pForest, size_t pageSize, size_t inlineCapacity);
+	void SplitRoot();
+	void BuildInlineTree();
+	EInsertResult InsertInBatch(const CCoordinate& point);
+	size_t MergePoints(const CCoordinate* pPoints, size_t count);
+	size_t LoadSortedEntries(const std::vector<CKeyedCoordinate>& entries);
+	CNode* CopyBatchPath(const CCoordinate& point);
+	size_t CollectPath(CNode* pRoot, const CCoordinate& point, CNode** pPath) const;
+	void EraseOnPath(CNode** pPath, size_t pathLength, const CCoordinate& point);
+	void EraseFromBucket(CNode* pLeaf, const CCoordinate& point);
+	CNode* OwnNextBucketNode(CNode* pPrevious);
+	template<typename TAllocator>
+	void SplitBucketLeaf(CNode* pLeaf, const CCoordinate& point, TAllocator& allocator);
+	template<typename TAllocator>
+	void CondenseBlock(CNode* pRoot, const CNode* pNode, TAllocator& allocator);
+	void ExpandBitmapLeaf(CNode* pLeaf);
+	void ClearBatchGenerations_Recursive(CNode* pNode);
+	CNode* CloneNode(const CNode* pSource);
+	void RetireNode(CNode* pNode);
+	void ReclaimRetiredNodes();
+	void ReleaseFreeNodes();
+	bool CanReuseFreeNodes() const { return m_compactionHeadId == 0 && m_compactionScrubId == 0; }
 	void SanityCheckChild_Recursive(CNode* pChild) const;
-	void AllocatePage();
+	void AllocatePage(size_t nodeCount);
+	void AllocateNextPage();
+	void LinkPage(CPage* pPage);
+	CPage* CreatePage(size_t nodeCount);
+	static std::unique_ptr<CPage> BuildPage(size_t nodeCount);
+	std::unique_ptr<CPage> TakePage(size_t nodeCount);
+	void ReturnPage(std::unique_ptr<CPage> pPage);
+	CPage* AdoptPage(std::unique_ptr<CPage> pPage);
+	size_t NextPageSize() const;
+	size_t GrownPageSize(size_t previousPageSize) const;
+	static size_t GrownPageSize(size_t previousPageSize, size_t minPageSize, size_t growthFactor, size_t maxPageSize);
+	bool CanAllocateNodes(size_t count) const;
+	bool IsUnderMemoryPressure() const;
+	void NotifyMemoryPressure();
 	CNode* AllocateNode();
+	CNode* ReserveNodes(size_t count);
 	CNode* AllocateLeafNode(const CCoordinate& point, const CBounds& regionBounds);
 	CNode* AllocateRegionNode(const CBounds& regionBounds);
+	const CPage* PageOf(const CNode* pNode) const;
+	std::vector<uint64_t> PageSlotBases() const;
+	uint64_t PoolSlotLink(const CNode* pNode, const std::vector<uint64_t>& slotBases) const;
+	CCheckpointRecord CheckpointRecord(const CNode& node, uint64_t slot, const std::vector<uint64_t>& slotBases) const;
+	uint64_t NodeId(const CNode* pNode) const;
+	bool NodeFromId(uint64_t nodeId, CNode** ppNode) const;
+	CNode** FindNodeLink(const CNode* pNode, CNode** ppReferrer);
+	CNode* PreviousPoolNode(const CNode* pNode) const;
+	void ReleaseLastPage();
+	void RestartCompaction();
+	void CountAccessPath(CNode* pRoot, const CCoordinate& point);
+	void AdvanceStructureVersion() { m_structureVersion.fetch_add(1, std::memory_order_release); }
+	CLeafCacheSet& LeafCacheSet(const CCoordinate& point);
+	uint64_t AccessCount(const CNode* pNode) const;
+	void CollectAccessCounts_Recursive(const CNode* pNode, std::vector<uint64_t>& counts) const;
+	CNode* PlaceHotNode_Recursive(CNode* pNode, CNode* pSlot, uint64_t threshold, size_t* pRemaining);
+	CNode* SwapNodeSlots(CNode* pNode, CNode* pSlot);
 
 	//// QuadTree state
-	CNode* m_pTreeRoot;
+	static constexpr size_t kMaxPathLength = 65; // root plus one node per bit of TScalar
+	static constexpr size_t kMaxPageSize = 0xFFFFFFFF; // node ids hold the slot in 32 bits
+	std::atomic<CNode*> m_pTreeRoot; // last committed root, read by Find
+
+	//// batch state
+	CNode* m_pBatchRoot; // root of the uncommitted copy, null outside of batches
+	CNode* m_pBatchWatermark; // pool head when the batch began
+	uint32_t m_batchGeneration;
+	std::vector<CNode*> m_batchReplacedNodes; // unlinked by this batch, retired by Commit
+	std::vector<CNode*> m_batchReusedNodes; // taken from the free nodes by this batch, given back by Abort
+
+	//// reclamation state, nodes replaced by commits wait for the Finds that may still read them
+	std::atomic<uint64_t> m_readEpoch;
+	std::atomic<uint64_t> m_readerCounts[2] = {}; // Finds running, by the parity of the read epoch they began in
+	std::vector<CNode*> m_retiredNodes; // replaced during the current read epoch
+	std::vector<CNode*> m_waitingNodes; // replaced during the previous read epoch
+	std::vector<CNode*> m_freeNodes; // handed out before the pool head
 
 	//// allocator state
-	size_t m_pageSize;
+	size_t m_pageSize; // nodes in the first page, and the smallest page size
+	size_t m_pageGrowthFactor;
+	size_t m_maxPageSize;
 	CNode* m_pPoolHead; // head of the linked list of available nodes in the pool
 	CNode* m_pPoolRoot; // root node for the pool, allows for fast reset
-	typedef std::unique_ptr<CNode[]> TNodePage;
-	std::vector<TNodePage> m_pages;
+	std::vector<std::unique_ptr<CPage>> m_pages;
+	std::vector<const CPage*> m_pagesByAddress; // m_pages ordered by the address of their nodes, for PageOf
+	std::mutex m_poolMutex; // only taken by ReserveNodes, the single threaded paths allocate without it
+	std::atomic<size_t> m_poolBytes; // node bytes across m_pages, read by the ingest threads
+	size_t m_checkpointedPageCount; // pages the last checkpoint wrote or applied that the pool still holds
+	std::unique_ptr<CPageRefill> m_pPageRefill; // null unless page refill is enabled
+	CQuadTreeForest* m_pForest; // shares its page pool with the tree, null for a tree of its own
+
+	//// compaction state, kept as node ids as the fingers may point into pages that get released
+	uint64_t m_compactionFrontId; // slots before the front finger are live, 0 when no pass is under way
+	uint64_t m_compactionBackId; // slots after the back finger, up to the pool head, are dead
+	uint64_t m_compactionHeadId; // pool head when the pass started, the head only moves back if nothing was allocated since
+	uint64_t m_compactionScrubId; // next slot of the clearing walk once the fingers have crossed, 0 before
+
+	//// access profile state
+	uint32_t m_accessSampleInterval; // 0 when Find does not count node visits
+	std::atomic<uint64_t> m_accessSampleTick;
+	std::mutex m_accessCountMutex; // sampled Finds may run on several threads
+	std::unordered_map<const CNode*, uint64_t> m_accessCounts;
+
+	//// memory budget state
+	size_t m_memoryBudget; // 0 when unlimited
+	size_t m_memoryPressureBytes;
+	uint32_t m_degradationDepth; // 0 when leaves always split
+	std::function<void(size_t poolBytes, size_t budgetBytes)> m_memoryPressureCallback;
+
+	//// bucket state
+	static constexpr uint32_t kPackedLeafDepth = 32; // from this depth a bucket node packs two points or more
+
+	//// bitmap leaf state
+	static constexpr TScalar kBitmapLeafSpan = 8; // cells along each side of a bitmap leaf's block
+	size_t m_bitmapLeafThreshold; // 0 when blocks are never collapsed
+
+	//// inline state, the tree is inline while m_pTreeRoot is null
+	size_t m_inlineCapacity; // 0 when the tree is built from the start
+	std::vector<CCoordinate> m_inlinePoints;
+
+	//// leaf cache state
+	std::atomic<uint64_t> m_structureVersion; // advanced by every change to the structure, ingest threads split too
+	std::unique_ptr<uint8_t[]> m_pLeafCacheStorage;
+	CLeafCacheSet* m_pLeafCache; // line aligned within the storage, null when the cache is disabled
+	size_t m_leafCacheMask; // set count less one
+
+	//// write buffer state
+	size_t m_writeBufferThreshold; // 0 when the write buffer is disabled
+	std::vector<CCoordinate> m_writeBuffer;
+
+	CWorkloadRecorder* m_pRecorder;
+
+	//// metrics state, atomic as Find may run on several threads
+	bool m_latencyHistograms;
+	std::atomic<uint64_t> m_operationCounts[static_cast<size_t>(CMetrics::EOperation::Count)] = {};
+	std::atomic<uint64_t> m_latencyBuckets[CMetrics::kTimedOperationCount][CMetrics::kLatencyBucketCount] = {};
+	std::atomic<uint64_t> m_latencySumsNs[CMetrics::kTimedOperationCount] = {};
+};
+
+// Many independent trees, per tenant, layer or entity, drawing their node pages from one shared pool. Pages a tree
+// frees, by being destroyed, compacted or loading a full checkpoint, go back to the pool for the next tree to take
+// instead of to the heap. Trees are created, reset and destroyed in constant time apart from handing back a destroyed
+// tree's pages. A tree starts on a run of a 64th of the page size and doubles each run up to the page size, runs
+// smaller than a page are carved out of shared slabs, so a small tree holds a fraction of a page. Freed runs are kept
+// by size for the next tree that needs one. Only pages of the forest's page size are pooled, slabs are made from
+// pooled pages and are kept until the forest goes. The pool is locked, so different threads may each use their own
+// trees, but creating and destroying trees is not thread safe.
+class CQuadTreeForest
+{
+public:
+	typedef size_t TTreeId;
+
+	CQuadTreeForest(size_t pageSize, size_t inlineCapacity = 0); // passed on to every tree
+	~CQuadTreeForest();
+
+	TTreeId CreateTree(); // reuses the ids of destroyed trees
+	void DestroyTree(TTreeId treeId);
+	CQuadTree& GetTree(TTreeId treeId);
+	void ResetTree(TTreeId treeId) { GetTree(treeId).Reset(); }
+
+	size_t GetTreeCount() const { return m_trees.size() - m_freeTreeIds.size(); }
+	size_t GetPooledPageCount() const;
+	size_t GetPageCount() const; // pages of the page size, in trees, pooled or carved into slabs
+	size_t GetAllocatedBytes() const; // every tree plus the pooled pages
+	void ReleasePooledPages(); // hands the pooled pages back to the heap, slabs stay
+
+private:
+	friend class CQuadTree;
+
+	std::unique_ptr<CQuadTree::CPage> TakePage(); // null when the pool is empty
+	void ReturnPage(std::unique_ptr<CQuadTree::CPage> pPage);
+	std::unique_ptr<CQuadTree::CPage> TakeRun(size_t nodeCount);
+	void ReturnRun(std::unique_ptr<CQuadTree::CPage> pRun);
+	static void ClearNodes(CQuadTree::CNode* pNodes, size_t nodeCount);
+
+	const size_t m_pageSize;
+	const size_t m_runSize; // nodes in the first run of every tree
+	const size_t m_inlineCapacity;
+	mutable std::mutex m_poolMutex;
+	std::vector<std::unique_ptr<CQuadTree::CPage>> m_pooledPages;
+	std::vector<std::unique_ptr<CQuadTree::CNode[]>> m_slabs; // runs are carved out of the last one
+	size_t m_slabNodeCount; // nodes already carved out of the last slab
+	std::unordered_map<size_t, std::vector<CQuadTree::CNode*>> m_freeRuns; // by node count
+	std::vector<std::unique_ptr<CQuadTree>> m_trees; // null where a tree was destroyed
+	std::vector<TTreeId> m_freeTreeIds;
+};
+
+// A bitmap pyramid over a small universe of 2^bits by 2^bits cells, for grids dense enough that a node per point costs
+// far more than a bit per cell. Level l holds one occupancy bit for each of the 4^l quadrants at depth l in Z-order,
+// so the four children of a quadrant are one nibble of the level below and the last level is the cells themselves.
+// Find is a single bit test, Insert and Erase walk up only while a quadrant's occupancy changes, and range queries
+// skip empty quadrants and count or visit the quadrants wholly inside the range a word at a time.
+// The levels down to kBlockLevels are allocated up front. Deeper levels are split into 8 KB blocks, each holding the
+// bits below one quadrant kBlockLevels levels up, allocated when a point first falls in that quadrant and freed when
+// it empties. A full grid takes about 4^bits / 6 bytes, 700 MB at 16 bits, an empty one 700 KB of block pointers.
+class CDenseQuadTree
+{
+public:
+	explicit CDenseQuadTree(uint32_t bits); // at most 16
+
+	CQuadTree::EInsertResult Insert(const CQuadTree::CCoordinate& point);
+	CQuadTree::EFindResult Find(const CQuadTree::CCoordinate& point) const;
+	CQuadTree::EEraseResult Erase(const CQuadTree::CCoordinate& point);
+	void Reset(); // frees the blocks and clears the levels allocated up front
+
+	// Inclusive bounds, clamped to the universe
+	size_t CountInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max) const;
+	template<typename TFunction>
+	void ForEachPointInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max, TFunction function) const;
+	template<typename TFunction>
+	void ForEachPoint(TFunction function) const; // in Z-order
+
+	size_t GetPointCount() const { return m_pointCount; }
+	size_t GetAllocatedBytes() const;
+
+private:
+	static constexpr uint32_t kBlockLevels = 8; // a block holds 4^8 bits
+	static constexpr uint32_t kBlockWordBits = 2 * kBlockLevels - 6;
+
+	bool InUniverse(const CQuadTree::CCoordinate& point) const;
+	size_t BlockWordCount(uint32_t level) const;
+	bool TestBit(uint32_t level, uint64_t index) const;
+	uint64_t& Word(uint32_t level, uint64_t index); // allocates the block holding the bit
+	template<typename TFunction>
+	void ForEachCellWord(uint64_t begin, uint64_t end, TFunction function) const; // skips unallocated blocks
+	// Calls visitCells(begin, end) for each maximal quadrant inside [min, max] that has points, as a range of cells
+	template<typename TFunction>
+	void VisitRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max, TFunction& visitCells) const;
+	template<typename TFunction>
+	void VisitRange_Recursive(
+		uint32_t level,
+		uint64_t index,
+		const CQuadTree::CCoordinate& min,
+		const CQuadTree::CCoordinate& max,
+		TFunction& visitCells) const;
+
+	const uint32_t m_bits;
+	size_t m_pointCount;
+	std::vector<std::vector<std::unique_ptr<uint64_t[]>>> m_levels; // blocks of each level, m_levels[m_bits] is one bit per cell
+};
+
+// Records the operations applied to a CQuadTree as a compact binary trace for CWorkloadReplayer.
+// Each record is an operation byte followed, for point operations, by the zigzag varint delta from the previous point.
+class CWorkloadRecorder
+{
+public:
+	enum class EOperation : uint8_t
+	{
+		Insert,
+		Find,
+		Erase,
+		Reset,
+		BeginBatch,
+		Commit,
+		Abort,
+		Count
+	};
+
+	explicit CWorkloadRecorder(std::ostream& stream);
+	~CWorkloadRecorder();
+
+	void Record(EOperation operation);
+	void Record(EOperation operation, const CQuadTree::CCoordinate& point);
+	void Flush();
+
+private:
+	static constexpr size_t kFlushSize = 64 * 1024;
+
+	std::ostream& m_stream;
+	std::mutex m_mutex; // readers may Find from several threads
+	std::string m_buffer;
+	CQuadTree::CCoordinate m_previousPoint;
 };
 
 //////////////////////////////////////////////////////////////////////////////
 // SCoordiante
-CQuadTree::CCoordinate::CCoordinate()
+constexpr CQuadTree::CCoordinate::CCoordinate()
 	: x(TScalar{})
 	, y(TScalar{})
 {
 }
 
-CQuadTree::CCoordinate::CCoordinate(TScalar _x, TScalar _y)
+constexpr CQuadTree::CCoordinate::CCoordinate(TScalar _x, TScalar _y)
 	: x(_x)
 	, y(_y)
 {
 }
 
-inline bool CQuadTree::CCoordinate::operator==(const CCoordinate& rhs) const
+constexpr bool CQuadTree::CCoordinate::operator==(const CCoordinate& rhs) const
 {
 	return x == rhs.x && y == rhs.y;
 }
 
-inline bool CQuadTree::CCoordinate::operator!=(const CCoordinate& rhs) const
+constexpr bool CQuadTree::CCoordinate::operator!=(const CCoordinate& rhs) const
 {
 	return x != rhs.x || y != rhs.y;
 }
 
-inline CQuadTree::CCoordinate CQuadTree::CCoordinate::operator/(const CCoordinate& rhs) const
+constexpr CQuadTree::CCoordinate CQuadTree::CCoordinate::operator/(const CCoordinate& rhs) const
 {
 	return CCoordinate(x / rhs.x, y / rhs.y);
 }
 
-inline CQuadTree::CCoordinate CQuadTree::CCoordinate::operator+(const CCoordinate& rhs) const
+constexpr CQuadTree::CCoordinate CQuadTree::CCoordinate::operator+(const CCoordinate& rhs) const
 {
 	return CCoordinate(x + rhs.x, y + rhs.y);
 }
 
-inline CQuadTree::CCoordinate CQuadTree::CCoordinate::operator-(const CCoordinate& rhs) const
+constexpr CQuadTree::CCoordinate CQuadTree::CCoordinate::operator-(const CCoordinate& rhs) const
 {
 	return CCoordinate(x - rhs.x, y - rhs.y);
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// CBounds
-CQuadTree::CBounds::CBounds(const CCoordinate& _min, const CCoordinate& _max)
-	: min(_min)
-	, max(_max)
-{
-}
-
-inline bool CQuadTree::CBounds::Contains(const CCoordinate& point) const
-{
-	return point.x >= min.x && point.y >= min.y && point.x <= max.x && point.y <= max.y;
-}
-
-inline bool CQuadTree::CBounds::operator==(const CBounds& rhs) const
-{
-	return min == rhs.min && max == rhs.max;
-}
-
-inline bool CQuadTree::CBounds::operator!=(const CBounds& rhs) const
+constexpr CQuadTree::CCoordinate CQuadTree::SplitCenter(const CCoordinate& min, const CCoordinate& max)
 {
-	return min != rhs.min || max != rhs.max;
+	return min + ((max - min) / CCoordinate(2, 2));
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// CNode
-void CQuadTree::CNode::InitializeAsLeaf(const CCoordinate& _point, const CBounds& _regionBounds)
+// Utilities
+namespace
 {
-	m_point = _point;
-	m_regionBounds = _regionBounds;
-	m_nodeType = EType::Leaf;
-}
-
-void CQuadTree::CNode::InitializeAsRegion(const CBounds& _regionBounds)
-{
-	m_regionBounds = _regionBounds;
-	m_nodeType = EType::Region;
-	assert(m_point == CCoordinate());
-}
-
-CQuadTree::EFindResult CQuadTree::CNode::Find(const CCoordinate& point, CNode** pFoundNode)
-{
-	CNode* pCurrentNode = this;
-	while (pCurrentNode->m_pNorthWest != nullptr)
+	void WriteVarint(std::string& buffer, uint64_t value)
 	{
-		assert(pCurrentNode->m_pNorthEast && pCurrentNode->m_pSouthEast && pCurrentNode->m_pSouthWest);
-
-		if (pCurrentNode->m_pNorthWest->m_regionBounds.Contains(point))
+		while (value >= 0x80)
 		{
-			pCurrentNode = pCurrentNode->m_pNorthWest;
+			buffer.push_back(static_cast<char>((value & 0x7F) | 0x80));
+			value >>= 7;
 		}
-		else if (pCurrentNode->m_pNorthEast->m_regionBounds.Contains(point))
+
+		buffer.push_back(static_cast<char>(value));
+	}
+
+	// 128 bit varint, so a small Morton key delta costs as few bytes as a small 64 bit value
+	void WriteVarint128(std::string& buffer, uint64_t high, uint64_t low)
+	{
+		while (high != 0 || low >= 0x80)
 		{
-			pCurrentNode = pCurrentNode->m_pNorthEast;
+			buffer.push_back(static_cast<char>((low & 0x7F) | 0x80));
+			low = (low >> 7) | (high << 57);
+			high >>= 7;
 		}
-		else if (pCurrentNode->m_pSouthEast->m_regionBounds.Contains(point))
+
+		buffer.push_back(static_cast<char>(low));
+	}
+
+	bool ReadVarint128(const uint8_t*& pCursor, const uint8_t* pEnd, uint64_t* pHigh, uint64_t* pLow)
+	{
+		uint64_t high = 0;
+		uint64_t low = 0;
+		for (uint32_t shift = 0; shift < 128 && pCursor != pEnd; shift += 7)
 		{
-			pCurrentNode = pCurrentNode->m_pSouthEast;
+			const uint64_t bits = *pCursor & 0x7F;
+			if (shift < 64)
+			{
+				low |= bits << shift;
+				high |= shift > 57 ? bits >> (64 - shift) : 0;
+			}
+			else
+			{
+				high |= bits << (shift - 64);
+			}
+
+			if ((*pCursor++ & 0x80) == 0)
+			{
+				*pHigh = high;
+				*pLow = low;
+				return true;
+			}
 		}
-		else
+
+		return false;
+	}
+
+	bool ReadVarint(const uint8_t*& pCursor, const uint8_t* pEnd, uint64_t* pValue)
+	{
+		uint64_t value = 0;
+		for (uint32_t shift = 0; shift < 64 && pCursor != pEnd; shift += 7)
 		{
-			assert(pCurrentNode->m_pSouthWest->m_regionBounds.Contains(point));
-			pCurrentNode = pCurrentNode->m_pSouthWest;
+			const uint8_t byte = *pCursor++;
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+			{
+				*pValue = value;
+				return true;
+			}
 		}
+
+		return false;
 	}
 
-	*pFoundNode = pCurrentNode;
-	if (pCurrentNode->m_nodeType == EType::Region)
+	// Maps a wrapping difference to an unsigned value that is small when the difference is small in either direction
+	inline uint64_t ZigZagEncode(uint64_t delta)
 	{
-		return EFindResult::NoEntry;
+		return (delta << 1) ^ (0 - (delta >> 63));
 	}
 
-	assert(pCurrentNode->m_nodeType == EType::Leaf);
-	return pCurrentNode->m_point == point ? EFindResult::Success : EFindResult::NoEntry;
-}
-
-void CQuadTree::CNode::Split(CQuadTree& quadTree)
-{
-	assert(m_pNorthWest == nullptr);
-	assert(m_pNorthEast == nullptr);
-	assert(m_pSouthEast == nullptr);
-	assert(m_pSouthWest == nullptr);
-
-	// Create new four children entries, with the point being in the quadrant it is inside
-	const CCoordinate min = m_regionBounds.min;
-	const CCoordinate max = m_regionBounds.max;
-
-	CCoordinate centerMin = min + ((max - min) / CCoordinate(2, 2));
-	CCoordinate centerMax = centerMin + CCoordinate(1, 1);
+	inline uint64_t ZigZagDecode(uint64_t value)
+	{
+		return (value >> 1) ^ (0 - (value & 1));
+	}
 
-	CBounds northWestBounds(min, centerMin);
-	CBounds northEastBounds(CCoordinate(centerMax.x, min.y), CCoordinate(max.x, centerMin.y));
-	CBounds southEastBounds(centerMax, max);
-	CBounds southWestBounds(CCoordinate(min.x, centerMax.y), CCoordinate(centerMin.x, max.y));
+	bool ReadVarint(std::istream& stream, uint64_t* pValue)
+	{
+		uint64_t value = 0;
+		for (uint32_t shift = 0; shift < 64; shift += 7)
+		{
+			const int byte = stream.get();
+			if (byte == std::char_traits<char>::eof())
+			{
+				return false;
+			}
 
-	m_pNorthWest = quadTree.AllocateRegionNode(northWestBounds);
-	m_pNorthEast = quadTree.AllocateRegionNode(northEastBounds);
-	m_pSouthEast = quadTree.AllocateRegionNode(southEastBounds);
-	m_pSouthWest = quadTree.AllocateRegionNode(southWestBounds);
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+			{
+				*pValue = value;
+				return true;
+			}
+		}
 
-	assert(m_pNorthWest != nullptr);
-	assert(m_pNorthEast != nullptr);
-	assert(m_pSouthEast != nullptr);
-	assert(m_pSouthWest != nullptr);
+		return false;
+	}
 
-	m_nodeType = EType::Region;
-	m_point = CCoordinate();
-}
+	// Depth of the split that puts two distinct points into different quadrants
+	inline uint32_t SeparatingDepth(const CQuadTree::CCoordinate& lhs, const CQuadTree::CCoordinate& rhs)
+	{
+		assert(lhs != rhs);
+		uint32_t depth = 0;
+		for (uint64_t difference = (lhs.x ^ rhs.x) | (lhs.y ^ rhs.y); (difference & (1ull << 63)) == 0; difference <<= 1)
+		{
+			++depth;
+		}
 
-CQuadTree::CNode* CQuadTree::CNode::ContainingSubRegion(const CCoordinate& point)
-{
-	if (!m_regionBounds.Contains(point))
-		return nullptr;
+		return depth;
+	}
 
-	if (m_pNorthWest)
+	// Portable popcount, MSVC's __popcnt64 faults on CPUs without POPCNT
+	inline uint32_t CountBits64(uint64_t value)
 	{
-		assert(m_nodeType == EType::Region);
-		assert(m_pNorthEast != nullptr);
-		assert(m_pSouthEast != nullptr);
-		assert(m_pSouthWest != nullptr);
+		value = value - ((value >> 1) & 0x5555555555555555ull);
+		value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+		value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+		return static_cast<uint32_t>((value * 0x0101010101010101ull) >> 56);
+	}
 
-		if (m_pNorthWest->m_regionBounds.Contains(point))
-		{
-			return m_pNorthWest;
-		}
-		else if (m_pNorthEast->m_regionBounds.Contains(point))
-		{
-			return m_pNorthEast;
-		}
-		else if (m_pSouthEast->m_regionBounds.Contains(point))
+	// Linear scan for an exact match, compares a whole coordinate per 128 bit lane where SSE2 is available.
+	// Returns the index of the match, or count when there is none.
+	size_t FindCoordinate(const CQuadTree::CCoordinate* pPoints, size_t count, const CQuadTree::CCoordinate& point)
+	{
+		static_assert(sizeof(CQuadTree::CCoordinate) == 16, "CCoordinate is expected to be two packed 64 bit scalars");
+		size_t i = 0;
+#if QUADTREE_SSE2
+		const __m128i needle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&point));
+		for (; i + 4 <= count; i += 4)
 		{
-			return m_pSouthEast;
+			const __m128i* pBlock = reinterpret_cast<const __m128i*>(pPoints + i);
+			const int equal0 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(pBlock + 0), needle)) == 0xFFFF;
+			const int equal1 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(pBlock + 1), needle)) == 0xFFFF;
+			const int equal2 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(pBlock + 2), needle)) == 0xFFFF;
+			const int equal3 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(pBlock + 3), needle)) == 0xFFFF;
+			if (equal0 | equal1 | equal2 | equal3)
+			{
+				return i + (equal0 ? 0 : equal1 ? 1 : equal2 ? 2 : 3);
+			}
 		}
-		else
+#endif
+		for (; i < count; ++i)
 		{
-			assert(m_pSouthWest->m_regionBounds.Contains(point));
-			return m_pSouthWest;
+			if (pPoints[i] == point)
+			{
+				return i;
+			}
 		}
+
+		return count;
 	}
 
-	return nullptr;
-}
+	bool ContainsCoordinate(const CQuadTree::CCoordinate* pPoints, size_t count, const CQuadTree::CCoordinate& point)
+	{
+		return FindCoordinate(pPoints, count, point) != count;
+	}
+}
 
 //////////////////////////////////////////////////////////////////////////////
-// CQuadTree
-CQuadTree::CQuadTree::CQuadTree(size_t pageSize)
-	: m_pageSize(pageSize)
-	, m_pPoolHead(nullptr)
-	, m_pPoolRoot(nullptr)
+// CMortonKey
+namespace
 {
-	assert(pageSize > 0);
-	m_pages.reserve(8);
-	Reset();
+	// Spreads the low 32 bits of value into the even bit positions
+	inline uint64_t SpreadBits32(uint64_t value)
+	{
+		value &= 0x00000000FFFFFFFFull;
+		value = (value | (value << 16)) & 0x0000FFFF0000FFFFull;
+		value = (value | (value << 8)) & 0x00FF00FF00FF00FFull;
+		value = (value | (value << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		value = (value | (value << 2)) & 0x3333333333333333ull;
+		value = (value | (value << 1)) & 0x5555555555555555ull;
+		return value;
+	}
+
+	// Inverse of SpreadBits32, gathers the even bit positions into the low 32 bits
+	inline uint64_t CompactBits32(uint64_t value)
+	{
+		value &= 0x5555555555555555ull;
+		value = (value | (value >> 1)) & 0x3333333333333333ull;
+		value = (value | (value >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+		value = (value | (value >> 4)) & 0x00FF00FF00FF00FFull;
+		value = (value | (value >> 8)) & 0x0000FFFF0000FFFFull;
+		value = (value | (value >> 16)) & 0x00000000FFFFFFFFull;
+		return value;
+	}
 }
 
-CQuadTree::EInsertResult CQuadTree::Insert(const CCoordinate& point)
+CQuadTree::CMortonKey::CMortonKey()
+	: high(TScalar{})
+	, low(TScalar{})
 {
-	assert(m_pTreeRoot != nullptr);
+}
 
-	CNode* pFoundNode = nullptr;
-	assert(m_pTreeRoot->m_regionBounds.Contains(point));
-	EFindResult findResult = m_pTreeRoot->Find(point, &pFoundNode);
-	assert(pFoundNode != nullptr);
-	if (findResult == EFindResult::Success)
-	{
-		assert(pFoundNode->m_point == point);
-		return EInsertResult::DuplicateEntry;
-	}
-	else
-	{
-		if (pFoundNode->m_nodeType == CNode::EType::Leaf)
-		{
-			// We expect either an empty region or a leaf, neither of which should have children
-			assert(pFoundNode->m_pNorthWest == nullptr);
-			assert(pFoundNode->m_pNorthEast == nullptr);
-			assert(pFoundNode->m_pSouthEast == nullptr);
-			assert(pFoundNode->m_pSouthWest == nullptr);
+CQuadTree::CMortonKey::CMortonKey(TScalar _high, TScalar _low)
+	: high(_high)
+	, low(_low)
+{
+}
 
-			// Split recursively until point and pFoundNode->m_point are in different quandrants
-			CCoordinate existingPoint = pFoundNode->m_point;
-			CNode* pExistingSubRegion = pFoundNode;
-			CNode* pSubRegion = pFoundNode;
+inline CQuadTree::CMortonKey CQuadTree::CMortonKey::FromCoordinate(const CCoordinate& point)
+{
+	return CMortonKey(
+		SpreadBits32(point.x >> 32) | (SpreadBits32(point.y >> 32) << 1),
+		SpreadBits32(point.x) | (SpreadBits32(point.y) << 1));
+}
 
-			do
-			{
-				pSubRegion->Split(*this);
-				pExistingSubRegion = pSubRegion->ContainingSubRegion(existingPoint);
-				pSubRegion = pSubRegion->ContainingSubRegion(point);
-				assert(pExistingSubRegion != nullptr && pSubRegion != nullptr);
-			} while (pExistingSubRegion == pSubRegion);
+inline CQuadTree::CCoordinate CQuadTree::CMortonKey::ToCoordinate() const
+{
+	return CCoordinate(
+		(CompactBits32(high) << 32) | CompactBits32(low),
+		(CompactBits32(high >> 1) << 32) | CompactBits32(low >> 1));
+}
 
+// 0 = North West, 1 = North East, 2 = South West, 3 = South East, see CNode::QuadrantChild
+inline uint8_t CQuadTree::CMortonKey::TopLevelQuadrant() const
+{
+	return static_cast<uint8_t>(high >> 62);
+}
 
-			assert(pExistingSubRegion != nullptr);
-			pExistingSubRegion->m_nodeType = CNode::EType::Leaf;
-			pExistingSubRegion->m_point = existingPoint;
+inline bool CQuadTree::CMortonKey::operator==(const CMortonKey& rhs) const
+{
+	return high == rhs.high && low == rhs.low;
+}
 
-			assert(pSubRegion != nullptr);
-			pSubRegion->m_nodeType = CNode::EType::Leaf;
-			pSubRegion->m_point = point;
-		}
-		else
-		{
-			// If it isn't a leaf we expect a region with no children (null entry)
-			assert(pFoundNode->m_nodeType == CNode::EType::Region);
-			// Change to a leaf and set point
-			pFoundNode->m_nodeType = CNode::EType::Leaf;
-			pFoundNode->m_point = point;
-		}
-	}
+inline bool CQuadTree::CMortonKey::operator!=(const CMortonKey& rhs) const
+{
+	return high != rhs.high || low != rhs.low;
+}
 
-	return EInsertResult::Success;
+inline bool CQuadTree::CMortonKey::operator<(const CMortonKey& rhs) const
+{
+	return high < rhs.high || (high == rhs.high && low < rhs.low);
 }
 
-CQuadTree::EFindResult CQuadTree::Find(const CCoordinate& point)
+CQuadTree::CKeyedCoordinate::CKeyedCoordinate(const CCoordinate& _point)
+	: key(CMortonKey::FromCoordinate(_point))
+	, point(_point)
 {
-	assert(m_pTreeRoot != nullptr);
-	CNode* pFoundNode = nullptr;
-	assert(m_pTreeRoot->m_regionBounds.Contains(point));
-	return m_pTreeRoot->Find(point, &pFoundNode);
 }
 
-void CQuadTree::Reset()
+inline bool CQuadTree::CKeyedCoordinate::operator<(const CKeyedCoordinate& rhs) const
 {
-	m_pPoolHead = m_pPoolRoot;
-	constexpr TScalar minValue = std::numeric_limits<TScalar>::min();
-	constexpr TScalar maxValue = std::numeric_limits<TScalar>::max();
-	m_pTreeRoot = AllocateRegionNode(CBounds(CCoordinate(minValue, minValue), CCoordinate(maxValue, maxValue)));
+	return key < rhs.key;
 }
 
-void CQuadTree::SanityCheck() const
+//////////////////////////////////////////////////////////////////////////////
+// CBounds
+CQuadTree::CBounds::CBounds(const CCoordinate& _min, const CCoordinate& _max)
+	: min(_min)
+	, max(_max)
 {
-	SanityCheckChild_Recursive(m_pTreeRoot);
 }
 
-void CQuadTree::SanityCheckChild_Recursive(CNode* pChild) const
+inline bool CQuadTree::CBounds::Contains(const CCoordinate& point) const
 {
-	assert(pChild);
-	assert(pChild->m_regionBounds != CBounds(CCoordinate(), CCoordinate()));
-	assert(pChild->m_regionBounds.max.x >= pChild->m_regionBounds.min.x);
-	assert(pChild->m_regionBounds.max.y >= pChild->m_regionBounds.min.y);
-	assert(pChild->m_regionBounds.min.x <= pChild->m_regionBounds.max.x);
-	assert(pChild->m_regionBounds.min.y <= pChild->m_regionBounds.max.y);
-	switch (pChild->m_nodeType)
+	return point.x >= min.x && point.y >= min.y && point.x <= max.x && point.y <= max.y;
+}
+
+// A region Split can cut: a square whose side is a power of two, aligned to its side
+inline bool CQuadTree::CBounds::IsAlignedSquare() const
+{
+	const TScalar extent = max.x - min.x;
+	return max.x >= min.x && max.y >= min.y && max.y - min.y == extent && (extent & (extent + 1)) == 0 &&
+		(min.x & extent) == 0 && (min.y & extent) == 0;
+}
+
+// Regions are bit aligned, so a region at depth d spans 64 - d bits of x
+inline uint32_t CQuadTree::CBounds::Depth() const
+{
+	uint32_t depth = 64;
+	for (TScalar extent = max.x - min.x; extent != 0; extent >>= 1)
 	{
-	case CNode::EType::Leaf:
-		assert(pChild->m_pNorthWest == nullptr);
-		assert(pChild->m_pNorthEast == nullptr);
-		assert(pChild->m_pSouthEast == nullptr);
-		assert(pChild->m_pSouthWest == nullptr);
-		assert(pChild->m_regionBounds.Contains(pChild->m_point));
-		break;
-	case CNode::EType::Region:
-		assert(pChild->m_point == CCoordinate(0, 0));
-		if (pChild->m_pNorthWest)
-		{
-			assert(pChild->m_pNorthWest != nullptr);
-			assert(pChild->m_pNorthEast != nullptr);
-			assert(pChild->m_pSouthEast != nullptr);
-			assert(pChild->m_pSouthWest != nullptr);
+		--depth;
+	}
 
-			assert(pChild->m_regionBounds.Contains(pChild->m_pNorthWest->m_regionBounds.min));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pNorthWest->m_regionBounds.max));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pNorthEast->m_regionBounds.min));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pNorthEast->m_regionBounds.max));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pSouthEast->m_regionBounds.min));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pSouthEast->m_regionBounds.max));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pSouthWest->m_regionBounds.min));
-			assert(pChild->m_regionBounds.Contains(pChild->m_pSouthWest->m_regionBounds.max));
-
-			assert(pChild->m_pNorthWest->m_regionBounds.min.x < pChild->m_pNorthEast->m_regionBounds.min.x);
-			assert(pChild->m_pNorthWest->m_regionBounds.min.y == pChild->m_pNorthEast->m_regionBounds.min.y);
-			assert(pChild->m_pNorthWest->m_regionBounds.max.x < pChild->m_pNorthEast->m_regionBounds.min.x);
-			assert(pChild->m_pNorthWest->m_regionBounds.max.x < pChild->m_pNorthEast->m_regionBounds.max.x);
-			assert(pChild->m_pNorthWest->m_regionBounds.min.y < pChild->m_pNorthEast->m_regionBounds.max.y);
-			assert(pChild->m_pNorthWest->m_regionBounds.max.y == pChild->m_pNorthEast->m_regionBounds.max.y);
-
-			assert(pChild->m_pNorthEast->m_regionBounds.min.x == pChild->m_pSouthEast->m_regionBounds.min.x);
-			assert(pChild->m_pNorthEast->m_regionBounds.min.y < pChild->m_pSouthEast->m_regionBounds.min.y);
-			assert(pChild->m_pNorthEast->m_regionBounds.max.x > pChild->m_pSouthEast->m_regionBounds.min.x);
-			assert(pChild->m_pNorthEast->m_regionBounds.max.x == pChild->m_pSouthEast->m_regionBounds.max.x);
-			assert(pChild->m_pNorthEast->m_regionBounds.min.y < pChild->m_pSouthEast->m_regionBounds.max.y);
-			assert(pChild->m_pNorthEast->m_regionBounds.max.y < pChild->m_pSouthEast->m_regionBounds.max.y);
-
-			assert(pChild->m_pSouthEast->m_regionBounds.min.x > pChild->m_pSouthWest->m_regionBounds.min.x);
-			assert(pChild->m_pSouthEast->m_regionBounds.min.y == pChild->m_pSouthWest->m_regionBounds.min.y);
-			assert(pChild->m_pSouthEast->m_regionBounds.max.x > pChild->m_pSouthWest->m_regionBounds.min.x);
-			assert(pChild->m_pSouthEast->m_regionBounds.max.x > pChild->m_pSouthWest->m_regionBounds.max.x);
-			assert(pChild->m_pSouthEast->m_regionBounds.min.y < pChild->m_pSouthWest->m_regionBounds.max.y);
-			assert(pChild->m_pSouthEast->m_regionBounds.max.y == pChild->m_pSouthWest->m_regionBounds.max.y);
-
-			assert(pChild->m_pSouthWest->m_regionBounds.min.x == pChild->m_pNorthWest->m_regionBounds.min.x);
-			assert(pChild->m_pSouthWest->m_regionBounds.min.y > pChild->m_pNorthWest->m_regionBounds.min.y);
-			assert(pChild->m_pSouthWest->m_regionBounds.max.x > pChild->m_pNorthWest->m_regionBounds.min.x);
-			assert(pChild->m_pSouthWest->m_regionBounds.max.x == pChild->m_pNorthWest->m_regionBounds.max.x);
-			assert(pChild->m_pSouthWest->m_regionBounds.min.y > pChild->m_pNorthWest->m_regionBounds.max.y);
-			assert(pChild->m_pSouthWest->m_regionBounds.max.y > pChild->m_pNorthWest->m_regionBounds.max.y);
+	return depth;
+}
 
-			if (pChild->m_pNorthWest->m_nodeType == CNode::EType::Leaf)
-			{
-				assert(pChild->m_regionBounds.Contains(pChild->m_pNorthWest->m_point));
-			}
+inline bool CQuadTree::CBounds::operator==(const CBounds& rhs) const
+{
+	return min == rhs.min && max == rhs.max;
+}
 
-			SanityCheckChild_Recursive(pChild->m_pNorthWest);
+inline bool CQuadTree::CBounds::operator!=(const CBounds& rhs) const
+{
+	return min != rhs.min || max != rhs.max;
+}
 
-			if (pChild->m_pNorthEast->m_nodeType == CNode::EType::Leaf)
-			{
-				assert(pChild->m_regionBounds.Contains(pChild->m_pNorthEast->m_point));
-			}
+//////////////////////////////////////////////////////////////////////////////
+// CNode
+void CQuadTree::CNode::InitializeAsLeaf(const CCoordinate& _point, const CBounds& _regionBounds)
+{
+	m_point = _point;
+	SetRegionBounds(_regionBounds);
+	m_nodeType = EType::Leaf;
+}
 
-			SanityCheckChild_Recursive(pChild->m_pNorthEast);
+void CQuadTree::CNode::InitializeAsRegion(const CBounds& _regionBounds)
+{
+	SetRegionBounds(_regionBounds);
+	m_nodeType = EType::Region;
+	assert(m_point == CCoordinate());
+}
 
-			if (pChild->m_pSouthEast->m_nodeType == CNode::EType::Leaf)
-			{
-				assert(pChild->m_regionBounds.Contains(pChild->m_pSouthEast->m_point));
-			}
-			SanityCheckChild_Recursive(pChild->m_pSouthEast);
+CQuadTree::EFindResult CQuadTree::CNode::Find(const CCoordinate& point, CNode** pFoundNode)
+{
+	// Regions are aligned squares, so the quadrant at a depth is the point's bit below that depth on either axis. The
+	// depth is counted along the way rather than read, and the chosen child is requested as soon as the links arrive,
+	// both lines of its descent state at once, without waiting on the rest of the current node.
+	CNode* pCurrentNode = this;
+	for (uint32_t shift = 63u - m_regionDepth; pCurrentNode->m_pNorthWest != nullptr; --shift)
+	{
+		const uint8_t quadrant = static_cast<uint8_t>(((point.x >> shift) & 1u) | (((point.y >> shift) & 1u) << 1));
+		assert(quadrant == pCurrentNode->QuadrantContaining(point));
+		CNode* pChild = *pCurrentNode->QuadrantLink(quadrant);
+		PrefetchDescentState(pChild);
+		pCurrentNode = pChild;
+	}
 
-			if (pChild->m_pSouthWest->m_nodeType == CNode::EType::Leaf)
-			{
-				assert(pChild->m_regionBounds.Contains(pChild->m_pSouthWest->m_point));
-			}
+	assert(pCurrentNode->RegionBounds().Contains(point));
 
-			SanityCheckChild_Recursive(pChild->m_pSouthWest);
-		}
-		else
+	*pFoundNode = pCurrentNode;
+	if (pCurrentNode->m_nodeType == EType::Region)
+	{
+		return EFindResult::NoEntry;
+	}
+
+	if (pCurrentNode->m_nodeType == EType::Bitmap)
+	{
+		return (pCurrentNode->m_point.x & pCurrentNode->CellBit(point)) != 0 ? EFindResult::Success : EFindResult::NoEntry;
+	}
+
+	assert(pCurrentNode->m_nodeType == EType::Leaf);
+	if (pCurrentNode->m_point == point)
+	{
+		return EFindResult::Success;
+	}
+
+	for (const CNode* pOverflow = pCurrentNode->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+	{
+		if (pOverflow->FindBucketPoint(point) < pOverflow->m_bucketCount)
 		{
-			assert(pChild->m_pNorthWest == nullptr);
-			assert(pChild->m_pNorthEast == nullptr);
-			assert(pChild->m_pSouthEast == nullptr);
-			assert(pChild->m_pSouthWest == nullptr);
+			return EFindResult::Success;
 		}
-		break;
-	case CNode::EType::Undefined:
-		assert(false);
-		break;
-	default:
-		assert(false);
-		break;
 	}
+
+	return EFindResult::NoEntry;
 }
 
-void CQuadTree::AllocatePage()
+template<typename TAllocator>
+void CQuadTree::CNode::Split(TAllocator& allocator)
 {
-	assert(m_pageSize > 0);
-	m_pages.emplace_back(new CNode[m_pageSize]());
-	CNode* pPages = m_pages.back().get();
-	size_t lastIndex = m_pageSize - 1;
-	for (size_t i = 0; i < lastIndex; ++i)
+	assert(m_pNorthWest == nullptr);
+	assert(m_pNorthEast == nullptr);
+	assert(m_pSouthEast == nullptr);
+	assert(m_pSouthWest == nullptr);
+	assert(m_pOverflow == nullptr);
+
+	// Create new four children entries, with the point being in the quadrant it is inside
+	const CCoordinate min = m_regionMin;
+	const CCoordinate max = RegionBounds().max;
+
+	CCoordinate centerMin = SplitCenter(min, max);
+	CCoordinate centerMax = centerMin + CCoordinate(1, 1);
+
+	CBounds northWestBounds(min, centerMin);
+	CBounds northEastBounds(CCoordinate(centerMax.x, min.y), CCoordinate(max.x, centerMin.y));
+	CBounds southEastBounds(centerMax, max);
+	CBounds southWestBounds(CCoordinate(min.x, centerMax.y), CCoordinate(centerMin.x, max.y));
+
+	QUADTREE_PROBE2(split__entry, this, RegionDepth());
+	MarkDirty();
+	m_pNorthWest = allocator.AllocateRegionNode(northWestBounds);
+	m_pNorthEast = allocator.AllocateRegionNode(northEastBounds);
+	m_pSouthEast = allocator.AllocateRegionNode(southEastBounds);
+	m_pSouthWest = allocator.AllocateRegionNode(southWestBounds);
+
+	assert(m_pNorthWest != nullptr);
+	assert(m_pNorthEast != nullptr);
+	assert(m_pSouthEast != nullptr);
+	assert(m_pSouthWest != nullptr);
+
+	m_nodeType = EType::Region;
+	m_point = CCoordinate();
+	QUADTREE_PROBE2(split__return, this, RegionDepth());
+}
+
+CQuadTree::CNode* CQuadTree::CNode::ContainingSubRegion(const CCoordinate& point)
+{
+	if (!RegionBounds().Contains(point))
+		return nullptr;
+
+	if (m_pNorthWest)
 	{
-		CNode* pCurrentPage = &pPages[i];
-		pCurrentPage->pPoolNext = pCurrentPage + 1;
+		assert(m_nodeType == EType::Region);
+		return ChildContaining(point);
 	}
 
-	pPages[lastIndex].pPoolNext = nullptr;
+	return nullptr;
+}
 
-	if (m_pPoolRoot == nullptr)
+// Picks the child from this node's own region, as Split cut it, so a descent never reads the bounds of the children
+// it passes over
+inline CQuadTree::CNode* CQuadTree::CNode::ChildContaining(const CCoordinate& point) const
+{
+	assert(m_pNorthWest && m_pNorthEast && m_pSouthEast && m_pSouthWest && RegionBounds().Contains(point));
+	CNode* pChild = *QuadrantLink(QuadrantContaining(point));
+	assert(pChild->RegionBounds().Contains(point));
+	return pChild;
+}
+
+// 0 = North West, 1 = North East, 2 = South West, 3 = South East, as CMortonKey orders them. Computed from the two
+// comparisons rather than branched on, as on scattered lookups either branch is taken about half the time.
+inline uint8_t CQuadTree::CNode::QuadrantContaining(const CCoordinate& point) const
+{
+	const TScalar halfExtent = RegionExtent() >> 1;
+	const CCoordinate centerMin = m_regionMin + CCoordinate(halfExtent, halfExtent);
+	return static_cast<uint8_t>(static_cast<uint8_t>(point.x > centerMin.x) | (static_cast<uint8_t>(point.y > centerMin.y) << 1));
+}
+
+// Requests both cache lines a node's descent state can straddle, since nodes are not line aligned
+inline void CQuadTree::CNode::PrefetchDescentState(const CNode* pNode)
+{
+#if QUADTREE_SSE2
+	static constexpr size_t kDescentStateSize = offsetof(CNode, m_batchGeneration) + sizeof(uint32_t);
+	static_assert(offsetof(CNode, m_pNorthWest) == 0 && kDescentStateSize <= 64, "The descent state is expected to lead the node and fit in a cache line");
+	const char* pBytes = reinterpret_cast<const char*>(pNode);
+	_mm_prefetch(pBytes, _MM_HINT_T0);
+	_mm_prefetch(pBytes + kDescentStateSize - 1, _MM_HINT_T0);
+#else
+	(void)pNode;
+#endif
+}
+
+CQuadTree::CNode** CQuadTree::CNode::ContainingSubRegionLink(const CCoordinate& point)
+{
+	CNode* pSubRegion = ContainingSubRegion(point);
+	assert(pSubRegion != nullptr);
+	if (pSubRegion == m_pNorthWest)
 	{
-		assert(m_pPoolHead == nullptr);
-		m_pPoolRoot = m_pPoolHead = pPages;
+		return &m_pNorthWest;
+	}
+	else if (pSubRegion == m_pNorthEast)
+	{
+		return &m_pNorthEast;
 	}
-	else if (m_pPoolHead != nullptr)
+	else if (pSubRegion == m_pSouthEast)
 	{
-		m_pPoolHead->pPoolNext = pPages;
+		return &m_pSouthEast;
 	}
 	else
 	{
-		assert(m_pPoolHead != nullptr);
+		return &m_pSouthWest;
 	}
 }
 
-CQuadTree::CNode* CQuadTree::AllocateNode()
+inline CQuadTree::CBounds CQuadTree::CNode::RegionBounds() const
 {
-	if (m_pPoolHead == nullptr || m_pPoolHead->pPoolNext == nullptr)
-	{
-		AllocatePage();
-	}
+	const TScalar extent = RegionExtent();
+	return CBounds(m_regionMin, m_regionMin + CCoordinate(extent, extent));
+}
 
-	assert(m_pPoolHead != nullptr);
-	assert(m_pPoolHead->pPoolNext != nullptr);
-	CNode* pAllocatedNode = m_pPoolHead;
-	CNode* pPoolNext = pAllocatedNode->pPoolNext;
-	*pAllocatedNode = CNode();
-	pAllocatedNode->pPoolNext = pPoolNext;
-	m_pPoolHead = pPoolNext;
-	return pAllocatedNode;
+inline CQuadTree::TScalar CQuadTree::CNode::RegionExtent() const
+{
+	return m_regionDepth < 64 ? ~TScalar(0) >> m_regionDepth : 0;
 }
 
-CQuadTree::CNode* CQuadTree::AllocateLeafNode(const CCoordinate& point, const CBounds& regionBounds)
+inline void CQuadTree::CNode::SetRegionBounds(const CBounds& regionBounds)
 {
-	CNode* pLeafNode = AllocateNode();
-	assert(pLeafNode != nullptr);
-	pLeafNode->InitializeAsLeaf(point, regionBounds);
-	return pLeafNode;
+	assert(regionBounds.IsAlignedSquare());
+	m_regionMin = regionBounds.min;
+	m_regionDepth = static_cast<uint8_t>(regionBounds.Depth());
 }
 
-CQuadTree::CNode* CQuadTree::AllocateRegionNode(const CBounds& regionBounds)
+// Each node carries its own flag, as ingest threads mark the nodes of their subtrees while others share the page
+inline void CQuadTree::CNode::MarkDirty()
 {
-	CNode* pLeafNode = AllocateNode();
-	assert(pLeafNode != nullptr);
-	pLeafNode->InitializeAsRegion(regionBounds);
-	return pLeafNode;
+	m_dirty = true;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// main
-int main()
+// Clears the node state for a new allocation, the memory pool state stays with the slot
+inline void CQuadTree::CNode::ResetNodeState()
+{
+	CNode* pPoolNextSlot = pPoolNext;
+	*this = CNode();
+	pPoolNext = pPoolNextSlot;
+}
+
+inline void CQuadTree::CNode::CopyNodeState(const CNode& source)
 {
+	CNode* pPoolNextSlot = pPoolNext;
+	*this = source;
+	pPoolNext = pPoolNextSlot;
+	MarkDirty();
+}
+
+inline bool CQuadTree::CNode::HasChildren() const
+{
+	assert((m_pNorthWest == nullptr) == (m_pSouthEast == nullptr));
+	return m_pNorthWest != nullptr;
+}
+
+// Cells of a bitmap leaf are numbered row by row from the block's min corner
+inline uint64_t CQuadTree::CNode::CellBit(const CCoordinate& point) const
+{
+	assert(RegionBounds().Contains(point) && RegionExtent() == kBitmapLeafSpan - 1);
+	return 1ull << ((point.y - m_regionMin.y) * kBitmapLeafSpan + (point.x - m_regionMin.x));
+}
+
+inline CQuadTree::CCoordinate CQuadTree::CNode::CellPoint(uint32_t cell) const
+{
+	return m_regionMin + CCoordinate(cell % kBitmapLeafSpan, cell / kBitmapLeafSpan);
+}
+
+// The points of a bucket node share the bits of the region above its depth, so only the bits below are kept, as
+// offsets from the region's min. x offsets are packed side by side into m_point.x and y offsets into m_point.y,
+// BucketCapacity fields of BucketWidth bits each: one point at the top levels, two from depth 32 and 16 at depth 60.
+// A region's extent is the mask of a field.
+inline uint32_t CQuadTree::CNode::BucketWidth() const
+{
+	return CountBits64(RegionExtent());
+}
+
+inline uint32_t CQuadTree::CNode::BucketCapacity() const
+{
+	return 64 / BucketWidth();
+}
+
+inline CQuadTree::CCoordinate CQuadTree::CNode::BucketPoint(uint32_t index) const
+{
+	assert(m_nodeType == EType::Bucket && index < m_bucketCount);
+	const TScalar mask = RegionExtent();
+	const uint32_t shift = index * BucketWidth();
+	return m_regionMin + CCoordinate((m_point.x >> shift) & mask, (m_point.y >> shift) & mask);
+}
+
+inline void CQuadTree::CNode::SetBucketPoint(uint32_t index, const CCoordinate& point)
+{
+	assert(RegionBounds().Contains(point) && index < BucketCapacity());
+	const TScalar mask = RegionExtent();
+	const uint32_t shift = index * BucketWidth();
+	m_point.x = (m_point.x & ~(mask << shift)) | ((point.x - m_regionMin.x) << shift);
+	m_point.y = (m_point.y & ~(mask << shift)) | ((point.y - m_regionMin.y) << shift);
+}
+
+inline uint32_t CQuadTree::CNode::FindBucketPoint(const CCoordinate& point) const
+{
+	const TScalar mask = RegionExtent();
+	const TScalar offsetX = point.x - m_regionMin.x;
+	const TScalar offsetY = point.y - m_regionMin.y;
+	if (offsetX > mask || offsetY > mask)
+	{
+		return m_bucketCount;
+	}
+
+	const uint32_t width = BucketWidth();
+	uint32_t index = 0;
+	for (uint32_t shift = 0; index < m_bucketCount; ++index, shift += width)
+	{
+		if (((m_point.x >> shift) & mask) == offsetX && ((m_point.y >> shift) & mask) == offsetY)
+		{
+			break;
+		}
+	}
+
+	return index;
+}
+
+inline CQuadTree::CNode* CQuadTree::CNode::QuadrantChild(uint8_t quadrant) const
+{
+	assert(m_pNorthWest != nullptr);
+	return *QuadrantLink(quadrant);
+}
+
+// The child links are laid out in quadrant order, so a quadrant index addresses its link directly
+inline CQuadTree::CNode* const* CQuadTree::CNode::QuadrantLink(uint8_t quadrant) const
+{
+	static_assert(offsetof(CNode, m_pNorthEast) == offsetof(CNode, m_pNorthWest) + sizeof(CNode*)
+		&& offsetof(CNode, m_pSouthWest) == offsetof(CNode, m_pNorthWest) + 2 * sizeof(CNode*)
+		&& offsetof(CNode, m_pSouthEast) == offsetof(CNode, m_pNorthWest) + 3 * sizeof(CNode*), "Child links are expected in quadrant order");
+	assert(quadrant < 4);
+	return &m_pNorthWest + quadrant;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CMetrics
+void CQuadTree::CMetrics::WritePrometheus(std::ostream& stream) const
+{
+	static const char* const operationNames[] = { "insert", "find", "erase", "reset" };
+	static_assert(sizeof(operationNames) / sizeof(operationNames[0]) == static_cast<size_t>(EOperation::Count), "Missing operation name");
+
+	const struct
+	{
+		const char* name;
+		const char* help;
+		uint64_t value;
+	} gauges[] =
+	{
+		{ "prqt_points", "Points in the tree, including the write buffer", pointCount },
+		{ "prqt_overflow_points", "Points held in the buckets of deep or degraded leaves", overflowPointCount },
+		{ "prqt_nodes", "Nodes reachable from the committed root", nodeCount },
+		{ "prqt_pages", "Pages in the node pool", pageCount },
+		{ "prqt_free_nodes", "Nodes left in the pool before another page is allocated", freeNodeCount },
+		{ "prqt_allocated_bytes", "Bytes held by the node pool and the write buffer", allocatedBytes },
+		{ "prqt_max_depth", "Depth of the deepest leaf", maxDepth },
+	};
+
+	for (const auto& gauge : gauges)
+	{
+		stream << "# HELP " << gauge.name << ' ' << gauge.help << "\n# TYPE " << gauge.name << " gauge\n" << gauge.name << ' ' << gauge.value << '\n';
+	}
+
+	stream << "# HELP prqt_operations_total Operations applied to the tree\n# TYPE prqt_operations_total counter\n";
+	for (size_t operation = 0; operation < static_cast<size_t>(EOperation::Count); ++operation)
+	{
+		stream << "prqt_operations_total{operation=\"" << operationNames[operation] << "\"} " << operationCounts[operation] << '\n';
+	}
+
+	stream << "# HELP prqt_operation_latency_seconds Operation latency while histograms are enabled\n"
+		"# TYPE prqt_operation_latency_seconds histogram\n";
+	for (size_t operation = 0; operation < kTimedOperationCount; ++operation)
+	{
+		uint64_t cumulativeCount = 0;
+		for (size_t bucket = 0; bucket < kLatencyBucketCount; ++bucket)
+		{
+			cumulativeCount += latencyBuckets[operation][bucket];
+			stream << "prqt_operation_latency_seconds_bucket{operation=\"" << operationNames[operation] << "\",le=\"";
+			if (bucket + 1 < kLatencyBucketCount)
+			{
+				stream << static_cast<double>(1ull << (bucket + 4)) * 1e-9;
+			}
+			else
+			{
+				stream << "+Inf";
+			}
+
+			stream << "\"} " << cumulativeCount << '\n';
+		}
+
+		stream << "prqt_operation_latency_seconds_sum{operation=\"" << operationNames[operation] << "\"} "
+			<< static_cast<double>(latencySumsNs[operation]) * 1e-9 << '\n';
+		stream << "prqt_operation_latency_seconds_count{operation=\"" << operationNames[operation] << "\"} " << cumulativeCount << '\n';
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// COperationScope
+CQuadTree::COperationScope::COperationScope(CQuadTree& quadTree, CMetrics::EOperation operation)
+	: m_quadTree(quadTree)
+	, m_operation(operation)
+	, m_timed(quadTree.m_latencyHistograms && static_cast<size_t>(operation) < CMetrics::kTimedOperationCount)
+{
+	m_quadTree.m_operationCounts[static_cast<size_t>(m_operation)].fetch_add(1, std::memory_order_relaxed);
+	if (m_timed)
+	{
+		m_start = std::chrono::steady_clock::now();
+	}
+}
+
+CQuadTree::COperationScope::~COperationScope()
+{
+	if (!m_timed)
+	{
+		return;
+	}
+
+	const uint64_t latencyNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count());
+	size_t bucket = 0;
+	for (uint64_t scaled = latencyNs >> 4; scaled != 0 && bucket + 1 < CMetrics::kLatencyBucketCount; scaled >>= 1)
+	{
+		++bucket;
+	}
+
+	const size_t operation = static_cast<size_t>(m_operation);
+	m_quadTree.m_latencyBuckets[operation][bucket].fetch_add(1, std::memory_order_relaxed);
+	m_quadTree.m_latencySumsNs[operation].fetch_add(latencyNs, std::memory_order_relaxed);
+}
+
+// The count is raised before the Find reads the root, both sequentially consistent, so a reader missed by
+// ReclaimRetiredNodes reads a root committed after the nodes it frees were replaced
+CQuadTree::CReadScope::CReadScope(CQuadTree& quadTree)
+	: m_readerCount(quadTree.m_readerCounts[quadTree.m_readEpoch.load(std::memory_order_relaxed) & 1])
+{
+	m_readerCount.fetch_add(1);
+}
+
+CQuadTree::CReadScope::~CReadScope()
+{
+	m_readerCount.fetch_sub(1, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CLeafCacheSet
+CQuadTree::CNode* CQuadTree::CLeafCacheSet::Probe(const CCoordinate& point, uint64_t version) const
+{
+	const uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+	if ((sequence & 1) != 0 || m_version.load(std::memory_order_relaxed) != version)
+	{
+		return nullptr;
+	}
+
+	CNode* pNode = nullptr;
+	for (size_t way = 0; way < 2 && pNode == nullptr; ++way)
+	{
+		if (m_coordinates[2 * way].load(std::memory_order_relaxed) == point.x && m_coordinates[2 * way + 1].load(std::memory_order_relaxed) == point.y)
+		{
+			pNode = m_pNodes[way].load(std::memory_order_relaxed);
+		}
+	}
+
+	// A fill that began meanwhile may have torn what was read
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return m_sequence.load(std::memory_order_relaxed) == sequence ? pNode : nullptr;
+}
+
+void CQuadTree::CLeafCacheSet::Fill(const CCoordinate& point, CNode* pNode, uint64_t version)
+{
+	uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+	if ((sequence & 1) != 0 || !m_sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+	{
+		return;
+	}
+
+	std::atomic_thread_fence(std::memory_order_release);
+	if (m_version.load(std::memory_order_relaxed) == version)
+	{
+		m_coordinates[2].store(m_coordinates[0].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		m_coordinates[3].store(m_coordinates[1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		m_pNodes[1].store(m_pNodes[0].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	else
+	{
+		// The older way belongs to a previous structure
+		m_pNodes[1].store(nullptr, std::memory_order_relaxed);
+		m_version.store(version, std::memory_order_relaxed);
+	}
+
+	m_coordinates[0].store(point.x, std::memory_order_relaxed);
+	m_coordinates[1].store(point.y, std::memory_order_relaxed);
+	m_pNodes[0].store(pNode, std::memory_order_relaxed);
+	m_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CNodeReservation
+CQuadTree::CNodeReservation::CNodeReservation(CQuadTree& quadTree, size_t chunkSize)
+	: m_quadTree(quadTree)
+	, m_chunkSize(chunkSize)
+	, m_remaining(0)
+	, m_pNext(nullptr)
+{
+	assert(chunkSize > 0);
+}
+
+// Unused reserved nodes go back as free nodes, so a short run does not strand the rest of its chunk
+CQuadTree::CNodeReservation::~CNodeReservation()
+{
+	if (m_remaining == 0 && m_retiredNodes.empty())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_quadTree.m_poolMutex);
+	m_quadTree.m_retiredNodes.insert(m_quadTree.m_retiredNodes.end(), m_retiredNodes.begin(), m_retiredNodes.end());
+	for (; m_remaining > 0; --m_remaining)
+	{
+		m_quadTree.m_freeNodes.push_back(m_pNext);
+		m_pNext = m_pNext->pPoolNext;
+	}
+}
+
+CQuadTree::CNode* CQuadTree::CNodeReservation::AllocateRegionNode(const CBounds& regionBounds)
+{
+	if (m_remaining == 0)
+	{
+		m_pNext = m_quadTree.ReserveNodes(m_chunkSize);
+		m_remaining = m_chunkSize;
+	}
+
+	// Reserved nodes stay linked through pPoolNext, which keeps the pool chain intact for Reset
+	assert(m_pNext != nullptr);
+	CNode* pAllocatedNode = m_pNext;
+	pAllocatedNode->ResetNodeState();
+	pAllocatedNode->InitializeAsRegion(regionBounds);
+	m_pNext = pAllocatedNode->pPoolNext;
+	--m_remaining;
+	return pAllocatedNode;
+}
+
+bool CQuadTree::CNodeReservation::CanAllocateNodes(size_t count) const
+{
+	if (m_remaining >= count || m_quadTree.m_memoryBudget == 0)
+	{
+		return true;
+	}
+
+	const size_t chunkCount = (count - m_remaining + m_chunkSize - 1) / m_chunkSize;
+	std::lock_guard<std::mutex> lock(m_quadTree.m_poolMutex);
+	return m_quadTree.CanAllocateNodes(chunkCount * m_chunkSize);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CQuadTree
+CQuadTree::CQuadTree::CQuadTree(size_t pageSize, size_t inlineCapacity)
+	: CQuadTree(nullptr, pageSize, inlineCapacity)
+{
+}
+
+CQuadTree::CQuadTree(CQuadTreeForest* pForest, size_t pageSize, size_t inlineCapacity)
+	: m_pTreeRoot(nullptr)
+	, m_pBatchRoot(nullptr)
+	, m_pBatchWatermark(nullptr)
+	, m_batchGeneration(0)
+	, m_readEpoch(0)
+	, m_pageSize(pageSize)
+	, m_pageGrowthFactor(1)
+	, m_maxPageSize(pageSize)
+	, m_pPoolHead(nullptr)
+	, m_pPoolRoot(nullptr)
+	, m_poolBytes(0)
+	, m_checkpointedPageCount(0)
+	, m_pForest(pForest)
+	, m_compactionFrontId(0)
+	, m_compactionBackId(0)
+	, m_compactionHeadId(0)
+	, m_compactionScrubId(0)
+	, m_accessSampleInterval(0)
+	, m_accessSampleTick(0)
+	, m_memoryBudget(0)
+	, m_memoryPressureBytes(0)
+	, m_degradationDepth(0)
+	, m_bitmapLeafThreshold(0)
+	, m_inlineCapacity(inlineCapacity)
+	, m_structureVersion(1)
+	, m_pLeafCache(nullptr)
+	, m_leafCacheMask(0)
+	, m_writeBufferThreshold(0)
+	, m_pRecorder(nullptr)
+	, m_latencyHistograms(false)
+{
+	assert(pageSize > 0 && pageSize <= kMaxPageSize);
+	m_pages.reserve(8);
+	Reset();
+}
+
+CQuadTree::EInsertResult CQuadTree::Insert(const CCoordinate& point)
+{
+	COperationScope operationScope(*this, CMetrics::EOperation::Insert);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::Insert, point);
+	}
+
+	if (m_pTreeRoot.load(std::memory_order_relaxed) == nullptr)
+	{
+		if (ContainsCoordinate(m_inlinePoints.data(), m_inlinePoints.size(), point))
+		{
+			return EInsertResult::DuplicateEntry;
+		}
+
+		if (m_inlinePoints.size() < m_inlineCapacity)
+		{
+			m_inlinePoints.push_back(point);
+			return EInsertResult::Success;
+		}
+
+		BuildInlineTree();
+	}
+
+	if (m_pBatchRoot != nullptr)
+	{
+		return InsertInBatch(point);
+	}
+
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+	if (m_writeBufferThreshold > 0 && !IsUnderMemoryPressure())
+	{
+		CNode* pFoundNode = nullptr;
+		if (ContainsCoordinate(m_writeBuffer.data(), m_writeBuffer.size(), point) || pTreeRoot->Find(point, &pFoundNode) == EFindResult::Success)
+		{
+			return EInsertResult::DuplicateEntry;
+		}
+
+		m_writeBuffer.push_back(point);
+		if (m_writeBuffer.size() >= m_writeBufferThreshold)
+		{
+			FlushWriteBuffer();
+		}
+
+		return EInsertResult::Success;
+	}
+
+	FlushWriteBuffer();
+	return InsertAt(pTreeRoot, point, *this);
+}
+
+size_t CQuadTree::InsertBatch(const CCoordinate* pPoints, size_t count)
+{
+	assert(pPoints != nullptr || count == 0);
+	m_operationCounts[static_cast<size_t>(CMetrics::EOperation::Insert)].fetch_add(count, std::memory_order_relaxed);
+	if (m_pRecorder != nullptr)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			m_pRecorder->Record(CWorkloadRecorder::EOperation::Insert, pPoints[i]);
+		}
+	}
+
+	if (m_pTreeRoot.load(std::memory_order_relaxed) == nullptr)
+	{
+		if (m_inlinePoints.size() + count > m_inlineCapacity)
+		{
+			BuildInlineTree();
+		}
+		else
+		{
+			size_t insertedCount = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (!ContainsCoordinate(m_inlinePoints.data(), m_inlinePoints.size(), pPoints[i]))
+				{
+					m_inlinePoints.push_back(pPoints[i]);
+					++insertedCount;
+				}
+			}
+
+			return insertedCount;
+		}
+	}
+
+	// Buffered points go first, so none of them is merged after the batch inserted it too
+	FlushWriteBuffer();
+	return MergePoints(pPoints, count);
+}
+
+// Inserting in Z-order keeps consecutive descents on the same path, so the upper levels stay in cache
+size_t CQuadTree::MergePoints(const CCoordinate* pPoints, size_t count)
+{
+	std::vector<CKeyedCoordinate> entries;
+	entries.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		entries.emplace_back(pPoints[i]);
+	}
+
+	std::sort(entries.begin(), entries.end());
+	if (m_pBatchRoot != nullptr)
+	{
+		size_t insertedCount = 0;
+		for (const CKeyedCoordinate& entry : entries)
+		{
+			insertedCount += InsertInBatch(entry.point) == EInsertResult::Success ? 1 : 0;
+		}
+
+		return insertedCount;
+	}
+
+	return InsertSorted(m_pTreeRoot.load(std::memory_order_relaxed), entries.data(), entries.size(), *this);
+}
+
+template<typename TAllocator>
+CQuadTree::EInsertResult CQuadTree::InsertAt(CNode* pRoot, const CCoordinate& point, TAllocator& allocator)
+{
+	assert(pRoot != nullptr);
+	QUADTREE_PROBE2(insert__entry, point.x, point.y);
+
+	CNode* pFoundNode = nullptr;
+	assert(pRoot->RegionBounds().Contains(point));
+	EFindResult findResult = pRoot->Find(point, &pFoundNode);
+	assert(pFoundNode != nullptr);
+	if (findResult == EFindResult::Success)
+	{
+		assert(pFoundNode->m_nodeType == CNode::EType::Bitmap || pFoundNode->m_pOverflow != nullptr || pFoundNode->m_point == point);
+		QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::DuplicateEntry), pFoundNode->RegionDepth(), 0);
+		return EInsertResult::DuplicateEntry;
+	}
+	else
+	{
+		if (pFoundNode->m_nodeType == CNode::EType::Bitmap)
+		{
+			pFoundNode->m_point.x |= pFoundNode->CellBit(point);
+			pFoundNode->MarkDirty();
+			QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::Success), pFoundNode->RegionDepth(), 0);
+		}
+		else if (pFoundNode->m_nodeType == CNode::EType::Leaf)
+		{
+			// We expect either an empty region or a leaf, neither of which should have children
+			assert(pFoundNode->m_pNorthWest == nullptr);
+			assert(pFoundNode->m_pNorthEast == nullptr);
+			assert(pFoundNode->m_pSouthEast == nullptr);
+			assert(pFoundNode->m_pSouthWest == nullptr);
+
+			// A leaf deep enough for a bucket node to pack two points keeps further points in its bucket rather than
+			// split, and splits once the front bucket node cannot take the point. Under memory pressure no split goes
+			// below the degradation depth, the bucket gains a node instead.
+			const uint32_t leafDepth = pFoundNode->RegionDepth();
+			const CNode* pFront = pFoundNode->m_pOverflow;
+			bool useBucket = pFront != nullptr || leafDepth >= kPackedLeafDepth;
+			bool splitBucket = pFront != nullptr &&
+				(pFront->m_bucketCount == pFront->BucketCapacity() || !pFront->RegionBounds().Contains(point)) &&
+				!(m_degradationDepth > 0 && leafDepth >= m_degradationDepth && IsUnderMemoryPressure());
+			uint32_t splitCount = 0; // only counted against a memory budget
+			if (m_memoryBudget != 0)
+			{
+				if (splitBucket)
+				{
+					// A split takes four nodes and at most a bucket node per point, without room the bucket grows instead
+					size_t pointCount = 2;
+					for (const CNode* pOverflow = pFront; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+					{
+						pointCount += pOverflow->m_bucketCount;
+					}
+
+					splitBucket = allocator.CanAllocateNodes(4 + pointCount);
+				}
+
+				if (!useBucket)
+				{
+					splitCount = SeparatingDepth(pFoundNode->m_point, point) - leafDepth + 1;
+					if (m_degradationDepth > 0 && leafDepth + splitCount > m_degradationDepth && IsUnderMemoryPressure())
+					{
+						// Split no deeper than the degradation depth, the two points then share a leaf there
+						splitCount = leafDepth < m_degradationDepth ? m_degradationDepth - leafDepth : 0;
+						useBucket = true;
+					}
+				}
+
+				if (!splitBucket && !allocator.CanAllocateNodes(4 * splitCount + (useBucket ? 1 : 0)))
+				{
+					NotifyMemoryPressure();
+					QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::OutOfMemory), leafDepth, 0);
+					return EInsertResult::OutOfMemory;
+				}
+			}
+
+			// The leaf gains children, unless a bucket takes the point without splitting
+			if (!useBucket || splitCount != 0 || splitBucket)
+			{
+				AdvanceStructureVersion();
+			}
+
+			if (splitBucket)
+			{
+				SplitBucketLeaf(pFoundNode, point, allocator);
+				QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::Success), leafDepth + 1, 1);
+				CondenseBlock(pRoot, pFoundNode, allocator);
+				return EInsertResult::Success;
+			}
+
+			if (useBucket)
+			{
+				const CCoordinate existingPoint = pFoundNode->m_point;
+				CNode* pLeaf = pFoundNode;
+				for (uint32_t i = 0; i < splitCount; ++i)
+				{
+					pLeaf->Split(allocator);
+					pLeaf = pLeaf->ContainingSubRegion(point);
+					assert(pLeaf != nullptr && pLeaf->RegionBounds().Contains(existingPoint));
+				}
+
+				pLeaf->m_nodeType = CNode::EType::Leaf;
+				pLeaf->m_point = existingPoint;
+
+				// The point joins the front bucket node while it has room. New bucket nodes go in front, and within
+				// a batch only a node of this batch takes more points, so a batch never modifies bucket nodes the
+				// committed tree shares.
+				CNode* pOverflow = pLeaf->m_pOverflow;
+				if (pOverflow != nullptr && pOverflow->m_bucketCount < pOverflow->BucketCapacity() && pOverflow->RegionBounds().Contains(point) &&
+					(m_pBatchRoot == nullptr || pOverflow->m_batchGeneration == m_batchGeneration))
+				{
+					pOverflow->SetBucketPoint(pOverflow->m_bucketCount++, point);
+					pOverflow->MarkDirty();
+				}
+				else
+				{
+					pOverflow = allocator.AllocateRegionNode(pLeaf->RegionBounds());
+					pOverflow->m_nodeType = CNode::EType::Bucket;
+					pOverflow->SetBucketPoint(0, point);
+					pOverflow->m_bucketCount = 1;
+					pOverflow->m_pOverflow = pLeaf->m_pOverflow;
+					pLeaf->m_pOverflow = pOverflow;
+					pLeaf->MarkDirty();
+				}
+
+				QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::Success), pLeaf->RegionDepth(), splitCount);
+				CondenseBlock(pRoot, pLeaf, allocator);
+				return EInsertResult::Success;
+			}
+
+			// Split recursively until point and pFoundNode->m_point are in different quandrants
+			CCoordinate existingPoint = pFoundNode->m_point;
+			CNode* pExistingSubRegion = pFoundNode;
+			CNode* pSubRegion = pFoundNode;
+
+			do
+			{
+				pSubRegion->Split(allocator);
+				pExistingSubRegion = pSubRegion->ContainingSubRegion(existingPoint);
+				pSubRegion = pSubRegion->ContainingSubRegion(point);
+				assert(pExistingSubRegion != nullptr && pSubRegion != nullptr);
+			} while (pExistingSubRegion == pSubRegion);
+
+
+			assert(pExistingSubRegion != nullptr);
+			pExistingSubRegion->m_nodeType = CNode::EType::Leaf;
+			pExistingSubRegion->m_point = existingPoint;
+
+			assert(pSubRegion != nullptr);
+			pSubRegion->m_nodeType = CNode::EType::Leaf;
+			pSubRegion->m_point = point;
+
+			pExistingSubRegion->MarkDirty();
+			pSubRegion->MarkDirty();
+			QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::Success), pSubRegion->RegionDepth(),
+				pSubRegion->RegionDepth() - pFoundNode->RegionDepth());
+			CondenseBlock(pRoot, pSubRegion, allocator);
+		}
+		else
+		{
+			// If it isn't a leaf we expect a region with no children (null entry)
+			assert(pFoundNode->m_nodeType == CNode::EType::Region);
+			// Change to a leaf and set point
+			pFoundNode->m_nodeType = CNode::EType::Leaf;
+			pFoundNode->m_point = point;
+			pFoundNode->MarkDirty();
+			QUADTREE_PROBE5(insert__return, point.x, point.y, static_cast<int>(EInsertResult::Success), pFoundNode->RegionDepth(), 0);
+			CondenseBlock(pRoot, pFoundNode, allocator);
+		}
+	}
+
+	return EInsertResult::Success;
+}
+
+template<typename TAllocator>
+size_t CQuadTree::InsertSorted(CNode* pRoot, const CKeyedCoordinate* pEntries, size_t count, TAllocator& allocator)
+{
+	size_t insertedCount = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (InsertAt(pRoot, pEntries[i].point, allocator) == EInsertResult::Success)
+		{
+			++insertedCount;
+		}
+	}
+
+	return insertedCount;
+}
+
+CQuadTree::EFindResult CQuadTree::Find(const CCoordinate& point)
+{
+	CReadScope readScope(*this);
+	// The version is read before the root, so a Find that descends a replaced root never files its leaf under the
+	// version of the commit that replaced it
+	const uint64_t version = m_pLeafCache != nullptr ? m_structureVersion.load(std::memory_order_acquire) : 0;
+	CNode* pTreeRoot = m_pTreeRoot.load();
+	COperationScope operationScope(*this, CMetrics::EOperation::Find);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::Find, point);
+	}
+
+	QUADTREE_PROBE2(find__entry, point.x, point.y);
+	if (pTreeRoot == nullptr)
+	{
+		const EFindResult findResult = ContainsCoordinate(m_inlinePoints.data(), m_inlinePoints.size(), point) ? EFindResult::Success : EFindResult::NoEntry;
+		QUADTREE_PROBE4(find__return, point.x, point.y, static_cast<int>(findResult), 0);
+		return findResult;
+	}
+	if (!m_writeBuffer.empty() && ContainsCoordinate(m_writeBuffer.data(), m_writeBuffer.size(), point))
+	{
+		// Depth 0, the point was still in the write buffer
+		QUADTREE_PROBE4(find__return, point.x, point.y, static_cast<int>(EFindResult::Success), 0);
+		return EFindResult::Success;
+	}
+
+	CNode* pFoundNode = nullptr;
+	assert(pTreeRoot->RegionBounds().Contains(point));
+	// A cache hit skips the descent but is counted as if it had taken it
+	if (m_accessSampleInterval != 0 && m_accessSampleTick.fetch_add(1, std::memory_order_relaxed) % m_accessSampleInterval == 0)
+	{
+		CountAccessPath(pTreeRoot, point);
+	}
+
+	CLeafCacheSet* pCacheSet = m_pLeafCache != nullptr ? &LeafCacheSet(point) : nullptr;
+	if (pCacheSet != nullptr)
+	{
+		CNode* pCachedNode = pCacheSet->Probe(point, version);
+		if (pCachedNode != nullptr)
+		{
+			// The cached node is still the leaf holding the point, only its points may have changed since
+			const EFindResult findResult = pCachedNode->Find(point, &pFoundNode);
+			QUADTREE_PROBE4(find__return, point.x, point.y, static_cast<int>(findResult), pFoundNode->RegionDepth());
+			return findResult;
+		}
+	}
+
+	const EFindResult findResult = pTreeRoot->Find(point, &pFoundNode);
+	if (pCacheSet != nullptr)
+	{
+		pCacheSet->Fill(point, pFoundNode, version);
+	}
+
+	QUADTREE_PROBE4(find__return, point.x, point.y, static_cast<int>(findResult), pFoundNode->RegionDepth());
+	return findResult;
+}
+
+CQuadTree::EEraseResult CQuadTree::Erase(const CCoordinate& point)
+{
+	CNode* pRoot = m_pBatchRoot != nullptr ? m_pBatchRoot : m_pTreeRoot.load(std::memory_order_relaxed);
+	COperationScope operationScope(*this, CMetrics::EOperation::Erase);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::Erase, point);
+	}
+
+	if (pRoot == nullptr)
+	{
+		const size_t index = FindCoordinate(m_inlinePoints.data(), m_inlinePoints.size(), point);
+		if (index == m_inlinePoints.size())
+		{
+			return EEraseResult::NoEntry;
+		}
+
+		m_inlinePoints[index] = m_inlinePoints.back();
+		m_inlinePoints.pop_back();
+		return EEraseResult::Success;
+	}
+
+	assert(pRoot->RegionBounds().Contains(point));
+
+	bool erased = false;
+	for (size_t i = 0; i < m_writeBuffer.size(); ++i)
+	{
+		if (m_writeBuffer[i] == point)
+		{
+			m_writeBuffer[i] = m_writeBuffer.back();
+			m_writeBuffer.pop_back();
+			erased = true;
+			break;
+		}
+	}
+
+	CNode* pFoundNode = nullptr;
+	if (pRoot->Find(point, &pFoundNode) == EFindResult::Success)
+	{
+		if (m_pBatchRoot != nullptr)
+		{
+			CopyBatchPath(point);
+			pRoot = m_pBatchRoot;
+		}
+
+		CNode* path[kMaxPathLength];
+		const size_t pathLength = CollectPath(pRoot, point, path);
+		EraseOnPath(path, pathLength, point);
+		erased = true;
+	}
+
+	return erased ? EEraseResult::Success : EEraseResult::NoEntry;
+}
+
+void CQuadTree::BeginBatch()
+{
+	assert(m_pBatchRoot == nullptr);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::BeginBatch);
+	}
+
+	BuildInlineTree();
+	FlushWriteBuffer();
+
+	if (++m_batchGeneration == 0)
+	{
+		// The generation wrapped, clear the stamps so no committed node is mistaken for one from this batch
+		ClearBatchGenerations_Recursive(m_pTreeRoot.load(std::memory_order_relaxed));
+		m_batchGeneration = 1;
+	}
+
+	ReclaimRetiredNodes();
+	m_pBatchWatermark = m_pPoolHead;
+	m_pBatchRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+}
+
+void CQuadTree::Commit()
+{
+	assert(m_pBatchRoot != nullptr);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::Commit);
+	}
+
+	m_pTreeRoot.store(m_pBatchRoot);
+	m_pBatchRoot = nullptr;
+	m_pBatchWatermark = nullptr;
+	AdvanceStructureVersion(); // the committed tree's copied nodes replace the ones cached
+	m_retiredNodes.insert(m_retiredNodes.end(), m_batchReplacedNodes.begin(), m_batchReplacedNodes.end());
+	m_batchReplacedNodes.clear();
+	m_batchReusedNodes.clear();
+	ReclaimRetiredNodes();
+}
+
+void CQuadTree::Abort()
+{
+	assert(m_pBatchRoot != nullptr);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::Abort);
+	}
+
+	// Every node the batch allocated lies after the watermark or was free, nothing committed can reference them
+	m_pPoolHead = m_pBatchWatermark;
+	m_pBatchRoot = nullptr;
+	m_pBatchWatermark = nullptr;
+	m_freeNodes.insert(m_freeNodes.end(), m_batchReusedNodes.begin(), m_batchReusedNodes.end());
+	m_batchReplacedNodes.clear();
+	m_batchReusedNodes.clear();
+	RestartCompaction();
+}
+
+CQuadTree::EInsertResult CQuadTree::InsertInBatch(const CCoordinate& point)
+{
+	assert(m_pBatchRoot != nullptr);
+	CNode* pFoundNode = nullptr;
+	assert(m_pBatchRoot->RegionBounds().Contains(point));
+	if (m_pBatchRoot->Find(point, &pFoundNode) == EFindResult::Success)
+	{
+		return EInsertResult::DuplicateEntry;
+	}
+
+	// The copied path is allocated before InsertAt checks the budget for its own nodes
+	if (m_memoryBudget != 0 && !CanAllocateNodes(kMaxPathLength))
+	{
+		NotifyMemoryPressure();
+		return EInsertResult::OutOfMemory;
+	}
+
+	// Only the copied path and the nodes split off below it are modified, both belong to this batch
+	CNode* pPathEnd = CopyBatchPath(point);
+	const EInsertResult insertResult = InsertAt(pPathEnd, point, *this);
+	if (insertResult == EInsertResult::Success)
+	{
+		// InsertAt only reaches the blocks below where it started, the rest of the path up to the block is copied too
+		CondenseBlock(m_pBatchRoot, pPathEnd, *this);
+	}
+
+	return insertResult;
+}
+
+// Copies every node on the path to point that predates this batch, returns the last node of the path
+CQuadTree::CNode* CQuadTree::CopyBatchPath(const CCoordinate& point)
+{
+	assert(m_pBatchRoot != nullptr);
+	CNode** ppLink = &m_pBatchRoot;
+	for (;;)
+	{
+		CNode* pNode = *ppLink;
+		if (pNode->m_batchGeneration != m_batchGeneration)
+		{
+			// The parent is already a copy belonging to this batch, so its page was marked dirty when it was copied
+			m_batchReplacedNodes.push_back(pNode);
+			pNode = CloneNode(pNode);
+			*ppLink = pNode;
+		}
+
+		if (!pNode->HasChildren())
+		{
+			return pNode;
+		}
+
+		ppLink = pNode->ContainingSubRegionLink(point);
+	}
+}
+
+size_t CQuadTree::CollectPath(CNode* pRoot, const CCoordinate& point, CNode** pPath) const
+{
+	size_t pathLength = 0;
+	for (CNode* pNode = pRoot; pNode != nullptr; pNode = pNode->ContainingSubRegion(point))
+	{
+		assert(pathLength < kMaxPathLength);
+		pPath[pathLength++] = pNode;
+	}
+
+	return pathLength;
+}
+
+// Empties the leaf at the end of the path, then merges back up any region left holding a single point
+void CQuadTree::EraseOnPath(CNode** pPath, size_t pathLength, const CCoordinate& point)
+{
+	assert(pathLength > 0);
+	CNode* pLeaf = pPath[pathLength - 1];
+	if (pLeaf->m_nodeType == CNode::EType::Bitmap)
+	{
+		pLeaf->m_point.x &= ~pLeaf->CellBit(point);
+		pLeaf->MarkDirty();
+		ExpandBitmapLeaf(pLeaf);
+		if (pLeaf->m_nodeType == CNode::EType::Bitmap || pLeaf->HasChildren())
+		{
+			return;
+		}
+	}
+	else if (pLeaf->m_pOverflow != nullptr)
+	{
+		EraseFromBucket(pLeaf, point);
+		return;
+	}
+	else
+	{
+		assert(pLeaf->m_nodeType == CNode::EType::Leaf && pLeaf->m_point == point);
+		pLeaf->m_nodeType = CNode::EType::Region;
+		pLeaf->m_point = CCoordinate();
+		pLeaf->MarkDirty();
+	}
+
+	for (size_t i = pathLength - 1; i > 0; --i)
+	{
+		CNode* pParent = pPath[i - 1];
+		CNode* children[4] = { pParent->m_pNorthWest, pParent->m_pNorthEast, pParent->m_pSouthEast, pParent->m_pSouthWest };
+		CNode* pOnlyLeaf = nullptr;
+		size_t leafCount = 0;
+		for (CNode* pChild : children)
+		{
+			if (pChild->HasChildren() || pChild->m_nodeType == CNode::EType::Bitmap)
+			{
+				return;
+			}
+
+			if (pChild->m_nodeType == CNode::EType::Leaf)
+			{
+				pOnlyLeaf = pChild;
+				++leafCount;
+			}
+		}
+
+		if (leafCount > 1)
+		{
+			return;
+		}
+
+		// The children are dropped and retired
+		for (CNode* pChild : children)
+		{
+			RetireNode(pChild);
+		}
+
+		AdvanceStructureVersion();
+		pParent->MarkDirty();
+		pParent->m_pNorthWest = nullptr;
+		pParent->m_pNorthEast = nullptr;
+		pParent->m_pSouthEast = nullptr;
+		pParent->m_pSouthWest = nullptr;
+		if (pOnlyLeaf != nullptr)
+		{
+			pParent->m_nodeType = CNode::EType::Leaf;
+			pParent->m_point = pOnlyLeaf->m_point;
+			pParent->m_pOverflow = pOnlyLeaf->m_pOverflow;
+		}
+		else
+		{
+			pParent->m_nodeType = CNode::EType::Region;
+			pParent->m_point = CCoordinate();
+		}
+	}
+}
+
+// Removes point from a leaf with an overflow bucket, the leaf keeps at least one point. The last point of the bucket
+// node the point is taken from fills its place. Within a batch, bucket nodes from before the batch are still read by
+// the committed tree, so they are copied rather than changed.
+void CQuadTree::EraseFromBucket(CNode* pLeaf, const CCoordinate& point)
+{
+	assert(pLeaf->m_pOverflow != nullptr);
+	pLeaf->MarkDirty();
+	CNode* pPrevious = pLeaf;
+	CNode* pBucket = OwnNextBucketNode(pLeaf);
+	uint32_t index = 0;
+	if (pLeaf->m_point == point)
+	{
+		// A point of the first bucket node moves into the leaf
+		index = pBucket->m_bucketCount - 1u;
+		pLeaf->m_point = pBucket->BucketPoint(index);
+	}
+	else
+	{
+		while ((index = pBucket->FindBucketPoint(point)) == pBucket->m_bucketCount)
+		{
+			pPrevious = pBucket;
+			pBucket = OwnNextBucketNode(pBucket);
+		}
+	}
+
+	const uint32_t lastIndex = pBucket->m_bucketCount - 1u;
+	pBucket->SetBucketPoint(index, pBucket->BucketPoint(lastIndex));
+	pBucket->SetBucketPoint(lastIndex, pBucket->m_regionMin);
+	--pBucket->m_bucketCount;
+	pBucket->MarkDirty();
+	if (pBucket->m_bucketCount == 0)
+	{
+		// The emptied node is dropped and retired
+		RetireNode(pBucket);
+		pPrevious->m_pOverflow = pBucket->m_pOverflow;
+		pPrevious->MarkDirty();
+	}
+}
+
+// The bucket node after pPrevious, copied first when it predates the running batch
+CQuadTree::CNode* CQuadTree::OwnNextBucketNode(CNode* pPrevious)
+{
+	CNode* pNext = pPrevious->m_pOverflow;
+	assert(pNext != nullptr && pNext->m_nodeType == CNode::EType::Bucket);
+	if (m_pBatchRoot != nullptr && pNext->m_batchGeneration != m_batchGeneration)
+	{
+		m_batchReplacedNodes.push_back(pNext);
+		pNext = CloneNode(pNext);
+		pPrevious->m_pOverflow = pNext;
+	}
+
+	return pNext;
+}
+
+// Splits a leaf with a bucket once, and packs its points and point into the new quadrants, each a leaf with a bucket
+// of what else falls in it. The bucket nodes are dropped and retired, untouched as the committed tree may still share
+// them during a batch.
+template<typename TAllocator>
+void CQuadTree::SplitBucketLeaf(CNode* pLeaf, const CCoordinate& point, TAllocator& allocator)
+{
+	std::vector<CCoordinate> points = { pLeaf->m_point, point };
+	for (CNode* pOverflow = pLeaf->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+	{
+		for (uint32_t i = 0; i < pOverflow->m_bucketCount; ++i)
+		{
+			points.push_back(pOverflow->BucketPoint(i));
+		}
+
+		allocator.RetireNode(pOverflow);
+	}
+
+	pLeaf->m_pOverflow = nullptr;
+	pLeaf->Split(allocator);
+	for (uint8_t quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		CNode* pChild = pLeaf->QuadrantChild(quadrant);
+		CNode* pBucket = nullptr;
+		for (const CCoordinate& childPoint : points)
+		{
+			if (pLeaf->QuadrantContaining(childPoint) != quadrant)
+			{
+				continue;
+			}
+
+			if (pChild->m_nodeType != CNode::EType::Leaf)
+			{
+				pChild->m_nodeType = CNode::EType::Leaf;
+				pChild->m_point = childPoint;
+				pChild->MarkDirty();
+				continue;
+			}
+
+			if (pBucket == nullptr || pBucket->m_bucketCount == pBucket->BucketCapacity())
+			{
+				pBucket = allocator.AllocateRegionNode(pChild->RegionBounds());
+				pBucket->m_nodeType = CNode::EType::Bucket;
+				pBucket->m_pOverflow = pChild->m_pOverflow;
+				pChild->m_pOverflow = pBucket;
+			}
+
+			pBucket->SetBucketPoint(pBucket->m_bucketCount++, childPoint);
+		}
+	}
+}
+
+// Collapses the block holding pNode into a bitmap leaf once the block's subtree holds the threshold of points.
+// Only a node inside a block can have made its block denser.
+template<typename TAllocator>
+void CQuadTree::CondenseBlock(CNode* pRoot, const CNode* pNode, TAllocator& allocator)
+{
+	if (m_bitmapLeafThreshold == 0 || pNode->RegionExtent() >= kBitmapLeafSpan - 1)
+	{
+		return;
+	}
+
+	CNode* pBlock = pRoot;
+	while (pBlock->HasChildren() && pBlock->RegionExtent() >= kBitmapLeafSpan)
+	{
+		pBlock = pBlock->ContainingSubRegion(pNode->m_regionMin);
+	}
+
+	if (!pBlock->HasChildren() || pBlock->RegionExtent() != kBitmapLeafSpan - 1)
+	{
+		return;
+	}
+
+	uint64_t cellBits = 0;
+	CNode* stack[10]; // three levels below the block
+	size_t stackSize = 0;
+	stack[stackSize++] = pBlock;
+	while (stackSize > 0)
+	{
+		CNode* pCurrent = stack[--stackSize];
+		if (pCurrent->HasChildren())
+		{
+			assert(stackSize + 4 <= sizeof(stack) / sizeof(stack[0]));
+			stack[stackSize++] = pCurrent->m_pSouthWest;
+			stack[stackSize++] = pCurrent->m_pSouthEast;
+			stack[stackSize++] = pCurrent->m_pNorthEast;
+			stack[stackSize++] = pCurrent->m_pNorthWest;
+		}
+		else if (pCurrent->m_nodeType == CNode::EType::Leaf)
+		{
+			cellBits |= pBlock->CellBit(pCurrent->m_point);
+			for (const CNode* pOverflow = pCurrent->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+			{
+				for (uint32_t i = 0; i < pOverflow->m_bucketCount; ++i)
+				{
+					cellBits |= pBlock->CellBit(pOverflow->BucketPoint(i));
+				}
+			}
+		}
+	}
+
+	if (CountBits64(cellBits) < m_bitmapLeafThreshold)
+	{
+		return;
+	}
+
+	// The block's nodes are dropped and retired, untouched as the committed tree may still share them during a batch
+	stack[stackSize++] = pBlock;
+	while (stackSize > 0)
+	{
+		CNode* pCurrent = stack[--stackSize];
+		if (pCurrent != pBlock)
+		{
+			allocator.RetireNode(pCurrent);
+		}
+
+		if (pCurrent->HasChildren())
+		{
+			stack[stackSize++] = pCurrent->m_pSouthWest;
+			stack[stackSize++] = pCurrent->m_pSouthEast;
+			stack[stackSize++] = pCurrent->m_pNorthEast;
+			stack[stackSize++] = pCurrent->m_pNorthWest;
+		}
+		else
+		{
+			for (CNode* pOverflow = pCurrent->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+			{
+				allocator.RetireNode(pOverflow);
+			}
+		}
+	}
+
+	AdvanceStructureVersion();
+	pBlock->MarkDirty();
+	pBlock->m_pNorthWest = nullptr;
+	pBlock->m_pNorthEast = nullptr;
+	pBlock->m_pSouthEast = nullptr;
+	pBlock->m_pSouthWest = nullptr;
+	pBlock->m_nodeType = CNode::EType::Bitmap;
+	pBlock->m_point = CCoordinate(cellBits, 0);
+}
+
+// Rebuilds the nodes of a bitmap leaf left with fewer than half the threshold of points. An empty bitmap leaf always
+// becomes an empty region, otherwise the leaf stays as it is when the budget has no room for the nodes.
+void CQuadTree::ExpandBitmapLeaf(CNode* pLeaf)
+{
+	const uint64_t cellBits = pLeaf->m_point.x;
+	const size_t pointCount = CountBits64(cellBits);
+	// Each point needs at most a split of four nodes for each of the three levels below the block
+	if (pointCount != 0 && (2 * pointCount >= m_bitmapLeafThreshold || !CanAllocateNodes(4 * 3 * pointCount)))
+	{
+		return;
+	}
+
+	pLeaf->MarkDirty();
+	pLeaf->m_nodeType = CNode::EType::Region;
+	pLeaf->m_point = CCoordinate();
+	for (uint32_t cell = 0; cell < 64; ++cell)
+	{
+		if ((cellBits >> cell) & 1)
+		{
+			InsertAt(pLeaf, pLeaf->CellPoint(cell), *this);
+		}
+	}
+}
+
+template<typename TFunction>
+void CQuadTree::ForEachPoint(TFunction function) const
+{
+	for (const CCoordinate& point : m_writeBuffer)
+	{
+		function(point);
+	}
+
+	for (const CCoordinate& point : m_inlinePoints)
+	{
+		function(point);
+	}
+
+	CNode* stack[kMaxPathLength * 3 + 1];
+	size_t stackSize = 0;
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_acquire);
+	if (pTreeRoot != nullptr)
+	{
+		stack[stackSize++] = pTreeRoot;
+	}
+
+	while (stackSize > 0)
+	{
+		const CNode* pNode = stack[--stackSize];
+		if (pNode->HasChildren())
+		{
+			assert(stackSize + 4 <= sizeof(stack) / sizeof(stack[0]));
+			stack[stackSize++] = pNode->m_pSouthWest;
+			stack[stackSize++] = pNode->m_pSouthEast;
+			stack[stackSize++] = pNode->m_pNorthEast;
+			stack[stackSize++] = pNode->m_pNorthWest;
+		}
+		else if (pNode->m_nodeType == CNode::EType::Leaf)
+		{
+			function(pNode->m_point);
+			for (const CNode* pOverflow = pNode->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+			{
+				for (uint32_t i = 0; i < pOverflow->m_bucketCount; ++i)
+				{
+					function(pOverflow->BucketPoint(i));
+				}
+			}
+		}
+		else if (pNode->m_nodeType == CNode::EType::Bitmap)
+		{
+			for (uint64_t cellBits = pNode->m_point.x; cellBits != 0; cellBits &= cellBits - 1)
+			{
+				function(pNode->CellPoint(CountBits64((cellBits & (~cellBits + 1)) - 1)));
+			}
+		}
+	}
+}
+
+namespace
+{
+	const char kSnapshotMagic[4] = { 'P', 'R', 'Q', 'T' };
+	const uint8_t kSnapshotVersion = 1;
+	const uint64_t kSnapshotBlockSize = 4096; // points per block
+	const uint64_t kSnapshotMaxBlockSize = 1 << 20; // largest block size a snapshot may declare
+	const uint64_t kSnapshotMaxPointBytes = 19; // a varint of 128 bits
+	const uint8_t kSnapshotCodecVarint = 0; // block codec, further codecs can compress the varint stream
+}
+
+void CQuadTree::Serialize(std::ostream& stream) const
+{
+	std::vector<CKeyedCoordinate> entries;
+	ForEachPoint([&entries](const CCoordinate& point) { entries.emplace_back(point); });
+	std::sort(entries.begin(), entries.end());
+
+	std::string buffer(kSnapshotMagic, sizeof(kSnapshotMagic));
+	buffer.push_back(static_cast<char>(kSnapshotVersion));
+	WriteVarint(buffer, entries.size());
+	WriteVarint(buffer, kSnapshotBlockSize);
+	stream.write(buffer.data(), buffer.size());
+
+	std::string block;
+	for (size_t blockBegin = 0; blockBegin < entries.size(); blockBegin += kSnapshotBlockSize)
+	{
+		const size_t blockEnd = std::min<size_t>(blockBegin + kSnapshotBlockSize, entries.size());
+		// Deltas restart at zero in every block so blocks decode independently
+		CMortonKey previousKey;
+		block.clear();
+		for (size_t i = blockBegin; i < blockEnd; ++i)
+		{
+			const CMortonKey& key = entries[i].key;
+			const TScalar deltaLow = key.low - previousKey.low;
+			const TScalar deltaHigh = key.high - previousKey.high - (key.low < previousKey.low ? 1 : 0);
+			WriteVarint128(block, deltaHigh, deltaLow);
+			previousKey = key;
+		}
+
+		buffer.clear();
+		WriteVarint(buffer, blockEnd - blockBegin);
+		WriteVarint(buffer, block.size());
+		buffer.push_back(static_cast<char>(kSnapshotCodecVarint));
+		stream.write(buffer.data(), buffer.size());
+		stream.write(block.data(), block.size());
+	}
+}
+
+CQuadTree::ELoadResult CQuadTree::Deserialize(std::istream& stream)
+{
+	assert(m_pBatchRoot == nullptr);
+	char magic[sizeof(kSnapshotMagic)];
+	if (!stream.read(magic, sizeof(magic)))
+	{
+		return ELoadResult::Truncated;
+	}
+
+	if (!std::equal(magic, magic + sizeof(magic), kSnapshotMagic) || stream.get() != kSnapshotVersion)
+	{
+		return ELoadResult::InvalidFormat;
+	}
+
+	uint64_t pointCount = 0;
+	uint64_t blockSize = 0;
+	if (!ReadVarint(stream, &pointCount) || !ReadVarint(stream, &blockSize))
+	{
+		return ELoadResult::Truncated;
+	}
+
+	if (blockSize > kSnapshotMaxBlockSize)
+	{
+		return ELoadResult::InvalidFormat;
+	}
+
+	// Keys ascend across the whole snapshot, so a wrapped delta or a duplicate point is caught here rather than by
+	// InsertSorted
+	std::vector<uint8_t> block;
+	std::vector<CKeyedCoordinate> entries;
+	while (entries.size() < pointCount)
+	{
+		uint64_t blockPointCount = 0;
+		uint64_t blockByteCount = 0;
+		if (!ReadVarint(stream, &blockPointCount) || !ReadVarint(stream, &blockByteCount))
+		{
+			return ELoadResult::Truncated;
+		}
+
+		const int codec = stream.get();
+		if (codec != kSnapshotCodecVarint || blockPointCount == 0 || blockPointCount > blockSize ||
+			blockPointCount > pointCount - entries.size() || blockByteCount > blockPointCount * kSnapshotMaxPointBytes)
+		{
+			return ELoadResult::InvalidFormat;
+		}
+
+		block.resize(static_cast<size_t>(blockByteCount));
+		if (!stream.read(reinterpret_cast<char*>(block.data()), block.size()))
+		{
+			return ELoadResult::Truncated;
+		}
+
+		const uint8_t* pCursor = block.data();
+		const uint8_t* pEnd = pCursor + block.size();
+		CMortonKey key;
+		for (uint64_t i = 0; i < blockPointCount; ++i)
+		{
+			uint64_t deltaHigh = 0;
+			uint64_t deltaLow = 0;
+			if (!ReadVarint128(pCursor, pEnd, &deltaHigh, &deltaLow))
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			const TScalar low = key.low + deltaLow;
+			key = CMortonKey(key.high + deltaHigh + (low < key.low ? 1 : 0), low);
+			CKeyedCoordinate entry;
+			entry.key = key;
+			entry.point = key.ToCoordinate();
+			if (!entries.empty() && !(entries.back() < entry))
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			entries.push_back(entry);
+		}
+	}
+
+	std::vector<CKeyedCoordinate> previousEntries;
+	if (m_memoryBudget != 0)
+	{
+		ForEachPoint([&previousEntries](const CCoordinate& point) { previousEntries.emplace_back(point); });
+		std::sort(previousEntries.begin(), previousEntries.end());
+	}
+
+	if (LoadSortedEntries(entries) != entries.size())
+	{
+		// The previous points go back regardless of the budget, the tree held them before the load
+		const size_t memoryBudget = m_memoryBudget;
+		m_memoryBudget = 0;
+		LoadSortedEntries(previousEntries);
+		m_memoryBudget = memoryBudget;
+		return ELoadResult::OutOfMemory;
+	}
+
+	return ELoadResult::Success;
+}
+
+// Replaces the tree with the sorted entries, returns how many the memory budget let in
+size_t CQuadTree::LoadSortedEntries(const std::vector<CKeyedCoordinate>& entries)
+{
+	Reset();
+	if (entries.size() > m_inlineCapacity)
+	{
+		BuildInlineTree();
+	}
+
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+	if (pTreeRoot == nullptr)
+	{
+		for (const CKeyedCoordinate& entry : entries)
+		{
+			m_inlinePoints.push_back(entry.point);
+		}
+
+		return entries.size();
+	}
+
+	return InsertSorted(pTreeRoot, entries.data(), entries.size(), *this);
+}
+
+namespace
+{
+	const char kCheckpointMagic[4] = { 'P', 'R', 'Q', 'C' };
+	const uint8_t kCheckpointVersion = 5;
+	const uint8_t kCheckpointFlagFull = 1 << 0;
+	const size_t kCheckpointHeaderSize = sizeof(kCheckpointMagic) + 2 + 6 * sizeof(uint64_t);
+	const size_t kCheckpointMaxRecordBytes = 10 + 3 + 4 * 10 + 6 * 10; // slot gap, type, bucket count, depth, corner, point, links
+
+	void WriteFixed64(std::string& buffer, uint64_t value)
+	{
+		for (uint32_t shift = 0; shift < 64; shift += 8)
+		{
+			buffer.push_back(static_cast<char>(value >> shift));
+		}
+	}
+
+	uint64_t ReadFixed64(const uint8_t*& pCursor)
+	{
+		uint64_t value = 0;
+		for (uint32_t shift = 0; shift < 64; shift += 8)
+		{
+			value |= static_cast<uint64_t>(*pCursor++) << shift;
+		}
+
+		return value;
+	}
+
+	// Reads byteCount bytes in chunks, so a size from a corrupt stream only allocates as much as the stream holds
+	bool ReadChunked(std::istream& stream, uint64_t byteCount, std::vector<uint8_t>* pBytes)
+	{
+		const uint64_t kChunkSize = 1 << 20;
+		pBytes->clear();
+		while (pBytes->size() < byteCount)
+		{
+			const size_t offset = pBytes->size();
+			pBytes->resize(offset + static_cast<size_t>(std::min(kChunkSize, byteCount - offset)));
+			if (!stream.read(reinterpret_cast<char*>(pBytes->data() + offset), pBytes->size() - offset))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
+CQuadTree::CCheckpointRecord CQuadTree::CCheckpointRecord::Pristine(uint64_t slot, uint64_t slotCount)
+{
+	CCheckpointRecord record;
+	record.m_slot = slot;
+	record.m_links[5] = slot + 1 < slotCount ? slot + 2 : 0;
+	return record;
+}
+
+bool CQuadTree::CCheckpointRecord::IsPristine(uint64_t slotCount) const
+{
+	const CCheckpointRecord pristine = Pristine(m_slot, slotCount);
+	return m_nodeType == pristine.m_nodeType && m_bucketCount == 0 && m_regionDepth == pristine.m_regionDepth && m_regionMin == pristine.m_regionMin &&
+		m_point == pristine.m_point && std::equal(m_links, m_links + 6, pristine.m_links);
+}
+
+// The slot as the gap from the previous record, the corner as its depth significant bits, the links relative to the slot
+void CQuadTree::CCheckpointRecord::Write(std::string& buffer, uint64_t previousSlot) const
+{
+	WriteVarint(buffer, m_slot - previousSlot - 1);
+	buffer.push_back(static_cast<char>(m_nodeType));
+	buffer.push_back(static_cast<char>(m_bucketCount));
+	buffer.push_back(static_cast<char>(m_regionDepth));
+	if (m_regionDepth > 0)
+	{
+		WriteVarint(buffer, m_regionMin.x >> (64 - m_regionDepth));
+		WriteVarint(buffer, m_regionMin.y >> (64 - m_regionDepth));
+	}
+
+	WriteVarint(buffer, m_point.x);
+	WriteVarint(buffer, m_point.y);
+	for (uint64_t link : m_links)
+	{
+		assert(link == 0 || link - 1 < ~uint64_t(0) - 1);
+		WriteVarint(buffer, link == 0 ? 0 : ZigZagEncode(link - 1 - m_slot) + 1);
+	}
+}
+
+bool CQuadTree::CCheckpointRecord::Read(const uint8_t*& pCursor, const uint8_t* pEnd, uint64_t previousSlot, uint64_t pageEnd, uint64_t slotCount)
+{
+	uint64_t slotGap = 0;
+	if (!ReadVarint(pCursor, pEnd, &slotGap) || slotGap >= pageEnd - previousSlot - 1 || pEnd - pCursor < 3)
+	{
+		return false;
+	}
+
+	m_slot = previousSlot + 1 + slotGap;
+	m_nodeType = *pCursor++;
+	m_bucketCount = *pCursor++;
+	m_regionDepth = *pCursor++;
+	if (m_regionDepth > 64)
+	{
+		return false;
+	}
+
+	m_regionMin = CCoordinate();
+	if (m_regionDepth > 0)
+	{
+		uint64_t cornerX = 0;
+		uint64_t cornerY = 0;
+		if (!ReadVarint(pCursor, pEnd, &cornerX) || !ReadVarint(pCursor, pEnd, &cornerY) ||
+			(m_regionDepth < 64 && ((cornerX >> m_regionDepth) != 0 || (cornerY >> m_regionDepth) != 0)))
+		{
+			return false;
+		}
+
+		m_regionMin = CCoordinate(cornerX << (64 - m_regionDepth), cornerY << (64 - m_regionDepth));
+	}
+
+	if (!ReadVarint(pCursor, pEnd, &m_point.x) || !ReadVarint(pCursor, pEnd, &m_point.y))
+	{
+		return false;
+	}
+
+	for (uint64_t& link : m_links)
+	{
+		uint64_t value = 0;
+		if (!ReadVarint(pCursor, pEnd, &value))
+		{
+			return false;
+		}
+
+		link = value == 0 ? 0 : m_slot + ZigZagDecode(value - 1) + 1;
+		if (value != 0 && link - 1 >= slotCount)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t CQuadTree::GetAllocatedBytes() const
+{
+	size_t allocatedBytes = m_pages.capacity() * sizeof(m_pages[0]) + (m_writeBuffer.capacity() + m_inlinePoints.capacity()) * sizeof(CCoordinate);
+	if (m_pLeafCache != nullptr)
+	{
+		allocatedBytes += (m_leafCacheMask + 2) * sizeof(CLeafCacheSet);
+	}
+	for (const std::unique_ptr<CPage>& pPage : m_pages)
+	{
+		allocatedBytes += sizeof(CPage) + pPage->m_nodeCount * sizeof(CNode);
+	}
+
+	return allocatedBytes;
+}
+
+CQuadTree::CMetrics CQuadTree::GetMetrics() const
+{
+	CMetrics metrics;
+	metrics.pointCount = m_writeBuffer.size() + m_inlinePoints.size();
+	metrics.pageCount = m_pages.size();
+	metrics.allocatedBytes = GetAllocatedBytes();
+
+	// The tail of the pool chain is never handed out, retired nodes are reused once the Finds that may read them return
+	metrics.freeNodeCount = m_freeNodes.size() + m_waitingNodes.size() + m_retiredNodes.size();
+	for (const CNode* pNode = m_pPoolHead; pNode != nullptr && pNode->pPoolNext != nullptr; pNode = pNode->pPoolNext)
+	{
+		++metrics.freeNodeCount;
+	}
+
+	CNode* stack[kMaxPathLength * 3 + 1];
+	size_t stackSize = 0;
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_acquire);
+	if (pTreeRoot != nullptr)
+	{
+		stack[stackSize++] = pTreeRoot;
+	}
+
+	while (stackSize > 0)
+	{
+		const CNode* pNode = stack[--stackSize];
+		++metrics.nodeCount;
+		if (pNode->HasChildren())
+		{
+			assert(stackSize + 4 <= sizeof(stack) / sizeof(stack[0]));
+			stack[stackSize++] = pNode->m_pSouthWest;
+			stack[stackSize++] = pNode->m_pSouthEast;
+			stack[stackSize++] = pNode->m_pNorthEast;
+			stack[stackSize++] = pNode->m_pNorthWest;
+		}
+		else if (pNode->m_nodeType == CNode::EType::Leaf)
+		{
+			++metrics.pointCount;
+			metrics.maxDepth = std::max(metrics.maxDepth, pNode->RegionDepth());
+			for (const CNode* pOverflow = pNode->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+			{
+				++metrics.nodeCount;
+				metrics.pointCount += pOverflow->m_bucketCount;
+				metrics.overflowPointCount += pOverflow->m_bucketCount;
+			}
+		}
+		else if (pNode->m_nodeType == CNode::EType::Bitmap)
+		{
+			metrics.pointCount += CountBits64(pNode->m_point.x);
+			metrics.maxDepth = std::max(metrics.maxDepth, pNode->RegionDepth());
+		}
+	}
+
+	for (size_t operation = 0; operation < static_cast<size_t>(CMetrics::EOperation::Count); ++operation)
+	{
+		metrics.operationCounts[operation] = m_operationCounts[operation].load(std::memory_order_relaxed);
+	}
+
+	for (size_t operation = 0; operation < CMetrics::kTimedOperationCount; ++operation)
+	{
+		for (size_t bucket = 0; bucket < CMetrics::kLatencyBucketCount; ++bucket)
+		{
+			metrics.latencyBuckets[operation][bucket] = m_latencyBuckets[operation][bucket].load(std::memory_order_relaxed);
+		}
+
+		metrics.latencySumsNs[operation] = m_latencySumsNs[operation].load(std::memory_order_relaxed);
+	}
+
+	return metrics;
+}
+
+// The page holding pNode, the last page whose nodes start at or before it
+const CQuadTree::CPage* CQuadTree::PageOf(const CNode* pNode) const
+{
+	const auto it = std::upper_bound(m_pagesByAddress.begin(), m_pagesByAddress.end(), pNode, [](const CNode* pKey, const CPage* pPage)
+	{
+		return std::less<const CNode*>()(pKey, pPage->m_pNodes);
+	});
+
+	assert(it != m_pagesByAddress.begin());
+	const CPage* pPage = *(it - 1);
+	assert(pNode < pPage->m_pNodes + pPage->m_nodeCount);
+	return pPage;
+}
+
+// Node ids are stable across processes: 0 is null, otherwise the page index in the high half and the slot in the low half, plus one
+uint64_t CQuadTree::NodeId(const CNode* pNode) const
+{
+	if (pNode == nullptr)
+	{
+		return 0;
+	}
+
+	const CPage* pPage = PageOf(pNode);
+	return ((static_cast<uint64_t>(pPage->m_index) << 32) | static_cast<uint64_t>(pNode - pPage->m_pNodes)) + 1;
+}
+
+bool CQuadTree::NodeFromId(uint64_t nodeId, CNode** ppNode) const
+{
+	if (nodeId == 0)
+	{
+		*ppNode = nullptr;
+		return true;
+	}
+
+	const uint64_t pageIndex = (nodeId - 1) >> 32;
+	const uint64_t slot = (nodeId - 1) & 0xFFFFFFFFull;
+	if (pageIndex >= m_pages.size() || slot >= m_pages[static_cast<size_t>(pageIndex)]->m_nodeCount)
+	{
+		return false;
+	}
+
+	*ppNode = &m_pages[static_cast<size_t>(pageIndex)]->m_pNodes[static_cast<size_t>(slot)];
+	return true;
+}
+
+// The first pool wide slot of each page, followed by the number of slots in the pool
+std::vector<uint64_t> CQuadTree::PageSlotBases() const
+{
+	std::vector<uint64_t> slotBases(1, 0);
+	for (const std::unique_ptr<CPage>& pPage : m_pages)
+	{
+		slotBases.push_back(slotBases.back() + pPage->m_nodeCount);
+	}
+
+	return slotBases;
+}
+
+// The pool wide slot of pNode plus one, 0 for null and ~0 for a node the slot bases do not cover
+uint64_t CQuadTree::PoolSlotLink(const CNode* pNode, const std::vector<uint64_t>& slotBases) const
+{
+	if (pNode == nullptr)
+	{
+		return 0;
+	}
+
+	const CPage* pPage = PageOf(pNode);
+	const uint64_t slot = static_cast<uint64_t>(pNode - pPage->m_pNodes);
+	if (pPage->m_index + 1 >= slotBases.size() || slotBases[pPage->m_index] + slot >= slotBases[pPage->m_index + 1])
+	{
+		return ~uint64_t(0);
+	}
+
+	return slotBases[pPage->m_index] + slot + 1;
+}
+
+CQuadTree::CCheckpointRecord CQuadTree::CheckpointRecord(const CNode& node, uint64_t slot, const std::vector<uint64_t>& slotBases) const
+{
+	CCheckpointRecord record;
+	record.m_slot = slot;
+	record.m_nodeType = static_cast<uint8_t>(node.m_nodeType);
+	record.m_bucketCount = node.m_bucketCount;
+	record.m_regionDepth = node.m_regionDepth;
+	record.m_regionMin = node.m_regionMin;
+	record.m_point = node.m_nodeType == CNode::EType::Leaf ? node.m_point - node.m_regionMin : node.m_point;
+	const CNode* links[] = { node.m_pNorthWest, node.m_pNorthEast, node.m_pSouthEast, node.m_pSouthWest, node.m_pOverflow, node.pPoolNext };
+	for (size_t link = 0; link < 6; ++link)
+	{
+		record.m_links[link] = PoolSlotLink(links[link], slotBases);
+	}
+
+	return record;
+}
+
+void CQuadTree::Checkpoint(std::ostream& stream, bool full)
+{
+	assert(m_pBatchRoot == nullptr);
+	BuildInlineTree();
+	FlushWriteBuffer();
+
+	// The pages the previous checkpoint carried are the replica's too, so only their changed slots go out. The replica
+	// starts every other page pristine, so only their slots that differ from a pristine one do, which leaves out
+	// everything past the pool head's high water mark.
+	const uint64_t retainedPageCount = full ? 0 : std::min<uint64_t>(m_checkpointedPageCount, m_pages.size());
+	const std::vector<uint64_t> slotBases = PageSlotBases();
+	const uint64_t slotCount = slotBases.back();
+	std::string pageRecords;
+	std::string records;
+	uint64_t writtenPageCount = 0;
+	for (size_t page = 0; page < m_pages.size(); ++page)
+	{
+		const CPage* pPage = m_pages[page].get();
+		uint64_t previousSlot = slotBases[page] - 1;
+		uint64_t recordCount = 0;
+		records.clear();
+		for (size_t i = 0; i < pPage->m_nodeCount; ++i)
+		{
+			const CNode& node = pPage->m_pNodes[i];
+			if (page < retainedPageCount && !node.m_dirty)
+			{
+				continue;
+			}
+
+			const CCheckpointRecord record = CheckpointRecord(node, slotBases[page] + i, slotBases);
+			if (page >= retainedPageCount && record.IsPristine(slotCount))
+			{
+				continue;
+			}
+
+			record.Write(records, previousSlot);
+			previousSlot = record.m_slot;
+			++recordCount;
+		}
+
+		if (recordCount > 0)
+		{
+			WriteVarint(pageRecords, page);
+			WriteVarint(pageRecords, recordCount);
+			WriteVarint(pageRecords, records.size());
+			pageRecords += records;
+			++writtenPageCount;
+		}
+	}
+
+	std::string buffer(kCheckpointMagic, sizeof(kCheckpointMagic));
+	buffer.push_back(static_cast<char>(kCheckpointVersion));
+	buffer.push_back(static_cast<char>(full ? kCheckpointFlagFull : 0));
+	WriteFixed64(buffer, m_pageSize);
+	WriteFixed64(buffer, m_pages.size());
+	WriteFixed64(buffer, retainedPageCount);
+	WriteFixed64(buffer, writtenPageCount);
+	WriteFixed64(buffer, NodeId(m_pTreeRoot.load(std::memory_order_relaxed)));
+	WriteFixed64(buffer, NodeId(m_pPoolHead));
+	assert(buffer.size() == kCheckpointHeaderSize);
+
+	// Pages differ in size once they grow, the sizes come first so every page exists before any link is resolved
+	for (const std::unique_ptr<CPage>& pPage : m_pages)
+	{
+		WriteFixed64(buffer, pPage->m_nodeCount);
+	}
+
+	stream.write(buffer.data(), buffer.size());
+	stream.write(pageRecords.data(), pageRecords.size());
+	for (const std::unique_ptr<CPage>& pPage : m_pages)
+	{
+		for (size_t i = 0; i < pPage->m_nodeCount; ++i)
+		{
+			pPage->m_pNodes[i].m_dirty = false;
+		}
+	}
+
+	m_checkpointedPageCount = m_pages.size();
+}
+
+CQuadTree::ELoadResult CQuadTree::ApplyCheckpoint(std::istream& stream)
+{
+	assert(m_pBatchRoot == nullptr);
+	std::vector<uint8_t> buffer(kCheckpointHeaderSize);
+	if (!stream.read(reinterpret_cast<char*>(buffer.data()), buffer.size()))
+	{
+		return ELoadResult::Truncated;
+	}
+
+	const uint8_t* pCursor = buffer.data();
+	if (!std::equal(kCheckpointMagic, kCheckpointMagic + sizeof(kCheckpointMagic), pCursor) || pCursor[4] != kCheckpointVersion)
+	{
+		return ELoadResult::InvalidFormat;
+	}
+
+	const bool full = (pCursor[5] & kCheckpointFlagFull) != 0;
+	pCursor += sizeof(kCheckpointMagic) + 2;
+	const uint64_t pageSize = ReadFixed64(pCursor);
+	const uint64_t pageCount = ReadFixed64(pCursor);
+	const uint64_t retainedPageCount = ReadFixed64(pCursor);
+	const uint64_t writtenPageCount = ReadFixed64(pCursor);
+	const uint64_t rootId = ReadFixed64(pCursor);
+	const uint64_t poolHeadId = ReadFixed64(pCursor);
+	if (pageSize == 0 || pageCount == 0 || writtenPageCount > pageCount || retainedPageCount > pageCount ||
+		(full && retainedPageCount != 0) || (!full && (pageSize != m_pageSize || retainedPageCount > m_pages.size())))
+	{
+		return ELoadResult::InvalidFormat;
+	}
+
+	// Pages this checkpoint retains from the pool must not change size, and the first page is the smallest page size
+	std::vector<uint64_t> slotBases(1, 0);
+	for (uint64_t page = 0; page < pageCount; ++page)
+	{
+		uint8_t pageSizeBytes[sizeof(uint64_t)];
+		if (!stream.read(reinterpret_cast<char*>(pageSizeBytes), sizeof(pageSizeBytes)))
+		{
+			return ELoadResult::Truncated;
+		}
+
+		const uint8_t* pPageSizeCursor = pageSizeBytes;
+		const uint64_t nodeCount = ReadFixed64(pPageSizeCursor);
+		if ((page < retainedPageCount ? nodeCount != m_pages[static_cast<size_t>(page)]->m_nodeCount : nodeCount < pageSize || nodeCount > kMaxPageSize) ||
+			(page == 0 && nodeCount != pageSize))
+		{
+			return ELoadResult::InvalidFormat;
+		}
+
+		slotBases.push_back(slotBases.back() + nodeCount);
+	}
+
+	// Pristine slots are not written, so the pages can claim far more nodes than the checkpoint holds
+	const uint64_t slotCount = slotBases.back();
+	if (m_memoryBudget != 0 && slotCount > m_memoryBudget / sizeof(CNode))
+	{
+		return ELoadResult::OutOfMemory;
+	}
+	auto SlotFromId = [&slotBases](uint64_t nodeId)
+	{
+		const uint64_t page = (nodeId - 1) >> 32;
+		const uint64_t slot = (nodeId - 1) & 0xFFFFFFFFull;
+		return nodeId != 0 && page + 1 < slotBases.size() && slot < slotBases[page + 1] - slotBases[page] ? slotBases[page] + slot : ~uint64_t(0);
+	};
+
+	// The records are checked on their own as they are read, and their links together below, before anything is applied
+	std::vector<CCheckpointRecord> records;
+	std::vector<uint8_t> image;
+	std::vector<bool> pageWritten(static_cast<size_t>(pageCount), false);
+	for (uint64_t page = 0; page < writtenPageCount; ++page)
+	{
+		uint64_t pageIndex = 0;
+		uint64_t recordCount = 0;
+		uint64_t byteCount = 0;
+		if (!ReadVarint(stream, &pageIndex) || !ReadVarint(stream, &recordCount) || !ReadVarint(stream, &byteCount))
+		{
+			return ELoadResult::Truncated;
+		}
+
+		if (pageIndex >= pageCount || pageWritten[static_cast<size_t>(pageIndex)] || recordCount == 0 ||
+			recordCount > slotBases[pageIndex + 1] - slotBases[pageIndex] || byteCount > recordCount * kCheckpointMaxRecordBytes)
+		{
+			return ELoadResult::InvalidFormat;
+		}
+
+		if (!ReadChunked(stream, byteCount, &image))
+		{
+			return ELoadResult::Truncated;
+		}
+
+		pageWritten[static_cast<size_t>(pageIndex)] = true;
+		pCursor = image.data();
+		const uint8_t* pEnd = pCursor + image.size();
+		uint64_t previousSlot = slotBases[pageIndex] - 1;
+		for (uint64_t i = 0; i < recordCount; ++i)
+		{
+			CCheckpointRecord record;
+			if (!record.Read(pCursor, pEnd, previousSlot, slotBases[pageIndex + 1], slotCount))
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			const CNode::EType nodeType = static_cast<CNode::EType>(record.m_nodeType);
+			if (record.m_nodeType > static_cast<uint8_t>(CNode::EType::Bucket) || (record.m_bucketCount != 0 && nodeType != CNode::EType::Bucket) ||
+				(nodeType == CNode::EType::Leaf && (record.m_point.x > record.RegionExtent() || record.m_point.y > record.RegionExtent())))
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			previousSlot = record.m_slot;
+			records.push_back(record);
+		}
+
+		if (pCursor != pEnd)
+		{
+			return ELoadResult::InvalidFormat;
+		}
+	}
+
+	const uint64_t rootSlot = SlotFromId(rootId);
+	const uint64_t poolHeadSlot = SlotFromId(poolHeadId);
+	if (rootSlot >= slotCount || poolHeadSlot >= slotCount)
+	{
+		return ELoadResult::InvalidFormat;
+	}
+
+	// A slot as it will be once applied: its record, else the retained node, else a pristine slot
+	std::sort(records.begin(), records.end(), [](const CCheckpointRecord& lhs, const CCheckpointRecord& rhs) { return lhs.m_slot < rhs.m_slot; });
+	auto SlotRecord = [&](uint64_t slot)
+	{
+		const auto it = std::lower_bound(records.begin(), records.end(), slot, [](const CCheckpointRecord& record, uint64_t key) { return record.m_slot < key; });
+		if (it != records.end() && it->m_slot == slot)
+		{
+			return *it;
+		}
+
+		const size_t page = static_cast<size_t>(std::upper_bound(slotBases.begin(), slotBases.end(), slot) - slotBases.begin() - 1);
+		return page < retainedPageCount ? CheckpointRecord(m_pages[page]->m_pNodes[static_cast<size_t>(slot - slotBases[page])], slot, slotBases) :
+			CCheckpointRecord::Pristine(slot, slotCount);
+	};
+
+	// The tree has to be one: every child and bucket node is reached once from the root, so no link is shared or
+	// closes a cycle, and a node has either all four children or none
+	std::vector<bool> reached(static_cast<size_t>(slotCount), false);
+	std::vector<uint64_t> pendingSlots(1, rootSlot);
+	reached[static_cast<size_t>(rootSlot)] = true;
+	auto Reach = [&](uint64_t link)
+	{
+		if (link - 1 >= slotCount || reached[static_cast<size_t>(link - 1)])
+		{
+			return false;
+		}
+
+		reached[static_cast<size_t>(link - 1)] = true;
+		return true;
+	};
+
+	while (!pendingSlots.empty())
+	{
+		const CCheckpointRecord record = SlotRecord(pendingSlots.back());
+		pendingSlots.pop_back();
+		const size_t childCount = std::count_if(record.m_links, record.m_links + 4, [](uint64_t link) { return link != 0; });
+		if (childCount != 0 && childCount != 4)
+		{
+			return ELoadResult::InvalidFormat;
+		}
+
+		for (size_t child = 0; child < childCount; ++child)
+		{
+			if (!Reach(record.m_links[child]))
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			pendingSlots.push_back(record.m_links[child] - 1);
+		}
+
+		for (uint64_t overflowLink = record.m_links[4]; overflowLink != 0; )
+		{
+			if (!Reach(overflowLink))
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			const CCheckpointRecord overflow = SlotRecord(overflowLink - 1);
+			if (overflow.m_links[0] != 0)
+			{
+				return ELoadResult::InvalidFormat;
+			}
+
+			overflowLink = overflow.m_links[4];
+		}
+	}
+
+	// The free end of the pool chain has to end, GetMetrics and CanAllocateNodes walk it
+	uint64_t chainLength = 0;
+	for (uint64_t link = SlotRecord(poolHeadSlot).m_links[5]; link != 0; link = SlotRecord(link - 1).m_links[5])
+	{
+		if (link - 1 >= slotCount || ++chainLength >= slotCount)
+		{
+			return ELoadResult::InvalidFormat;
+		}
+	}
+
+	// ReleaseLastPage cuts the pool chain after the last retained page, whose tail keeps its link unless a record replaces it
+	const uint64_t retainedTailLink = retainedPageCount > 0 ? SlotRecord(slotBases[retainedPageCount] - 1).m_links[5] : 0;
+
+	// The whole checkpoint is valid, from here on it replaces the pool
+	AdvanceStructureVersion();
+	m_inlinePoints.clear();
+	if (retainedPageCount == 0)
+	{
+		for (std::unique_ptr<CPage>& pPage : m_pages)
+		{
+			ReturnPage(std::move(pPage));
+		}
+
+		m_pages.clear();
+		m_pagesByAddress.clear();
+		m_poolBytes.store(0, std::memory_order_relaxed);
+		m_pPoolRoot = m_pPoolHead = nullptr;
+		m_pageSize = static_cast<size_t>(pageSize);
+		m_maxPageSize = std::max(m_maxPageSize, m_pageSize);
+	}
+
+	// Pages past the retained ones are rebuilt pristine, whatever the pool held there
+	while (m_pages.size() > retainedPageCount)
+	{
+		ReleaseLastPage();
+	}
+
+	RestartCompaction();
+	ReleaseFreeNodes();
+	m_writeBuffer.clear();
+	for (uint64_t page = m_pages.size(); page < pageCount; ++page)
+	{
+		CreatePage(static_cast<size_t>(slotBases[page + 1] - slotBases[page]));
+		if (page > retainedPageCount)
+		{
+			const CPage* pPreviousPage = m_pages[static_cast<size_t>(page) - 1].get();
+			pPreviousPage->m_pNodes[pPreviousPage->m_nodeCount - 1].pPoolNext = m_pages.back()->m_pNodes;
+		}
+	}
+
+	auto SlotNode = [&](uint64_t link)
+	{
+		if (link == 0)
+		{
+			return static_cast<CNode*>(nullptr);
+		}
+
+		const size_t page = static_cast<size_t>(std::upper_bound(slotBases.begin(), slotBases.end(), link - 1) - slotBases.begin() - 1);
+		return &m_pages[page]->m_pNodes[static_cast<size_t>(link - 1 - slotBases[page])];
+	};
+
+	if (retainedPageCount > 0)
+	{
+		SlotNode(slotBases[retainedPageCount])->pPoolNext = SlotNode(retainedTailLink);
+	}
+
+	for (const CCheckpointRecord& record : records)
+	{
+		CNode& node = *SlotNode(record.m_slot + 1);
+		node.m_nodeType = static_cast<CNode::EType>(record.m_nodeType);
+		node.m_bucketCount = record.m_bucketCount;
+		node.m_regionDepth = record.m_regionDepth;
+		node.m_regionMin = record.m_regionMin;
+		node.m_point = node.m_nodeType == CNode::EType::Leaf ? record.m_point + record.m_regionMin : record.m_point;
+		node.m_batchGeneration = 0;
+		CNode** links[] = { &node.m_pNorthWest, &node.m_pNorthEast, &node.m_pSouthEast, &node.m_pSouthWest, &node.m_pOverflow, &node.pPoolNext };
+		for (size_t link = 0; link < 6; ++link)
+		{
+			*links[link] = SlotNode(record.m_links[link]);
+		}
+	}
+
+	for (const std::unique_ptr<CPage>& pPage : m_pages)
+	{
+		for (size_t i = 0; i < pPage->m_nodeCount; ++i)
+		{
+			pPage->m_pNodes[i].m_dirty = false;
+		}
+	}
+
+	m_checkpointedPageCount = static_cast<size_t>(pageCount);
+	m_pTreeRoot.store(SlotNode(rootSlot + 1), std::memory_order_release);
+	m_pPoolHead = SlotNode(poolHeadSlot + 1);
+	m_pPoolRoot = m_pages.front()->m_pNodes;
+	return ELoadResult::Success;
+}
+
+void CQuadTree::ClearBatchGenerations_Recursive(CNode* pNode)
+{
+	pNode->m_batchGeneration = 0;
+	pNode->MarkDirty();
+	for (CNode* pOverflow = pNode->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+	{
+		pOverflow->m_batchGeneration = 0;
+		pOverflow->MarkDirty();
+	}
+
+	if (pNode->HasChildren())
+	{
+		ClearBatchGenerations_Recursive(pNode->m_pNorthWest);
+		ClearBatchGenerations_Recursive(pNode->m_pNorthEast);
+		ClearBatchGenerations_Recursive(pNode->m_pSouthEast);
+		ClearBatchGenerations_Recursive(pNode->m_pSouthWest);
+	}
+}
+
+void CQuadTree::EnableWriteBuffer(size_t mergeThreshold)
+{
+	assert(mergeThreshold > 0);
+	m_writeBufferThreshold = mergeThreshold;
+	m_writeBuffer.reserve(mergeThreshold);
+	if (m_writeBuffer.size() >= m_writeBufferThreshold)
+	{
+		FlushWriteBuffer();
+	}
+}
+
+void CQuadTree::DisableWriteBuffer()
+{
+	FlushWriteBuffer();
+	m_writeBufferThreshold = 0;
+}
+
+// The buffered points were checked against the tree and each other as they were inserted, so any the merge does not
+// insert were refused by the memory budget. Insert and InsertBatch already counted and recorded them.
+size_t CQuadTree::FlushWriteBuffer()
+{
+	if (m_writeBuffer.empty())
+	{
+		return 0;
+	}
+
+	const size_t refusedCount = m_writeBuffer.size() - MergePoints(m_writeBuffer.data(), m_writeBuffer.size());
+	m_writeBuffer.clear();
+	return refusedCount;
+}
+
+void CQuadTree::EnableLeafCache(size_t setCount)
+{
+	assert(setCount > 0);
+	assert(m_readerCounts[0].load() == 0 && m_readerCounts[1].load() == 0);
+	size_t roundedSetCount = 1;
+	while (roundedSetCount < setCount)
+	{
+		roundedSetCount *= 2;
+	}
+
+	// One set more than needed leaves room to start the sets on a line boundary
+	static_assert(sizeof(CLeafCacheSet) == 64, "A leaf cache set is expected to fill one cache line");
+	const size_t storageBytes = (roundedSetCount + 1) * sizeof(CLeafCacheSet);
+	m_pLeafCacheStorage.reset(new uint8_t[storageBytes]());
+	const uintptr_t storageAddress = reinterpret_cast<uintptr_t>(m_pLeafCacheStorage.get());
+	m_pLeafCache = reinterpret_cast<CLeafCacheSet*>((storageAddress + sizeof(CLeafCacheSet) - 1) & ~uintptr_t(sizeof(CLeafCacheSet) - 1));
+	m_leafCacheMask = roundedSetCount - 1;
+}
+
+void CQuadTree::DisableLeafCache()
+{
+	assert(m_readerCounts[0].load() == 0 && m_readerCounts[1].load() == 0);
+	m_pLeafCache = nullptr;
+	m_pLeafCacheStorage.reset();
+}
+
+CQuadTree::CLeafCacheSet& CQuadTree::LeafCacheSet(const CCoordinate& point)
+{
+	const uint64_t hash = point.x * 0x9E3779B97F4A7C15ull ^ point.y * 0xC2B2AE3D27D4EB4Full;
+	return m_pLeafCache[static_cast<size_t>(hash >> 32) & m_leafCacheMask];
+}
+
+void CQuadTree::Reset()
+{
+	COperationScope operationScope(*this, CMetrics::EOperation::Reset);
+	if (m_pRecorder != nullptr)
+	{
+		m_pRecorder->Record(CWorkloadRecorder::EOperation::Reset);
+	}
+
+	QUADTREE_PROBE1(reset__entry, m_pages.size());
+	m_writeBuffer.clear();
+	m_inlinePoints.clear();
+	m_pPoolHead = m_pPoolRoot;
+	constexpr TScalar minValue = std::numeric_limits<TScalar>::min();
+	constexpr TScalar maxValue = std::numeric_limits<TScalar>::max();
+	m_pBatchRoot = nullptr;
+	m_pBatchWatermark = nullptr;
+	RestartCompaction();
+	ReleaseFreeNodes();
+	AdvanceStructureVersion();
+	{
+		std::lock_guard<std::mutex> lock(m_accessCountMutex);
+		m_accessCounts.clear();
+	}
+
+	// A tree that has not left inline mode yet stays inline
+	if (m_inlineCapacity == 0 || m_pPoolRoot != nullptr)
+	{
+		m_pTreeRoot.store(AllocateRegionNode(CBounds(CCoordinate(minValue, minValue), CCoordinate(maxValue, maxValue))), std::memory_order_release);
+	}
+
+	QUADTREE_PROBE1(reset__return, m_pages.size());
+}
+
+// Leaves inline mode: builds the pool and a tree holding the inline points. The tree is built regardless of the
+// memory budget, which only holds back the inserts after it.
+void CQuadTree::BuildInlineTree()
+{
+	if (m_pTreeRoot.load(std::memory_order_relaxed) != nullptr)
+	{
+		return;
+	}
+
+	std::vector<CKeyedCoordinate> entries;
+	entries.reserve(m_inlinePoints.size());
+	for (const CCoordinate& point : m_inlinePoints)
+	{
+		entries.emplace_back(point);
+	}
+
+	std::sort(entries.begin(), entries.end());
+	constexpr TScalar minValue = std::numeric_limits<TScalar>::min();
+	constexpr TScalar maxValue = std::numeric_limits<TScalar>::max();
+	const size_t memoryBudget = m_memoryBudget;
+	m_memoryBudget = 0;
+	CNode* pTreeRoot = AllocateRegionNode(CBounds(CCoordinate(minValue, minValue), CCoordinate(maxValue, maxValue)));
+	InsertSorted(pTreeRoot, entries.data(), entries.size(), *this);
+	m_memoryBudget = memoryBudget;
+	m_pTreeRoot.store(pTreeRoot, std::memory_order_release);
+	std::vector<CCoordinate>().swap(m_inlinePoints);
+}
+
+// Gives the root its four children so each top level quadrant can be built on its own
+void CQuadTree::SplitRoot()
+{
+	assert(m_pBatchRoot == nullptr);
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+	assert(pTreeRoot != nullptr);
+	if (pTreeRoot->m_pNorthWest != nullptr)
+	{
+		return;
+	}
+
+	const bool hadPoint = pTreeRoot->m_nodeType == CNode::EType::Leaf;
+	const CCoordinate existingPoint = pTreeRoot->m_point;
+	const CNode* pOverflow = pTreeRoot->m_pOverflow;
+	pTreeRoot->m_pOverflow = nullptr;
+	AdvanceStructureVersion();
+	pTreeRoot->Split(*this);
+	if (hadPoint)
+	{
+		CNode* pExistingSubRegion = pTreeRoot->ContainingSubRegion(existingPoint);
+		assert(pExistingSubRegion != nullptr);
+		pExistingSubRegion->m_nodeType = CNode::EType::Leaf;
+		pExistingSubRegion->m_point = existingPoint;
+		pExistingSubRegion->MarkDirty();
+	}
+
+	// An erase can leave a bucket at the root, its points are spread over the new quadrants
+	for (; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+	{
+		for (uint32_t i = 0; i < pOverflow->m_bucketCount; ++i)
+		{
+			InsertAt(pTreeRoot, pOverflow->BucketPoint(i), *this);
+		}
+	}
+}
+
+void CQuadTree::SanityCheck() const
+{
+	assert(m_writeBufferThreshold == 0 ? m_writeBuffer.empty() : m_writeBuffer.size() < m_writeBufferThreshold);
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_acquire);
+	if (pTreeRoot == nullptr)
+	{
+		assert(m_inlinePoints.size() <= m_inlineCapacity && m_writeBuffer.empty() && m_pBatchRoot == nullptr);
+		return;
+	}
+
+	assert(m_inlinePoints.empty());
+	SanityCheckChild_Recursive(pTreeRoot);
+	if (m_pBatchRoot != nullptr)
+	{
+		SanityCheckChild_Recursive(m_pBatchRoot);
+	}
+}
+
+void CQuadTree::SanityCheckChild_Recursive(CNode* pChild) const
+{
+	assert(pChild);
+	// An unused node is told by its type, which the switch below rejects. Its empty bounds are those of the single cell
+	// region at the origin as well, where a leaf is valid.
+	assert(pChild->RegionBounds().max.x >= pChild->m_regionMin.x);
+	assert(pChild->RegionBounds().max.y >= pChild->m_regionMin.y);
+	assert(pChild->m_regionMin.x <= pChild->RegionBounds().max.x);
+	assert(pChild->m_regionMin.y <= pChild->RegionBounds().max.y);
+	switch (pChild->m_nodeType)
+	{
+	case CNode::EType::Leaf:
+		assert(pChild->m_pNorthWest == nullptr);
+		assert(pChild->m_pNorthEast == nullptr);
+		assert(pChild->m_pSouthEast == nullptr);
+		assert(pChild->m_pSouthWest == nullptr);
+		assert(pChild->RegionBounds().Contains(pChild->m_point));
+		for (const CNode* pOverflow = pChild->m_pOverflow; pOverflow != nullptr; pOverflow = pOverflow->m_pOverflow)
+		{
+			// A bucket keeps the region it was made in when a merge moves it up to a larger leaf
+			assert(pOverflow->m_nodeType == CNode::EType::Bucket);
+			assert(pOverflow->m_bucketCount > 0 && pOverflow->m_bucketCount <= pOverflow->BucketCapacity());
+			assert(pChild->RegionBounds().Contains(pOverflow->m_regionMin));
+			assert(pChild->RegionBounds().Contains(pOverflow->RegionBounds().max));
+			for (uint32_t i = 0; i < pOverflow->m_bucketCount; ++i)
+			{
+				assert(pOverflow->BucketPoint(i) != pChild->m_point);
+				assert(pOverflow->FindBucketPoint(pOverflow->BucketPoint(i)) == i);
+			}
+		}
+		break;
+	case CNode::EType::Region:
+		assert(pChild->m_point == CCoordinate(0, 0));
+		assert(pChild->m_pOverflow == nullptr);
+		if (pChild->m_pNorthWest)
+		{
+			assert(pChild->m_pNorthWest != nullptr);
+			assert(pChild->m_pNorthEast != nullptr);
+			assert(pChild->m_pSouthEast != nullptr);
+			assert(pChild->m_pSouthWest != nullptr);
+
+			assert(pChild->RegionBounds().Contains(pChild->m_pNorthWest->m_regionMin));
+			assert(pChild->RegionBounds().Contains(pChild->m_pNorthWest->RegionBounds().max));
+			assert(pChild->RegionBounds().Contains(pChild->m_pNorthEast->m_regionMin));
+			assert(pChild->RegionBounds().Contains(pChild->m_pNorthEast->RegionBounds().max));
+			assert(pChild->RegionBounds().Contains(pChild->m_pSouthEast->m_regionMin));
+			assert(pChild->RegionBounds().Contains(pChild->m_pSouthEast->RegionBounds().max));
+			assert(pChild->RegionBounds().Contains(pChild->m_pSouthWest->m_regionMin));
+			assert(pChild->RegionBounds().Contains(pChild->m_pSouthWest->RegionBounds().max));
+
+			// The children of a 2 x 2 cell region are single cells with min == max, so the comparisons of one axis
+			// against the other (a min of one child against a max of the next) only hold with equality there
+			assert(pChild->m_pNorthWest->m_regionMin.x < pChild->m_pNorthEast->m_regionMin.x);
+			assert(pChild->m_pNorthWest->m_regionMin.y == pChild->m_pNorthEast->m_regionMin.y);
+			assert(pChild->m_pNorthWest->RegionBounds().max.x < pChild->m_pNorthEast->m_regionMin.x);
+			assert(pChild->m_pNorthWest->RegionBounds().max.x < pChild->m_pNorthEast->RegionBounds().max.x);
+			assert(pChild->m_pNorthWest->m_regionMin.y <= pChild->m_pNorthEast->RegionBounds().max.y);
+			assert(pChild->m_pNorthWest->RegionBounds().max.y == pChild->m_pNorthEast->RegionBounds().max.y);
+
+			assert(pChild->m_pNorthEast->m_regionMin.x == pChild->m_pSouthEast->m_regionMin.x);
+			assert(pChild->m_pNorthEast->m_regionMin.y < pChild->m_pSouthEast->m_regionMin.y);
+			assert(pChild->m_pNorthEast->RegionBounds().max.x >= pChild->m_pSouthEast->m_regionMin.x);
+			assert(pChild->m_pNorthEast->RegionBounds().max.x == pChild->m_pSouthEast->RegionBounds().max.x);
+			assert(pChild->m_pNorthEast->m_regionMin.y < pChild->m_pSouthEast->RegionBounds().max.y);
+			assert(pChild->m_pNorthEast->RegionBounds().max.y < pChild->m_pSouthEast->RegionBounds().max.y);
+
+			assert(pChild->m_pSouthEast->m_regionMin.x > pChild->m_pSouthWest->m_regionMin.x);
+			assert(pChild->m_pSouthEast->m_regionMin.y == pChild->m_pSouthWest->m_regionMin.y);
+			assert(pChild->m_pSouthEast->RegionBounds().max.x > pChild->m_pSouthWest->m_regionMin.x);
+			assert(pChild->m_pSouthEast->RegionBounds().max.x > pChild->m_pSouthWest->RegionBounds().max.x);
+			assert(pChild->m_pSouthEast->m_regionMin.y <= pChild->m_pSouthWest->RegionBounds().max.y);
+			assert(pChild->m_pSouthEast->RegionBounds().max.y == pChild->m_pSouthWest->RegionBounds().max.y);
+
+			assert(pChild->m_pSouthWest->m_regionMin.x == pChild->m_pNorthWest->m_regionMin.x);
+			assert(pChild->m_pSouthWest->m_regionMin.y > pChild->m_pNorthWest->m_regionMin.y);
+			assert(pChild->m_pSouthWest->RegionBounds().max.x >= pChild->m_pNorthWest->m_regionMin.x);
+			assert(pChild->m_pSouthWest->RegionBounds().max.x == pChild->m_pNorthWest->RegionBounds().max.x);
+			assert(pChild->m_pSouthWest->m_regionMin.y > pChild->m_pNorthWest->RegionBounds().max.y);
+			assert(pChild->m_pSouthWest->RegionBounds().max.y > pChild->m_pNorthWest->RegionBounds().max.y);
+
+			if (pChild->m_pNorthWest->m_nodeType == CNode::EType::Leaf)
+			{
+				assert(pChild->RegionBounds().Contains(pChild->m_pNorthWest->m_point));
+			}
+
+			SanityCheckChild_Recursive(pChild->m_pNorthWest);
+
+			if (pChild->m_pNorthEast->m_nodeType == CNode::EType::Leaf)
+			{
+				assert(pChild->RegionBounds().Contains(pChild->m_pNorthEast->m_point));
+			}
+
+			SanityCheckChild_Recursive(pChild->m_pNorthEast);
+
+			if (pChild->m_pSouthEast->m_nodeType == CNode::EType::Leaf)
+			{
+				assert(pChild->RegionBounds().Contains(pChild->m_pSouthEast->m_point));
+			}
+			SanityCheckChild_Recursive(pChild->m_pSouthEast);
+
+			if (pChild->m_pSouthWest->m_nodeType == CNode::EType::Leaf)
+			{
+				assert(pChild->RegionBounds().Contains(pChild->m_pSouthWest->m_point));
+			}
+
+			SanityCheckChild_Recursive(pChild->m_pSouthWest);
+		}
+		else
+		{
+			assert(pChild->m_pNorthWest == nullptr);
+			assert(pChild->m_pNorthEast == nullptr);
+			assert(pChild->m_pSouthEast == nullptr);
+			assert(pChild->m_pSouthWest == nullptr);
+		}
+		break;
+	case CNode::EType::Bitmap:
+		assert(pChild->m_pNorthWest == nullptr);
+		assert(pChild->m_pSouthEast == nullptr);
+		assert(pChild->m_pOverflow == nullptr);
+		assert(pChild->RegionExtent() == kBitmapLeafSpan - 1);
+		assert(pChild->m_point.x != 0 && pChild->m_point.y == 0);
+		break;
+	case CNode::EType::Undefined:
+		assert(false);
+		break;
+	default:
+		assert(false);
+		break;
+	}
+}
+
+// Two finger compaction: the front finger walks up the pool chain to the next dead slot, the back finger walks down
+// from the pool head to the next live node and moves it there. Once the fingers cross every slot from the front finger
+// to the head is dead, so the head moves back to the front finger. A second walk then clears the dead slots up to the
+// end of the head's page, as a dropped node may still point into the pages past it, and those pages are released.
+bool CQuadTree::CompactPool(size_t maxNodes)
+{
+	assert(m_pBatchRoot == nullptr);
+	ReleaseFreeNodes();
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+	if (pTreeRoot == nullptr)
+	{
+		return true;
+	}
+	size_t examined = 0;
+	if (m_compactionScrubId == 0)
+	{
+		CNode* pFront = nullptr;
+		CNode* pBack = nullptr;
+		if (m_compactionFrontId == 0 || !NodeFromId(m_compactionFrontId, &pFront))
+		{
+			pFront = m_pPoolRoot;
+		}
+
+		// Nodes allocated after the pass started lie past the back finger and are left to the next pass
+		if (m_compactionHeadId == 0 || !NodeFromId(m_compactionBackId, &pBack))
+		{
+			pBack = PreviousPoolNode(m_pPoolHead);
+			m_compactionHeadId = NodeId(m_pPoolHead);
+		}
+
+		for (; pBack != nullptr && NodeId(pFront) <= NodeId(pBack); ++examined)
+		{
+			if (examined == maxNodes)
+			{
+				m_compactionFrontId = NodeId(pFront);
+				m_compactionBackId = NodeId(pBack);
+				return false;
+			}
+
+			CNode* pReferrer = nullptr;
+			if (pFront == pTreeRoot || FindNodeLink(pFront, &pReferrer) != nullptr)
+			{
+				pFront = pFront->pPoolNext;
+				continue;
+			}
+
+			if (pBack != pFront)
+			{
+				CNode** ppLink = pBack == pTreeRoot ? nullptr : FindNodeLink(pBack, &pReferrer);
+				if (pBack == pTreeRoot || ppLink != nullptr)
+				{
+					pFront->CopyNodeState(*pBack);
+					AdvanceStructureVersion();
+					if (ppLink != nullptr)
+					{
+						*ppLink = pFront;
+						pReferrer->MarkDirty();
+					}
+					else
+					{
+						pTreeRoot = pFront;
+						m_pTreeRoot.store(pFront, std::memory_order_release);
+					}
+
+					pBack->ResetNodeState();
+					pFront = pFront->pPoolNext;
+				}
+			}
+
+			pBack = PreviousPoolNode(pBack);
+		}
+
+		if (NodeId(m_pPoolHead) == m_compactionHeadId && NodeId(pFront) < m_compactionHeadId)
+		{
+			m_pPoolHead = pFront;
+		}
+
+		m_compactionScrubId = NodeId(m_pPoolRoot);
+	}
+
+	CNode* pScrub = nullptr;
+	NodeFromId(m_compactionScrubId, &pScrub);
+	const CPage* pHeadPage = PageOf(m_pPoolHead);
+	const CNode* pHeadPageEnd = &pHeadPage->m_pNodes[pHeadPage->m_nodeCount - 1];
+	const uint64_t headId = NodeId(m_pPoolHead);
+	for (; pScrub != nullptr; ++examined)
+	{
+		if (examined == maxNodes)
+		{
+			m_compactionScrubId = NodeId(pScrub);
+			return false;
+		}
+
+		CNode* pReferrer = nullptr;
+		if (pScrub->m_nodeType != CNode::EType::Undefined &&
+			(NodeId(pScrub) >= headId || (pScrub != pTreeRoot && FindNodeLink(pScrub, &pReferrer) == nullptr)))
+		{
+			pScrub->ResetNodeState();
+		}
+
+		pScrub = pScrub != pHeadPageEnd ? pScrub->pPoolNext : nullptr;
+	}
+
+	while (m_pages.size() > pHeadPage->m_index + 1)
+	{
+		ReleaseLastPage();
+	}
+
+	RestartCompaction();
+	return true;
+}
+
+// The link that references pNode in the committed tree, found by descending to the node's region, and the node holding
+// it. Null for the root and for nodes nothing references, which is how compaction tells live slots from dead ones.
+CQuadTree::CNode** CQuadTree::FindNodeLink(const CNode* pNode, CNode** ppReferrer)
+{
+	if (pNode->m_nodeType == CNode::EType::Undefined)
+	{
+		return nullptr;
+	}
+
+	CNode* pCurrent = m_pTreeRoot.load(std::memory_order_relaxed);
+	while (pCurrent->HasChildren() && pCurrent->RegionBounds() != pNode->RegionBounds())
+	{
+		if (!pCurrent->RegionBounds().Contains(pNode->m_regionMin))
+		{
+			return nullptr;
+		}
+
+		CNode** ppLink = pCurrent->ContainingSubRegionLink(pNode->m_regionMin);
+		if (*ppLink == pNode)
+		{
+			*ppReferrer = pCurrent;
+			return ppLink;
+		}
+
+		pCurrent = *ppLink;
+	}
+
+	// Overflow bucket nodes share the region of the leaf holding the bucket
+	for (CNode* pReferrer = pCurrent; pReferrer->m_pOverflow != nullptr; pReferrer = pReferrer->m_pOverflow)
+	{
+		if (pReferrer->m_pOverflow == pNode)
+		{
+			*ppReferrer = pReferrer;
+			return &pReferrer->m_pOverflow;
+		}
+	}
+
+	return nullptr;
+}
+
+// The node before pNode in the pool chain, null for the pool root
+CQuadTree::CNode* CQuadTree::PreviousPoolNode(const CNode* pNode) const
+{
+	const CPage* pPage = PageOf(pNode);
+	if (pNode != pPage->m_pNodes)
+	{
+		return const_cast<CNode*>(pNode - 1);
+	}
+
+	if (pPage->m_index == 0)
+	{
+		return nullptr;
+	}
+
+	const CPage* pPreviousPage = m_pages[pPage->m_index - 1].get();
+	return &pPreviousPage->m_pNodes[pPreviousPage->m_nodeCount - 1];
+}
+
+void CQuadTree::RestartCompaction()
+{
+	m_compactionFrontId = 0;
+	m_compactionBackId = 0;
+	m_compactionHeadId = 0;
+	m_compactionScrubId = 0;
+}
+
+void CQuadTree::BeginAccessProfile(uint32_t sampleInterval)
+{
+	assert(sampleInterval > 0);
+	m_accessCounts.clear();
+	m_accessSampleTick.store(0, std::memory_order_relaxed);
+	m_accessSampleInterval = sampleInterval;
+}
+
+// The hot nodes are the most visited top of the tree, as a node is visited at least as often as any of its children.
+// Laying them out is a depth first walk of that top, each node swapped into the next slot from the pool root.
+size_t CQuadTree::RelayoutHotPaths(size_t hotNodeCount)
+{
+	assert(m_pBatchRoot == nullptr);
+	m_accessSampleInterval = 0;
+	const CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+	std::vector<uint64_t> counts;
+	if (pTreeRoot != nullptr && hotNodeCount > 0)
+	{
+		CollectAccessCounts_Recursive(pTreeRoot, counts);
+	}
+
+	if (counts.empty())
+	{
+		m_accessCounts.clear();
+		return 0;
+	}
+
+	// Free nodes would otherwise be handed out again with hot nodes in them
+	ReleaseFreeNodes();
+	hotNodeCount = std::min(hotNodeCount, counts.size());
+	std::nth_element(counts.begin(), counts.begin() + (hotNodeCount - 1), counts.end(), std::greater<uint64_t>());
+	size_t remaining = hotNodeCount;
+	PlaceHotNode_Recursive(m_pTreeRoot.load(std::memory_order_relaxed), m_pPoolRoot, counts[hotNodeCount - 1], &remaining);
+	m_accessCounts.clear();
+	RestartCompaction();
+	return hotNodeCount - remaining;
+}
+
+void CQuadTree::CountAccessPath(CNode* pRoot, const CCoordinate& point)
+{
+	std::lock_guard<std::mutex> lock(m_accessCountMutex);
+	for (CNode* pNode = pRoot; ; pNode = pNode->ChildContaining(point))
+	{
+		++m_accessCounts[pNode];
+		if (!pNode->HasChildren())
+		{
+			break;
+		}
+	}
+}
+
+uint64_t CQuadTree::AccessCount(const CNode* pNode) const
+{
+	const auto it = m_accessCounts.find(pNode);
+	return it != m_accessCounts.end() ? it->second : 0;
+}
+
+// Visited nodes hang together from the root, so the walk stops at the first unvisited node of a path
+void CQuadTree::CollectAccessCounts_Recursive(const CNode* pNode, std::vector<uint64_t>& counts) const
+{
+	const uint64_t count = AccessCount(pNode);
+	if (count == 0)
+	{
+		return;
+	}
+
+	counts.push_back(count);
+	if (pNode->HasChildren())
+	{
+		for (uint8_t quadrant = 0; quadrant < 4; ++quadrant)
+		{
+			CollectAccessCounts_Recursive(pNode->QuadrantChild(quadrant), counts);
+		}
+	}
+}
+
+// Places pNode in pSlot and then its children visited at least threshold times, returns the slot after the last one used.
+// The children are read back from the placed node, as swapping one child's subtree into place can move a sibling.
+CQuadTree::CNode* CQuadTree::PlaceHotNode_Recursive(CNode* pNode, CNode* pSlot, uint64_t threshold, size_t* pRemaining)
+{
+	assert(pSlot != nullptr && NodeId(pSlot) < NodeId(m_pPoolHead));
+	pNode = SwapNodeSlots(pNode, pSlot);
+	--*pRemaining;
+	CNode* pNextSlot = pNode->pPoolNext;
+	if (!pNode->HasChildren())
+	{
+		return pNextSlot;
+	}
+
+	uint8_t quadrants[4] = { 0, 1, 2, 3 };
+	uint64_t counts[4];
+	for (uint8_t quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		counts[quadrant] = AccessCount(pNode->QuadrantChild(quadrant));
+	}
+
+	std::sort(quadrants, quadrants + 4, [&counts](uint8_t lhs, uint8_t rhs) { return counts[lhs] > counts[rhs]; });
+	for (uint8_t quadrant : quadrants)
+	{
+		if (*pRemaining == 0 || counts[quadrant] < threshold)
+		{
+			break;
+		}
+
+		pNextSlot = PlaceHotNode_Recursive(pNode->QuadrantChild(quadrant), pNextSlot, threshold, pRemaining);
+	}
+
+	return pNextSlot;
+}
+
+// Moves pNode into pSlot and the live node found in pSlot, if any, into pNode's old slot, along with their access
+// counts, and redirects the links to both. Returns pSlot.
+CQuadTree::CNode* CQuadTree::SwapNodeSlots(CNode* pNode, CNode* pSlot)
+{
+	if (pNode == pSlot)
+	{
+		return pSlot;
+	}
+
+	CNode* pTreeRoot = m_pTreeRoot.load(std::memory_order_relaxed);
+	CNode* pReferrer = nullptr;
+	CNode* pSlotReferrer = nullptr;
+	CNode** ppLink = pNode == pTreeRoot ? nullptr : FindNodeLink(pNode, &pReferrer);
+	CNode** ppSlotLink = pSlot == pTreeRoot ? nullptr : FindNodeLink(pSlot, &pSlotReferrer);
+	const bool slotLive = pSlot == pTreeRoot || ppSlotLink != nullptr;
+	assert(pNode == pTreeRoot || ppLink != nullptr);
+
+	// A link held by one of the two nodes moves with it
+	const auto movedLink = [](CNode** ppMoved, const CNode* pFrom, CNode* pTo)
+	{
+		return reinterpret_cast<CNode**>(reinterpret_cast<char*>(pTo) + (reinterpret_cast<char*>(ppMoved) - reinterpret_cast<const char*>(pFrom)));
+	};
+	if (pReferrer == pSlot)
+	{
+		ppLink = movedLink(ppLink, pSlot, pNode);
+		pReferrer = pNode;
+	}
+	if (pSlotReferrer == pNode)
+	{
+		ppSlotLink = movedLink(ppSlotLink, pNode, pSlot);
+		pSlotReferrer = pSlot;
+	}
+
+	AdvanceStructureVersion();
+	const CNode node = *pNode;
+	if (slotLive)
+	{
+		pNode->CopyNodeState(*pSlot);
+	}
+	else
+	{
+		pNode->ResetNodeState();
+	}
+	pSlot->CopyNodeState(node);
+
+	if (ppLink != nullptr)
+	{
+		*ppLink = pSlot;
+		pReferrer->MarkDirty();
+	}
+	else
+	{
+		m_pTreeRoot.store(pSlot, std::memory_order_release);
+	}
+
+	if (ppSlotLink != nullptr)
+	{
+		*ppSlotLink = pNode;
+		pSlotReferrer->MarkDirty();
+	}
+	else if (slotLive)
+	{
+		m_pTreeRoot.store(pNode, std::memory_order_release);
+	}
+
+	std::swap(m_accessCounts[pNode], m_accessCounts[pSlot]);
+	return pSlot;
+}
+
+// Frees the last page, the caller has made sure that none of its nodes are in use
+void CQuadTree::ReleaseLastPage()
+{
+	assert(m_pages.size() > 1);
+	QUADTREE_PROBE2(release_page, m_pages.size() - 1, m_pages.back()->m_nodeCount);
+	m_poolBytes.fetch_sub(m_pages.back()->m_nodeCount * sizeof(CNode), std::memory_order_relaxed);
+	m_pagesByAddress.erase(std::find(m_pagesByAddress.begin(), m_pagesByAddress.end(), m_pages.back().get()));
+	ReturnPage(std::move(m_pages.back()));
+	m_pages.pop_back();
+	m_checkpointedPageCount = std::min(m_checkpointedPageCount, m_pages.size());
+	const CPage* pTailPage = m_pages.back().get();
+	CNode* pTail = &pTailPage->m_pNodes[pTailPage->m_nodeCount - 1];
+	pTail->pPoolNext = nullptr;
+	pTail->MarkDirty();
+}
+
+void CQuadTree::AllocatePage(size_t nodeCount)
+{
+	assert(nodeCount > 0 && nodeCount <= kMaxPageSize);
+	QUADTREE_PROBE2(allocate_page__entry, m_pages.size(), nodeCount);
+	LinkPage(CreatePage(nodeCount));
+}
+
+// Links a page just added to m_pages behind the last node of the pool chain, the last node of the page before it
+void CQuadTree::LinkPage(CPage* pPage)
+{
+	assert(pPage == m_pages.back().get());
+	const CPage* pPreviousPage = pPage->m_index > 0 ? m_pages[pPage->m_index - 1].get() : nullptr;
+	CNode* pTail = pPreviousPage != nullptr ? &pPreviousPage->m_pNodes[pPreviousPage->m_nodeCount - 1] : nullptr;
+	CNode* pPages = pPage->m_pNodes;
+	if (m_pPoolRoot == nullptr)
+	{
+		assert(m_pPoolHead == nullptr);
+		m_pPoolRoot = m_pPoolHead = pPages;
+	}
+	else
+	{
+		assert(pTail != nullptr && pTail->pPoolNext == nullptr);
+		pTail->pPoolNext = pPages;
+		pTail->MarkDirty();
+	}
+
+	QUADTREE_PROBE2(allocate_page__return, m_pages.size() - 1, m_pages.size());
+	if (IsUnderMemoryPressure())
+	{
+		NotifyMemoryPressure();
+	}
+}
+
+size_t CQuadTree::NextPageSize() const
+{
+	return m_pages.empty() ? m_pageSize : GrownPageSize(m_pages.back()->m_nodeCount);
+}
+
+size_t CQuadTree::GrownPageSize(size_t previousPageSize) const
+{
+	return GrownPageSize(previousPageSize, m_pageSize, m_pageGrowthFactor, m_maxPageSize);
+}
+
+size_t CQuadTree::GrownPageSize(size_t previousPageSize, size_t minPageSize, size_t growthFactor, size_t maxPageSize)
+{
+	const size_t grownPageSize = previousPageSize > maxPageSize / growthFactor ? maxPageSize : previousPageSize * growthFactor;
+	return std::max(minPageSize, std::min(grownPageSize, maxPageSize));
+}
+
+void CQuadTree::SetPageGrowth(size_t growthFactor, size_t maxPageSize)
+{
+	assert(growthFactor > 0);
+	assert(maxPageSize >= m_pageSize && maxPageSize <= kMaxPageSize);
+	m_pageGrowthFactor = growthFactor;
+	m_maxPageSize = maxPageSize;
+}
+
+void CQuadTree::Reserve(size_t expectedPoints, const CCoordinate* pSample, size_t sampleCount)
+{
+	assert(pSample != nullptr || sampleCount == 0);
+	if (m_pTreeRoot.load(std::memory_order_relaxed) == nullptr)
+	{
+		if (expectedPoints <= m_inlineCapacity)
+		{
+			return;
+		}
+
+		BuildInlineTree();
+	}
+
+	// Clustered points share the splits above their clusters, so each point adds fewer nodes the denser the points get
+	// and the sample's nodes per point overstate what a full build needs. Points past the sample are estimated at what
+	// the second half of the sample added per point, and the estimate is capped at the sample's nodes per point.
+	double nodeEstimate = 3.0 * static_cast<double>(expectedPoints);
+	if (sampleCount > 0)
+	{
+		CQuadTree sampleTree(std::max<size_t>(sampleCount * 3, 1024));
+		sampleTree.InsertBatch(pSample, sampleCount / 2);
+		const CMetrics halfMetrics = sampleTree.GetMetrics();
+		sampleTree.InsertBatch(pSample + sampleCount / 2, sampleCount - sampleCount / 2);
+		const CMetrics sampleMetrics = sampleTree.GetMetrics();
+		const double samplePoints = static_cast<double>(std::max<uint64_t>(sampleMetrics.pointCount, 1));
+		const double nodesPerPoint = static_cast<double>(sampleMetrics.nodeCount) / samplePoints;
+		const double nodesPerLaterPoint = static_cast<double>(sampleMetrics.nodeCount - halfMetrics.nodeCount) /
+			static_cast<double>(std::max<uint64_t>(sampleMetrics.pointCount - halfMetrics.pointCount, 1));
+		const double laterPoints = std::max(static_cast<double>(expectedPoints) - samplePoints, 0.0);
+		nodeEstimate = std::min(static_cast<double>(sampleMetrics.nodeCount) + nodesPerLaterPoint * laterPoints,
+			nodesPerPoint * static_cast<double>(expectedPoints));
+	}
+
+	size_t nodeCount = static_cast<size_t>(std::ceil(nodeEstimate));
+	size_t freeCount = 0;
+	for (const CNode* pNode = m_pPoolHead; pNode != nullptr && pNode->pPoolNext != nullptr && freeCount < nodeCount; pNode = pNode->pPoolNext)
+	{
+		++freeCount;
+	}
+
+	nodeCount -= freeCount;
+	if (m_memoryBudget != 0)
+	{
+		const size_t poolBytes = m_poolBytes.load(std::memory_order_relaxed);
+		nodeCount = std::min(nodeCount, poolBytes < m_memoryBudget ? (m_memoryBudget - poolBytes) / sizeof(CNode) : 0);
+	}
+
+	// The reservation is one page where node ids allow it, growth then carries on from its size
+	while (nodeCount > 0)
+	{
+		const size_t pageSize = nodeCount < kMaxPageSize ? nodeCount : kMaxPageSize;
+		AllocatePage(pageSize);
+		nodeCount -= pageSize;
+	}
+}
+
+// Appends a page whose nodes are chained to each other but not yet to the rest of the pool
+CQuadTree::CPage* CQuadTree::CreatePage(size_t nodeCount)
+{
+	return AdoptPage(TakePage(nodeCount));
+}
+
+// Builds a page apart from any tree, so the refill thread can build pages while the pool is in use
+std::unique_ptr<CQuadTree::CPage> CQuadTree::BuildPage(size_t nodeCount)
+{
+	assert(nodeCount > 0);
+	std::unique_ptr<CPage> pPage(new CPage());
+	pPage->m_pStorage.reset(new CNode[nodeCount]());
+	pPage->m_pNodes = pPage->m_pStorage.get();
+	pPage->m_nodeCount = nodeCount;
+	CNode* pPages = pPage->m_pNodes;
+	size_t lastIndex = nodeCount - 1;
+	for (size_t i = 0; i < lastIndex; ++i)
+	{
+		CNode* pCurrentPage = &pPages[i];
+		pCurrentPage->pPoolNext = pCurrentPage + 1;
+	}
+
+	pPages[lastIndex].pPoolNext = nullptr;
+	return pPage;
+}
+
+CQuadTree::CPage* CQuadTree::AdoptPage(std::unique_ptr<CPage> pPage)
+{
+	static_assert(sizeof(CNode) <= 88, "A node is expected to stay within 88 bytes, below the 96 of the original layout");
+	pPage->m_index = m_pages.size();
+	m_poolBytes.fetch_add(pPage->m_nodeCount * sizeof(CNode), std::memory_order_relaxed);
+	const CNode* pNodes = pPage->m_pNodes;
+	m_pagesByAddress.insert(std::upper_bound(m_pagesByAddress.begin(), m_pagesByAddress.end(), pNodes, [](const CNode* pKey, const CPage* pOther)
+	{
+		return std::less<const CNode*>()(pKey, pOther->m_pNodes);
+	}), pPage.get());
+	m_pages.push_back(std::move(pPage));
+	return m_pages.back().get();
+}
+
+// Whether count more nodes fit, from the free end of the pool and from pages the memory budget still allows
+bool CQuadTree::CanAllocateNodes(size_t count) const
+{
+	if (m_memoryBudget == 0)
+	{
+		return true;
+	}
+
+	// The tail of the chain is only handed out once another page is linked behind it, which then adds a full page
+	size_t freeCount = CanReuseFreeNodes() ? m_freeNodes.size() : 0;
+	for (const CNode* pNode = m_pPoolHead; pNode != nullptr && pNode->pPoolNext != nullptr && freeCount < count; pNode = pNode->pPoolNext)
+	{
+		++freeCount;
+	}
+
+	if (freeCount >= count)
+	{
+		return true;
+	}
+
+	size_t poolBytes = m_poolBytes.load(std::memory_order_relaxed);
+	size_t pageSize = NextPageSize();
+	for (size_t remaining = count - freeCount; remaining > 0; pageSize = GrownPageSize(pageSize))
+	{
+		poolBytes += pageSize * sizeof(CNode);
+		remaining -= std::min(remaining, pageSize);
+	}
+
+	return poolBytes <= m_memoryBudget;
+}
+
+bool CQuadTree::IsUnderMemoryPressure() const
+{
+	return m_memoryBudget != 0 && m_poolBytes.load(std::memory_order_relaxed) >= m_memoryPressureBytes;
+}
+
+void CQuadTree::NotifyMemoryPressure()
+{
+	if (m_memoryPressureCallback)
+	{
+		m_memoryPressureCallback(m_poolBytes.load(std::memory_order_relaxed), m_memoryBudget);
+	}
+}
+
+void CQuadTree::SetMemoryBudget(size_t budgetBytes, double pressureFraction)
+{
+	assert(pressureFraction >= 0.0 && pressureFraction <= 1.0);
+	m_memoryBudget = budgetBytes;
+	m_memoryPressureBytes = static_cast<size_t>(static_cast<double>(budgetBytes) * pressureFraction);
+}
+
+void CQuadTree::SetMemoryPressureCallback(std::function<void(size_t poolBytes, size_t budgetBytes)> callback)
+{
+	m_memoryPressureCallback = std::move(callback);
+}
+
+CQuadTree::CNode* CQuadTree::AllocateNode()
+{
+	if (m_freeNodes.empty() && !(m_retiredNodes.empty() && m_waitingNodes.empty()))
+	{
+		ReclaimRetiredNodes();
+	}
+
+	if (!m_freeNodes.empty() && CanReuseFreeNodes())
+	{
+		CNode* pFreeNode = m_freeNodes.back();
+		m_freeNodes.pop_back();
+		if (m_pBatchRoot != nullptr)
+		{
+			m_batchReusedNodes.push_back(pFreeNode);
+		}
+
+		pFreeNode->ResetNodeState();
+		pFreeNode->m_batchGeneration = m_pBatchRoot != nullptr ? m_batchGeneration : 0;
+		return pFreeNode;
+	}
+
+	if (m_pPoolHead == nullptr || m_pPoolHead->pPoolNext == nullptr)
+	{
+		AllocateNextPage();
+	}
+
+	assert(m_pPoolHead != nullptr);
+	assert(m_pPoolHead->pPoolNext != nullptr);
+	CNode* pAllocatedNode = m_pPoolHead;
+	pAllocatedNode->ResetNodeState();
+	pAllocatedNode->m_batchGeneration = m_pBatchRoot != nullptr ? m_batchGeneration : 0;
+	m_pPoolHead = pAllocatedNode->pPoolNext;
+	return pAllocatedNode;
+}
+
+CQuadTree::CNode* CQuadTree::CloneNode(const CNode* pSource)
+{
+	CNode* pClone = AllocateNode();
+	const uint32_t batchGeneration = pClone->m_batchGeneration;
+	pClone->CopyNodeState(*pSource);
+	pClone->m_batchGeneration = batchGeneration;
+	return pClone;
+}
+
+// A dropped node may still be read by a Find that passed its parent, so it waits among the retired nodes for those
+// Finds to return. Within a batch the committed tree still references it, and Commit retires it.
+void CQuadTree::RetireNode(CNode* pNode)
+{
+	(m_pBatchRoot != nullptr ? m_batchReplacedNodes : m_retiredNodes).push_back(pNode);
+}
+
+// A node replaced during one read epoch is freed in the epoch after next. The epoch only advances once the Finds begun
+// in the one before it have returned, and a Find begun earlier that read the old root would still be counted there.
+void CQuadTree::ReclaimRetiredNodes()
+{
+	const uint64_t readEpoch = m_readEpoch.load(std::memory_order_relaxed);
+	if (m_readerCounts[(readEpoch - 1) & 1].load() != 0)
+	{
+		return;
+	}
+
+	m_freeNodes.insert(m_freeNodes.end(), m_waitingNodes.begin(), m_waitingNodes.end());
+	m_waitingNodes.swap(m_retiredNodes);
+	m_retiredNodes.clear();
+	m_readEpoch.store(readEpoch + 1);
+}
+
+// Compaction, relayout and loading move or discard the slots, the nodes in them are reclaimed as dead slots instead
+void CQuadTree::ReleaseFreeNodes()
+{
+	m_batchReplacedNodes.clear();
+	m_batchReusedNodes.clear();
+	m_retiredNodes.clear();
+	m_waitingNodes.clear();
+	m_freeNodes.clear();
+}
+
+// Detaches count nodes from the front of the pool for a CNodeReservation, the nodes stay linked through pPoolNext
+CQuadTree::CNode* CQuadTree::ReserveNodes(size_t count)
+{
+	assert(count > 0);
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	CNode* pFirstNode = nullptr;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (m_pPoolHead == nullptr || m_pPoolHead->pPoolNext == nullptr)
+		{
+			AllocateNextPage();
+		}
+
+		if (pFirstNode == nullptr)
+		{
+			pFirstNode = m_pPoolHead;
+		}
+
+		m_pPoolHead = m_pPoolHead->pPoolNext;
+	}
+
+	return pFirstNode;
+}
+
+CQuadTree::CNode* CQuadTree::AllocateLeafNode(const CCoordinate& point, const CBounds& regionBounds)
+{
+	CNode* pLeafNode = AllocateNode();
+	assert(pLeafNode != nullptr);
+	pLeafNode->InitializeAsLeaf(point, regionBounds);
+	return pLeafNode;
+}
+
+CQuadTree::CNode* CQuadTree::AllocateRegionNode(const CBounds& regionBounds)
+{
+	CNode* pLeafNode = AllocateNode();
+	assert(pLeafNode != nullptr);
+	pLeafNode->InitializeAsRegion(regionBounds);
+	return pLeafNode;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CBoundedSpscQueue
+// Lock free ring buffer with exactly one producer thread and one consumer thread
+template<typename T>
+class CBoundedSpscQueue
+{
+public:
+	explicit CBoundedSpscQueue(size_t capacity);
+
+	bool TryPush(const T& value);
+	bool TryPop(T* pValue);
+	bool Empty() const;
+
+private:
+	std::vector<T> m_slots;
+	size_t m_mask;
+	// Padded apart so the producer and consumer do not false share a cache line
+	char m_headPadding[64];
+	std::atomic<size_t> m_head; // next slot to pop, written by the consumer
+	char m_tailPadding[64];
+	std::atomic<size_t> m_tail; // next slot to push, written by the producer
+};
+
+template<typename T>
+CBoundedSpscQueue<T>::CBoundedSpscQueue(size_t capacity)
+	: m_mask(0)
+	, m_head(0)
+	, m_tail(0)
+{
+	assert(capacity > 0);
+	size_t roundedCapacity = 1;
+	while (roundedCapacity < capacity)
+	{
+		roundedCapacity <<= 1;
+	}
+
+	m_slots.resize(roundedCapacity);
+	m_mask = roundedCapacity - 1;
+}
+
+template<typename T>
+bool CBoundedSpscQueue<T>::TryPush(const T& value)
+{
+	const size_t tail = m_tail.load(std::memory_order_relaxed);
+	if (tail - m_head.load(std::memory_order_acquire) == m_slots.size())
+	{
+		return false;
+	}
+
+	m_slots[tail & m_mask] = value;
+	m_tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+template<typename T>
+bool CBoundedSpscQueue<T>::TryPop(T* pValue)
+{
+	assert(pValue != nullptr);
+	const size_t head = m_head.load(std::memory_order_relaxed);
+	if (head == m_tail.load(std::memory_order_acquire))
+	{
+		return false;
+	}
+
+	*pValue = m_slots[head & m_mask];
+	m_head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+template<typename T>
+bool CBoundedSpscQueue<T>::Empty() const
+{
+	return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CPageRefill
+// Builds pages ahead of the pool on a background thread, see CQuadTree::EnablePageRefill
+class CQuadTree::CPageRefill
+{
+public:
+	CPageRefill(const CQuadTree& quadTree, size_t reservePages);
+	~CPageRefill();
+
+	CPage* TryTakePage(); // null when no page is ready, the caller owns the page
+
+private:
+	void Run(size_t firstPageSize);
+
+	// The tree's growth policy when the refill started, the thread never reads the tree itself
+	const size_t m_minPageSize;
+	const size_t m_growthFactor;
+	const size_t m_maxPageSize;
+	CBoundedSpscQueue<CPage*> m_queue;
+	std::atomic<bool> m_stop;
+	std::thread m_thread;
+};
+
+CQuadTree::CPageRefill::CPageRefill(const CQuadTree& quadTree, size_t reservePages)
+	: m_minPageSize(quadTree.m_pageSize)
+	, m_growthFactor(quadTree.m_pageGrowthFactor)
+	, m_maxPageSize(quadTree.m_maxPageSize)
+	, m_queue(reservePages)
+	, m_stop(false)
+{
+	m_thread = std::thread(&CPageRefill::Run, this, quadTree.NextPageSize());
+}
+
+CQuadTree::CPageRefill::~CPageRefill()
+{
+	m_stop.store(true, std::memory_order_release);
+	m_thread.join();
+	for (CPage* pPage = TryTakePage(); pPage != nullptr; pPage = TryTakePage())
+	{
+		delete pPage;
+	}
+}
+
+CQuadTree::CPage* CQuadTree::CPageRefill::TryTakePage()
+{
+	CPage* pPage = nullptr;
+	return m_queue.TryPop(&pPage) ? pPage : nullptr;
+}
+
+// Follows the pool's growth from the page it would allocate next. new CNode[]() writes every node, so pages arrive faulted in.
+void CQuadTree::CPageRefill::Run(size_t firstPageSize)
+{
+	size_t pageSize = firstPageSize;
+	std::unique_ptr<CPage> pPage;
+	while (!m_stop.load(std::memory_order_acquire))
+	{
+		if (pPage == nullptr)
+		{
+			pPage = BuildPage(pageSize);
+			pageSize = GrownPageSize(pageSize, m_minPageSize, m_growthFactor, m_maxPageSize);
+		}
+
+		if (m_queue.TryPush(pPage.get()))
+		{
+			pPage.release();
+		}
+		else
+		{
+			// The reserve is full, it drains by a page at a time so polling is enough
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+CQuadTree::~CQuadTree()
+{
+	DisablePageRefill();
+	for (std::unique_ptr<CPage>& pPage : m_pages)
+	{
+		ReturnPage(std::move(pPage));
+	}
+}
+
+void CQuadTree::EnablePageRefill(size_t reservePages)
+{
+	assert(reservePages > 0);
+	m_pPageRefill.reset();
+	m_pPageRefill.reset(new CPageRefill(*this, reservePages));
+}
+
+void CQuadTree::DisablePageRefill()
+{
+	m_pPageRefill.reset();
+}
+
+// Takes the next page from the refill thread when one is ready, otherwise builds it here. Each page built here puts
+// the thread a page behind the pool's growth, so queued pages smaller than the pool's next page are dropped.
+void CQuadTree::AllocateNextPage()
+{
+	std::unique_ptr<CPage> pPage(m_pPageRefill != nullptr ? m_pPageRefill->TryTakePage() : nullptr);
+	while (pPage != nullptr && pPage->m_nodeCount < NextPageSize())
+	{
+		pPage.reset(m_pPageRefill->TryTakePage());
+	}
+
+	if (pPage != nullptr && m_memoryBudget != 0 &&
+		m_poolBytes.load(std::memory_order_relaxed) + pPage->m_nodeCount * sizeof(CNode) > m_memoryBudget)
+	{
+		// The refill thread does not know the budget, a page that would break it is dropped
+		pPage.reset();
+	}
+
+	if (pPage == nullptr)
+	{
+		AllocatePage(NextPageSize());
+		return;
+	}
+
+	QUADTREE_PROBE2(allocate_page__entry, m_pages.size(), pPage->m_nodeCount);
+	LinkPage(AdoptPage(std::move(pPage)));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CQuadTreeForest
+CQuadTreeForest::CQuadTreeForest(size_t pageSize, size_t inlineCapacity)
+	: m_pageSize(pageSize)
+	, m_runSize(std::max<size_t>(pageSize / 64, 2))
+	, m_inlineCapacity(inlineCapacity)
+	, m_slabNodeCount(0)
+{
+	assert(pageSize > 1);
+}
+
+CQuadTreeForest::~CQuadTreeForest()
+{
+	// The trees hand their pages back to the pool as they go
+	m_trees.clear();
+}
+
+CQuadTreeForest::TTreeId CQuadTreeForest::CreateTree()
+{
+	std::unique_ptr<CQuadTree> pTree(new CQuadTree(this, m_runSize, m_inlineCapacity));
+	pTree->SetPageGrowth(2, m_pageSize);
+	if (m_freeTreeIds.empty())
+	{
+		m_trees.push_back(std::move(pTree));
+		return m_trees.size() - 1;
+	}
+
+	const TTreeId treeId = m_freeTreeIds.back();
+	m_freeTreeIds.pop_back();
+	m_trees[treeId] = std::move(pTree);
+	return treeId;
+}
+
+void CQuadTreeForest::DestroyTree(TTreeId treeId)
+{
+	assert(treeId < m_trees.size() && m_trees[treeId] != nullptr);
+	m_trees[treeId].reset();
+	m_freeTreeIds.push_back(treeId);
+}
+
+CQuadTree& CQuadTreeForest::GetTree(TTreeId treeId)
+{
+	assert(treeId < m_trees.size() && m_trees[treeId] != nullptr);
+	return *m_trees[treeId];
+}
+
+size_t CQuadTreeForest::GetPooledPageCount() const
+{
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	return m_pooledPages.size();
+}
+
+size_t CQuadTreeForest::GetPageCount() const
+{
+	size_t pageCount = 0;
+	for (const std::unique_ptr<CQuadTree>& pTree : m_trees)
+	{
+		for (size_t page = 0; pTree != nullptr && page < pTree->m_pages.size(); ++page)
+		{
+			pageCount += pTree->m_pages[page]->m_pStorage != nullptr && pTree->m_pages[page]->m_nodeCount == m_pageSize ? 1 : 0;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	return pageCount + m_pooledPages.size() + m_slabs.size();
+}
+
+// The runs a tree holds count towards its own bytes, so the slabs only add what is not handed out
+size_t CQuadTreeForest::GetAllocatedBytes() const
+{
+	size_t allocatedBytes = m_trees.capacity() * sizeof(m_trees[0]) + m_freeTreeIds.capacity() * sizeof(TTreeId);
+	size_t runNodeCount = 0;
+	for (const std::unique_ptr<CQuadTree>& pTree : m_trees)
+	{
+		allocatedBytes += pTree != nullptr ? sizeof(CQuadTree) + pTree->GetAllocatedBytes() : 0;
+		for (size_t page = 0; pTree != nullptr && page < pTree->m_pages.size(); ++page)
+		{
+			runNodeCount += pTree->m_pages[page]->m_pStorage == nullptr ? pTree->m_pages[page]->m_nodeCount : 0;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	allocatedBytes += m_pooledPages.capacity() * sizeof(m_pooledPages[0]);
+	allocatedBytes += m_pooledPages.size() * (sizeof(CQuadTree::CPage) + m_pageSize * sizeof(CQuadTree::CNode));
+	allocatedBytes += m_slabs.capacity() * sizeof(m_slabs[0]) + (m_slabs.size() * m_pageSize - runNodeCount) * sizeof(CQuadTree::CNode);
+	return allocatedBytes;
+}
+
+void CQuadTreeForest::ReleasePooledPages()
+{
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	std::vector<std::unique_ptr<CQuadTree::CPage>>().swap(m_pooledPages);
+}
+
+// Pooled pages and runs still hold the nodes of the tree that had them, so they are cleared and chained as a built page would be
+void CQuadTreeForest::ClearNodes(CQuadTree::CNode* pNodes, size_t nodeCount)
+{
+	for (size_t i = 0; i < nodeCount; ++i)
+	{
+		pNodes[i] = CQuadTree::CNode();
+		pNodes[i].pPoolNext = i + 1 < nodeCount ? &pNodes[i + 1] : nullptr;
+	}
+}
+
+std::unique_ptr<CQuadTree::CPage> CQuadTreeForest::TakePage()
+{
+	std::unique_ptr<CQuadTree::CPage> pPage;
+	{
+		std::lock_guard<std::mutex> lock(m_poolMutex);
+		if (m_pooledPages.empty())
+		{
+			return nullptr;
+		}
+
+		pPage = std::move(m_pooledPages.back());
+		m_pooledPages.pop_back();
+	}
+
+	ClearNodes(pPage->m_pNodes, pPage->m_nodeCount);
+	return pPage;
+}
+
+void CQuadTreeForest::ReturnPage(std::unique_ptr<CQuadTree::CPage> pPage)
+{
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	m_pooledPages.push_back(std::move(pPage));
+}
+
+// A freed run of the same size if there is one, otherwise the next nodes of the last slab. A run that does not fit
+// in what is left of the slab starts a new one, from a pooled page when there is one.
+std::unique_ptr<CQuadTree::CPage> CQuadTreeForest::TakeRun(size_t nodeCount)
+{
+	assert(nodeCount < m_pageSize);
+	std::unique_ptr<CQuadTree::CPage> pRun(new CQuadTree::CPage());
+	pRun->m_nodeCount = nodeCount;
+	{
+		std::lock_guard<std::mutex> lock(m_poolMutex);
+		std::vector<CQuadTree::CNode*>& freeRuns = m_freeRuns[nodeCount];
+		if (!freeRuns.empty())
+		{
+			pRun->m_pNodes = freeRuns.back();
+			freeRuns.pop_back();
+		}
+		else
+		{
+			if (m_slabs.empty() || m_slabNodeCount + nodeCount > m_pageSize)
+			{
+				if (m_pooledPages.empty())
+				{
+					m_slabs.emplace_back(new CQuadTree::CNode[m_pageSize]());
+				}
+				else
+				{
+					m_slabs.push_back(std::move(m_pooledPages.back()->m_pStorage));
+					m_pooledPages.pop_back();
+				}
+
+				m_slabNodeCount = 0;
+			}
+
+			pRun->m_pNodes = m_slabs.back().get() + m_slabNodeCount;
+			m_slabNodeCount += nodeCount;
+		}
+	}
+
+	ClearNodes(pRun->m_pNodes, nodeCount);
+	return pRun;
+}
+
+void CQuadTreeForest::ReturnRun(std::unique_ptr<CQuadTree::CPage> pRun)
+{
+	std::lock_guard<std::mutex> lock(m_poolMutex);
+	m_freeRuns[pRun->m_nodeCount].push_back(pRun->m_pNodes);
+}
+
+// Pages of the forest's page size come from its pool and smaller ones are runs of its slabs, anything else is built
+std::unique_ptr<CQuadTree::CPage> CQuadTree::TakePage(size_t nodeCount)
+{
+	if (m_pForest != nullptr && nodeCount < m_pForest->m_pageSize)
+	{
+		return m_pForest->TakeRun(nodeCount);
+	}
+
+	std::unique_ptr<CPage> pPage(m_pForest != nullptr && nodeCount == m_pForest->m_pageSize ? m_pForest->TakePage() : nullptr);
+	return pPage != nullptr ? std::move(pPage) : BuildPage(nodeCount);
+}
+
+void CQuadTree::ReturnPage(std::unique_ptr<CPage> pPage)
+{
+	if (pPage->m_pStorage == nullptr)
+	{
+		m_pForest->ReturnRun(std::move(pPage));
+	}
+	else if (m_pForest != nullptr && pPage->m_nodeCount == m_pForest->m_pageSize)
+	{
+		m_pForest->ReturnPage(std::move(pPage));
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CDenseQuadTree
+namespace
+{
+	// Mask of the bits of word wordIndex that fall in [begin, end)
+	inline uint64_t RangeMask(uint64_t wordIndex, uint64_t begin, uint64_t end)
+	{
+		const uint64_t wordBegin = wordIndex << 6;
+		const uint64_t low = begin > wordBegin ? begin - wordBegin : 0;
+		const uint64_t high = end - wordBegin < 64 ? end - wordBegin : 64;
+		const uint64_t highMask = high == 64 ? ~0ull : (1ull << high) - 1;
+		return highMask & ~((1ull << low) - 1);
+	}
+}
+
+CDenseQuadTree::CDenseQuadTree(uint32_t bits)
+	: m_bits(bits)
+	, m_pointCount(0)
+	, m_levels(bits + 1)
+{
+	assert(bits <= 16);
+	for (uint32_t level = 0; level <= bits; ++level)
+	{
+		m_levels[level].resize(level > kBlockLevels ? size_t(1) << (2 * (level - kBlockLevels)) : 1);
+		if (level <= kBlockLevels)
+		{
+			m_levels[level][0].reset(new uint64_t[BlockWordCount(level)]());
+		}
+	}
+}
+
+size_t CDenseQuadTree::BlockWordCount(uint32_t level) const
+{
+	return ((size_t(1) << (2 * (level < kBlockLevels ? level : kBlockLevels))) + 63) / 64;
+}
+
+inline bool CDenseQuadTree::TestBit(uint32_t level, uint64_t index) const
+{
+	const uint64_t* pBlock = m_levels[level][index >> (2 * kBlockLevels)].get();
+	return pBlock != nullptr && ((pBlock[(index >> 6) & ((1ull << kBlockWordBits) - 1)] >> (index & 63)) & 1) != 0;
+}
+
+inline uint64_t& CDenseQuadTree::Word(uint32_t level, uint64_t index)
+{
+	std::unique_ptr<uint64_t[]>& pBlock = m_levels[level][index >> (2 * kBlockLevels)];
+	if (pBlock == nullptr)
+	{
+		pBlock.reset(new uint64_t[BlockWordCount(level)]());
+	}
+
+	return pBlock[(index >> 6) & ((1ull << kBlockWordBits) - 1)];
+}
+
+template<typename TFunction>
+void CDenseQuadTree::ForEachCellWord(uint64_t begin, uint64_t end, TFunction function) const
+{
+	const std::vector<std::unique_ptr<uint64_t[]>>& blocks = m_levels[m_bits];
+	for (uint64_t wordIndex = begin >> 6; wordIndex <= (end - 1) >> 6; ++wordIndex)
+	{
+		const uint64_t* pBlock = blocks[wordIndex >> kBlockWordBits].get();
+		if (pBlock == nullptr)
+		{
+			wordIndex |= (1ull << kBlockWordBits) - 1;
+			continue;
+		}
+
+		function(wordIndex, pBlock[wordIndex & ((1ull << kBlockWordBits) - 1)]);
+	}
+}
+
+inline bool CDenseQuadTree::InUniverse(const CQuadTree::CCoordinate& point) const
+{
+	return (point.x >> m_bits) == 0 && (point.y >> m_bits) == 0;
+}
+
+CQuadTree::EInsertResult CDenseQuadTree::Insert(const CQuadTree::CCoordinate& point)
+{
+	if (!InUniverse(point))
+	{
+		return CQuadTree::EInsertResult::OutOfRegionBounds;
+	}
+
+	uint64_t index = SpreadBits32(point.x) | (SpreadBits32(point.y) << 1);
+	if (TestBit(m_bits, index))
+	{
+		return CQuadTree::EInsertResult::DuplicateEntry;
+	}
+
+	// Mark the cell, then each enclosing quadrant until one already had points
+	for (uint32_t level = m_bits + 1; level-- > 0; index >>= 2)
+	{
+		uint64_t& word = Word(level, index);
+		const uint64_t bit = 1ull << (index & 63);
+		if ((word & bit) != 0)
+		{
+			break;
+		}
+
+		word |= bit;
+	}
+
+	++m_pointCount;
+	return CQuadTree::EInsertResult::Success;
+}
+
+CQuadTree::EFindResult CDenseQuadTree::Find(const CQuadTree::CCoordinate& point) const
+{
+	if (!InUniverse(point))
+	{
+		return CQuadTree::EFindResult::OutOfRegionBounds;
+	}
+
+	return TestBit(m_bits, SpreadBits32(point.x) | (SpreadBits32(point.y) << 1))
+		? CQuadTree::EFindResult::Success
+		: CQuadTree::EFindResult::NoEntry;
+}
+
+CQuadTree::EEraseResult CDenseQuadTree::Erase(const CQuadTree::CCoordinate& point)
+{
+	if (!InUniverse(point))
+	{
+		return CQuadTree::EEraseResult::OutOfRegionBounds;
+	}
+
+	uint64_t index = SpreadBits32(point.x) | (SpreadBits32(point.y) << 1);
+	if (!TestBit(m_bits, index))
+	{
+		return CQuadTree::EEraseResult::NoEntry;
+	}
+
+	// Clear the cell, then each enclosing quadrant left with no occupied children. Siblings are an aligned nibble.
+	// A quadrant only gets here once it is empty, so the block below it kBlockLevels levels down is all zero.
+	for (uint32_t level = m_bits + 1; level-- > 0; index >>= 2)
+	{
+		if (level < m_bits && level > 0 && level + kBlockLevels <= m_bits)
+		{
+			m_levels[level + kBlockLevels][index].reset();
+		}
+
+		uint64_t& word = Word(level, index);
+		word &= ~(1ull << (index & 63));
+		if (((word >> (index & 60)) & 0xF) != 0)
+		{
+			break;
+		}
+	}
+
+	--m_pointCount;
+	return CQuadTree::EEraseResult::Success;
+}
+
+void CDenseQuadTree::Reset()
+{
+	for (uint32_t level = 0; level <= m_bits; ++level)
+	{
+		if (level <= kBlockLevels)
+		{
+			std::fill(m_levels[level][0].get(), m_levels[level][0].get() + BlockWordCount(level), 0);
+			continue;
+		}
+
+		for (std::unique_ptr<uint64_t[]>& pBlock : m_levels[level])
+		{
+			pBlock.reset();
+		}
+	}
+
+	m_pointCount = 0;
+}
+
+size_t CDenseQuadTree::CountInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max) const
+{
+	size_t count = 0;
+	auto countCells = [this, &count](uint64_t begin, uint64_t end)
+	{
+		ForEachCellWord(begin, end, [&](uint64_t wordIndex, uint64_t word)
+		{
+			count += CountBits64(word & RangeMask(wordIndex, begin, end));
+		});
+	};
+
+	VisitRange(min, max, countCells);
+	return count;
+}
+
+template<typename TFunction>
+void CDenseQuadTree::ForEachPointInRange(
+	const CQuadTree::CCoordinate& min,
+	const CQuadTree::CCoordinate& max,
+	TFunction function) const
+{
+	auto visitCells = [this, &function](uint64_t begin, uint64_t end)
+	{
+		ForEachCellWord(begin, end, [&](uint64_t wordIndex, uint64_t cellWord)
+		{
+			for (uint64_t word = cellWord & RangeMask(wordIndex, begin, end); word != 0; word &= word - 1)
+			{
+				const uint64_t index = (wordIndex << 6) | CountBits64((word & (~word + 1)) - 1);
+				function(CQuadTree::CCoordinate(CompactBits32(index), CompactBits32(index >> 1)));
+			}
+		});
+	};
+
+	VisitRange(min, max, visitCells);
+}
+
+template<typename TFunction>
+void CDenseQuadTree::ForEachPoint(TFunction function) const
+{
+	const CQuadTree::TScalar last = (CQuadTree::TScalar(1) << m_bits) - 1;
+	ForEachPointInRange(CQuadTree::CCoordinate(0, 0), CQuadTree::CCoordinate(last, last), function);
+}
+
+size_t CDenseQuadTree::GetAllocatedBytes() const
+{
+	size_t bytes = sizeof(*this) + m_levels.capacity() * sizeof(m_levels[0]);
+	for (uint32_t level = 0; level <= m_bits; ++level)
+	{
+		bytes += m_levels[level].capacity() * sizeof(m_levels[level][0]);
+		for (const std::unique_ptr<uint64_t[]>& pBlock : m_levels[level])
+		{
+			bytes += pBlock != nullptr ? BlockWordCount(level) * sizeof(uint64_t) : 0;
+		}
+	}
+
+	return bytes;
+}
+
+template<typename TFunction>
+void CDenseQuadTree::VisitRange(
+	const CQuadTree::CCoordinate& min,
+	const CQuadTree::CCoordinate& max,
+	TFunction& visitCells) const
+{
+	const CQuadTree::TScalar last = (CQuadTree::TScalar(1) << m_bits) - 1;
+	if (min.x > max.x || min.y > max.y || min.x > last || min.y > last)
+	{
+		return;
+	}
+
+	VisitRange_Recursive(0, 0, min, CQuadTree::CCoordinate(std::min(max.x, last), std::min(max.y, last)), visitCells);
+}
+
+template<typename TFunction>
+void CDenseQuadTree::VisitRange_Recursive(
+	uint32_t level,
+	uint64_t index,
+	const CQuadTree::CCoordinate& min,
+	const CQuadTree::CCoordinate& max,
+	TFunction& visitCells) const
+{
+	if (!TestBit(level, index))
+	{
+		return;
+	}
+
+	const uint32_t shift = m_bits - level;
+	const CQuadTree::TScalar x0 = CompactBits32(index) << shift;
+	const CQuadTree::TScalar y0 = CompactBits32(index >> 1) << shift;
+	const CQuadTree::TScalar x1 = x0 + ((CQuadTree::TScalar(1) << shift) - 1);
+	const CQuadTree::TScalar y1 = y0 + ((CQuadTree::TScalar(1) << shift) - 1);
+	if (x1 < min.x || x0 > max.x || y1 < min.y || y0 > max.y)
+	{
+		return;
+	}
+
+	// A quadrant wholly inside the range is a contiguous run of cells in Z-order. Cells are always wholly inside.
+	if (x0 >= min.x && x1 <= max.x && y0 >= min.y && y1 <= max.y)
+	{
+		visitCells(index << (2 * shift), (index + 1) << (2 * shift));
+		return;
+	}
+
+	for (uint64_t child = index * 4; child < index * 4 + 4; ++child)
+	{
+		VisitRange_Recursive(level + 1, child, min, max, visitCells);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CStaticQuadTree
+// A read only quadtree built from a point set known at compile time, for fixed reference data such as landmarks or zone
+// centroids. It cuts regions at CQuadTree::SplitCenter as CNode::Split does, one point per leaf, and holds its nodes in
+// an array of kNodeCapacity, so a constexpr instance is laid out in read only data with nothing to initialize at startup
+// and nothing allocated. Every split takes four nodes, so points sharing long coordinate prefixes need more capacity.
+// Running out throws std::length_error, which fails the constant evaluation of a constexpr instance, and
+// StaticQuadTreeNodeCount gives the exact capacity for a point set. Duplicate points are kept once.
+template<size_t kNodeCapacity>
+class CStaticQuadTree
+{
+public:
+	template<size_t kPointCount>
+	constexpr explicit CStaticQuadTree(const CQuadTree::CCoordinate (&points)[kPointCount]);
+
+	constexpr CQuadTree::EFindResult Find(const CQuadTree::CCoordinate& point) const;
+
+	// Inclusive bounds
+	constexpr size_t CountInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max) const;
+	template<typename TFunction>
+	void ForEachPointInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max, TFunction function) const;
+
+	constexpr size_t GetPointCount() const { return m_pointCount; }
+	constexpr size_t GetNodeCount() const { return m_nodeCount; }
+
+private:
+	class CStaticNode
+	{
+	public:
+		CQuadTree::CCoordinate m_point;
+		uint32_t m_firstChild = 0; // the four children follow in quadrant order, 0 for a leaf as the root is no child
+		bool m_hasPoint = false;
+	};
+
+	constexpr void Insert(const CQuadTree::CCoordinate& point);
+	static constexpr uint8_t EnterQuadrant(const CQuadTree::CCoordinate& point, CQuadTree::CCoordinate& regionMin, CQuadTree::CCoordinate& regionMax);
+	constexpr size_t CountInRange_Recursive(uint32_t index, CQuadTree::CCoordinate regionMin, CQuadTree::CCoordinate regionMax,
+		const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max) const;
+	template<typename TFunction>
+	void VisitRange_Recursive(uint32_t index, CQuadTree::CCoordinate regionMin, CQuadTree::CCoordinate regionMax,
+		const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max, TFunction& function) const;
+
+	CStaticNode m_nodes[kNodeCapacity];
+	size_t m_nodeCount;
+	size_t m_pointCount;
+};
+
+// Nodes a CStaticQuadTree of the points takes: the root and four for every region holding two distinct points. Each
+// such region is counted at the first point in it, the regions a point shares with another reach down to the depth
+// that separates them, and those it shares with an earlier point are counted already.
+template<size_t kPointCount>
+constexpr size_t StaticQuadTreeNodeCount(const CQuadTree::CCoordinate (&points)[kPointCount])
+{
+	size_t splitCount = 0;
+	for (size_t i = 0; i < kPointCount; ++i)
+	{
+		int32_t deepestShared = -1;
+		int32_t deepestSharedEarlier = -1;
+		for (size_t j = 0; j < kPointCount; ++j)
+		{
+			int32_t separatingDepth = 0;
+			for (uint64_t difference = (points[i].x ^ points[j].x) | (points[i].y ^ points[j].y);
+				difference != 0 && (difference & (1ull << 63)) == 0; difference <<= 1)
+			{
+				++separatingDepth;
+			}
+
+			if (points[i] == points[j])
+			{
+				// A duplicate of an earlier point adds nothing
+				deepestSharedEarlier = j < i ? 64 : deepestSharedEarlier;
+			}
+			else
+			{
+				deepestShared = std::max(deepestShared, separatingDepth);
+				deepestSharedEarlier = j < i ? std::max(deepestSharedEarlier, separatingDepth) : deepestSharedEarlier;
+			}
+		}
+
+		splitCount += deepestShared > deepestSharedEarlier ? static_cast<size_t>(deepestShared - deepestSharedEarlier) : 0;
+	}
+
+	return 1 + 4 * splitCount;
+}
+
+template<size_t kNodeCapacity>
+template<size_t kPointCount>
+constexpr CStaticQuadTree<kNodeCapacity>::CStaticQuadTree(const CQuadTree::CCoordinate (&points)[kPointCount])
+	: m_nodes()
+	, m_nodeCount(1)
+	, m_pointCount(0)
+{
+	static_assert(kNodeCapacity > 0, "The root needs a node");
+	for (size_t i = 0; i < kPointCount; ++i)
+	{
+		Insert(points[i]);
+	}
+}
+
+template<size_t kNodeCapacity>
+constexpr CQuadTree::EFindResult CStaticQuadTree<kNodeCapacity>::Find(const CQuadTree::CCoordinate& point) const
+{
+	CQuadTree::CCoordinate regionMin(0, 0);
+	CQuadTree::CCoordinate regionMax(~CQuadTree::TScalar{}, ~CQuadTree::TScalar{});
+	uint32_t index = 0;
+	while (m_nodes[index].m_firstChild != 0)
+	{
+		index = m_nodes[index].m_firstChild + EnterQuadrant(point, regionMin, regionMax);
+	}
+
+	return m_nodes[index].m_hasPoint && m_nodes[index].m_point == point ? CQuadTree::EFindResult::Success : CQuadTree::EFindResult::NoEntry;
+}
+
+template<size_t kNodeCapacity>
+constexpr size_t CStaticQuadTree<kNodeCapacity>::CountInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max) const
+{
+	return CountInRange_Recursive(0, CQuadTree::CCoordinate(0, 0), CQuadTree::CCoordinate(~CQuadTree::TScalar{}, ~CQuadTree::TScalar{}), min, max);
+}
+
+template<size_t kNodeCapacity>
+template<typename TFunction>
+void CStaticQuadTree<kNodeCapacity>::ForEachPointInRange(const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max, TFunction function) const
+{
+	VisitRange_Recursive(0, CQuadTree::CCoordinate(0, 0), CQuadTree::CCoordinate(~CQuadTree::TScalar{}, ~CQuadTree::TScalar{}), min, max, function);
+}
+
+// Splits the leaf the point falls in until the point and the leaf's point part, as CQuadTree::InsertAt does
+template<size_t kNodeCapacity>
+constexpr void CStaticQuadTree<kNodeCapacity>::Insert(const CQuadTree::CCoordinate& point)
+{
+	CQuadTree::CCoordinate regionMin(0, 0);
+	CQuadTree::CCoordinate regionMax(~CQuadTree::TScalar{}, ~CQuadTree::TScalar{});
+	uint32_t index = 0;
+	while (true)
+	{
+		CStaticNode& node = m_nodes[index];
+		if (node.m_firstChild != 0)
+		{
+			index = node.m_firstChild + EnterQuadrant(point, regionMin, regionMax);
+		}
+		else if (!node.m_hasPoint)
+		{
+			node.m_point = point;
+			node.m_hasPoint = true;
+			++m_pointCount;
+			return;
+		}
+		else if (node.m_point == point)
+		{
+			return;
+		}
+		else
+		{
+			if (m_nodeCount + 4 > kNodeCapacity)
+			{
+				throw std::length_error("CStaticQuadTree: the points need more than kNodeCapacity nodes");
+			}
+
+			node.m_firstChild = static_cast<uint32_t>(m_nodeCount);
+			m_nodeCount += 4;
+			CQuadTree::CCoordinate existingMin = regionMin;
+			CQuadTree::CCoordinate existingMax = regionMax;
+			CStaticNode& existingChild = m_nodes[node.m_firstChild + EnterQuadrant(node.m_point, existingMin, existingMax)];
+			existingChild.m_point = node.m_point;
+			existingChild.m_hasPoint = true;
+			node.m_point = CQuadTree::CCoordinate();
+			node.m_hasPoint = false;
+		}
+	}
+}
+
+// Narrows the region to the quadrant holding the point, numbered 0 = North West, 1 = North East, 2 = South West,
+// 3 = South East as in CQuadTree
+template<size_t kNodeCapacity>
+constexpr uint8_t CStaticQuadTree<kNodeCapacity>::EnterQuadrant(const CQuadTree::CCoordinate& point, CQuadTree::CCoordinate& regionMin, CQuadTree::CCoordinate& regionMax)
+{
+	const CQuadTree::CCoordinate center = CQuadTree::SplitCenter(regionMin, regionMax);
+	uint8_t quadrant = 0;
+	if (point.x > center.x)
+	{
+		regionMin.x = center.x + 1;
+		quadrant |= 1;
+	}
+	else
+	{
+		regionMax.x = center.x;
+	}
+
+	if (point.y > center.y)
+	{
+		regionMin.y = center.y + 1;
+		quadrant |= 2;
+	}
+	else
+	{
+		regionMax.y = center.y;
+	}
+
+	return quadrant;
+}
+
+template<size_t kNodeCapacity>
+constexpr size_t CStaticQuadTree<kNodeCapacity>::CountInRange_Recursive(uint32_t index, CQuadTree::CCoordinate regionMin, CQuadTree::CCoordinate regionMax,
+	const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max) const
+{
+	if (regionMax.x < min.x || regionMin.x > max.x || regionMax.y < min.y || regionMin.y > max.y)
+	{
+		return 0;
+	}
+
+	const CStaticNode& node = m_nodes[index];
+	if (node.m_firstChild == 0)
+	{
+		return node.m_hasPoint && node.m_point.x >= min.x && node.m_point.x <= max.x && node.m_point.y >= min.y && node.m_point.y <= max.y ? 1 : 0;
+	}
+
+	size_t count = 0;
+	for (uint8_t quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		// A point at the quadrant's corner walks the region into that quadrant
+		CQuadTree::CCoordinate childMin = regionMin;
+		CQuadTree::CCoordinate childMax = regionMax;
+		const CQuadTree::CCoordinate corner((quadrant & 1) != 0 ? regionMax.x : regionMin.x, (quadrant & 2) != 0 ? regionMax.y : regionMin.y);
+		EnterQuadrant(corner, childMin, childMax);
+		count += CountInRange_Recursive(node.m_firstChild + quadrant, childMin, childMax, min, max);
+	}
+
+	return count;
+}
+
+template<size_t kNodeCapacity>
+template<typename TFunction>
+void CStaticQuadTree<kNodeCapacity>::VisitRange_Recursive(uint32_t index, CQuadTree::CCoordinate regionMin, CQuadTree::CCoordinate regionMax,
+	const CQuadTree::CCoordinate& min, const CQuadTree::CCoordinate& max, TFunction& function) const
+{
+	if (regionMax.x < min.x || regionMin.x > max.x || regionMax.y < min.y || regionMin.y > max.y)
+	{
+		return;
+	}
+
+	const CStaticNode& node = m_nodes[index];
+	if (node.m_firstChild == 0)
+	{
+		if (node.m_hasPoint && node.m_point.x >= min.x && node.m_point.x <= max.x && node.m_point.y >= min.y && node.m_point.y <= max.y)
+		{
+			function(node.m_point);
+		}
+
+		return;
+	}
+
+	for (uint8_t quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		CQuadTree::CCoordinate childMin = regionMin;
+		CQuadTree::CCoordinate childMax = regionMax;
+		const CQuadTree::CCoordinate corner((quadrant & 1) != 0 ? regionMax.x : regionMin.x, (quadrant & 2) != 0 ? regionMax.y : regionMin.y);
+		EnterQuadrant(corner, childMin, childMax);
+		VisitRange_Recursive(node.m_firstChild + quadrant, childMin, childMax, min, max, function);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CIngestPipeline
+// Feeds a CQuadTree through parse -> Morton encode -> partition -> insert stages, each running on its own thread.
+// The partition stage routes points by top level quadrant, and one insert thread per quadrant builds that subtree.
+// The tree must not be touched by any other thread between Start and Finish.
+template<typename TRecord>
+class CIngestPipeline
+{
+public:
+	typedef std::function<bool(const TRecord& record, CQuadTree::CCoordinate* pPoint)> TParseFunction;
+
+	CIngestPipeline(CQuadTree& quadTree, TParseFunction parseFunction, size_t queueCapacity = 4096, size_t insertBatchSize = 1024);
+	~CIngestPipeline();
+
+	void Start();
+	void Push(const TRecord& record); // several producer threads may push, they take turns through m_pushMutex
+	void Finish(); // drains every stage and joins the worker threads
+
+	size_t GetParsedCount() const { return m_parsedCount.load(); }
+	size_t GetRejectedCount() const { return m_rejectedCount.load(); }
+	size_t GetInsertedCount() const { return m_insertedCount.load(); }
+	size_t GetDuplicateCount() const { return m_duplicateCount.load(); }
+
+private:
+	enum EStage : uint8_t
+	{
+		Parse,
+		Encode,
+		Partition,
+		StageCount
+	};
+
+	static constexpr uint8_t kQuadrantCount = 4;
+	static constexpr size_t kReservationChunkSize = 1024;
+
+	template<typename T>
+	static void PushBlocking(CBoundedSpscQueue<T>& queue, const T& value);
+
+	void ParseStage();
+	void EncodeStage();
+	void PartitionStage();
+	void InsertStage(uint8_t quadrant);
+
+	CQuadTree& m_quadTree;
+	TParseFunction m_parseFunction;
+	size_t m_insertBatchSize;
+	bool m_running;
+
+	std::mutex m_pushMutex; // the record queue has a single producer side, shared by the pushing threads
+	CBoundedSpscQueue<TRecord> m_recordQueue;
+	CBoundedSpscQueue<CQuadTree::CCoordinate> m_pointQueue;
+	CBoundedSpscQueue<CQuadTree::CKeyedCoordinate> m_keyedQueue;
+	std::vector<std::unique_ptr<CBoundedSpscQueue<CQuadTree::CKeyedCoordinate>>> m_partitionQueues;
+
+	// Set once a stage has seen its input end and has forwarded everything downstream
+	std::atomic<bool> m_producerDone;
+	std::atomic<bool> m_stageDone[StageCount];
+
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_parsedCount;
+	std::atomic<size_t> m_rejectedCount;
+	std::atomic<size_t> m_insertedCount;
+	std::atomic<size_t> m_duplicateCount;
+};
+
+template<typename TRecord>
+CIngestPipeline<TRecord>::CIngestPipeline(CQuadTree& quadTree, TParseFunction parseFunction, size_t queueCapacity, size_t insertBatchSize)
+	: m_quadTree(quadTree)
+	, m_parseFunction(std::move(parseFunction))
+	, m_insertBatchSize(insertBatchSize)
+	, m_running(false)
+	, m_recordQueue(queueCapacity)
+	, m_pointQueue(queueCapacity)
+	, m_keyedQueue(queueCapacity)
+	, m_producerDone(false)
+	, m_parsedCount(0)
+	, m_rejectedCount(0)
+	, m_insertedCount(0)
+	, m_duplicateCount(0)
+{
+	assert(m_parseFunction);
+	assert(insertBatchSize > 0);
+	for (uint8_t quadrant = 0; quadrant < kQuadrantCount; ++quadrant)
+	{
+		m_partitionQueues.emplace_back(new CBoundedSpscQueue<CQuadTree::CKeyedCoordinate>(queueCapacity));
+	}
+
+	for (uint8_t stage = 0; stage < StageCount; ++stage)
+	{
+		m_stageDone[stage] = false;
+	}
+}
+
+template<typename TRecord>
+CIngestPipeline<TRecord>::~CIngestPipeline()
+{
+	if (m_running)
+	{
+		Finish();
+	}
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::Start()
+{
+	assert(!m_running);
+	m_running = true;
+	m_producerDone = false;
+	for (uint8_t stage = 0; stage < StageCount; ++stage)
+	{
+		m_stageDone[stage] = false;
+	}
+
+	// Every insert thread owns one top level quadrant, so the subtrees they build never overlap
+	m_quadTree.BuildInlineTree();
+	m_quadTree.SplitRoot();
+
+	m_threads.emplace_back(&CIngestPipeline::ParseStage, this);
+	m_threads.emplace_back(&CIngestPipeline::EncodeStage, this);
+	m_threads.emplace_back(&CIngestPipeline::PartitionStage, this);
+	for (uint8_t quadrant = 0; quadrant < kQuadrantCount; ++quadrant)
+	{
+		m_threads.emplace_back(&CIngestPipeline::InsertStage, this, quadrant);
+	}
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::Push(const TRecord& record)
+{
+	assert(m_running);
+	std::lock_guard<std::mutex> lock(m_pushMutex);
+	PushBlocking(m_recordQueue, record);
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::Finish()
+{
+	assert(m_running);
+	m_producerDone.store(true, std::memory_order_release);
+	for (std::thread& thread : m_threads)
+	{
+		thread.join();
+	}
+
+	m_threads.clear();
+	m_running = false;
+}
+
+template<typename TRecord>
+template<typename T>
+void CIngestPipeline<TRecord>::PushBlocking(CBoundedSpscQueue<T>& queue, const T& value)
+{
+	while (!queue.TryPush(value))
+	{
+		std::this_thread::yield();
+	}
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::ParseStage()
+{
+	TRecord record;
+	for (;;)
+	{
+		if (m_recordQueue.TryPop(&record))
+		{
+			CQuadTree::CCoordinate point;
+			if (m_parseFunction(record, &point))
+			{
+				++m_parsedCount;
+				PushBlocking(m_pointQueue, point);
+			}
+			else
+			{
+				++m_rejectedCount;
+			}
+		}
+		else if (m_producerDone.load(std::memory_order_acquire) && m_recordQueue.Empty())
+		{
+			break;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	m_stageDone[Parse].store(true, std::memory_order_release);
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::EncodeStage()
+{
+	CQuadTree::CCoordinate point;
+	for (;;)
+	{
+		if (m_pointQueue.TryPop(&point))
+		{
+			PushBlocking(m_keyedQueue, CQuadTree::CKeyedCoordinate(point));
+		}
+		else if (m_stageDone[Parse].load(std::memory_order_acquire) && m_pointQueue.Empty())
+		{
+			break;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	m_stageDone[Encode].store(true, std::memory_order_release);
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::PartitionStage()
+{
+	CQuadTree::CKeyedCoordinate entry;
+	for (;;)
+	{
+		if (m_keyedQueue.TryPop(&entry))
+		{
+			PushBlocking(*m_partitionQueues[entry.key.TopLevelQuadrant()], entry);
+		}
+		else if (m_stageDone[Encode].load(std::memory_order_acquire) && m_keyedQueue.Empty())
+		{
+			break;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	m_stageDone[Partition].store(true, std::memory_order_release);
+}
+
+template<typename TRecord>
+void CIngestPipeline<TRecord>::InsertStage(uint8_t quadrant)
+{
+	CBoundedSpscQueue<CQuadTree::CKeyedCoordinate>& queue = *m_partitionQueues[quadrant];
+	CQuadTree::CNode* pQuadrantRoot = m_quadTree.m_pTreeRoot.load(std::memory_order_relaxed)->QuadrantChild(quadrant);
+	CQuadTree::CNodeReservation reservation(m_quadTree, kReservationChunkSize);
+	std::vector<CQuadTree::CKeyedCoordinate> batch;
+	batch.reserve(m_insertBatchSize);
+
+	auto flush = [&]()
+	{
+		std::sort(batch.begin(), batch.end());
+		m_quadTree.m_operationCounts[static_cast<size_t>(CQuadTree::CMetrics::EOperation::Insert)].fetch_add(batch.size(), std::memory_order_relaxed);
+		const size_t insertedCount = m_quadTree.InsertSorted(pQuadrantRoot, batch.data(), batch.size(), reservation);
+		m_insertedCount += insertedCount;
+		m_duplicateCount += batch.size() - insertedCount;
+		batch.clear();
+	};
+
+	CQuadTree::CKeyedCoordinate entry;
+	for (;;)
+	{
+		if (queue.TryPop(&entry))
+		{
+			batch.push_back(entry);
+			if (batch.size() == m_insertBatchSize)
+			{
+				flush();
+			}
+		}
+		else if (!batch.empty())
+		{
+			// Nothing waiting upstream, insert what we have rather than sitting on it
+			flush();
+		}
+		else if (m_stageDone[Partition].load(std::memory_order_acquire) && queue.Empty())
+		{
+			break;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CWorkloadRecorder
+namespace
+{
+	const char kTraceMagic[4] = { 'P', 'R', 'Q', 'W' };
+	const uint8_t kTraceVersion = 1;
+
+	inline bool IsPointOperation(CWorkloadRecorder::EOperation operation)
+	{
+		return operation == CWorkloadRecorder::EOperation::Insert || operation == CWorkloadRecorder::EOperation::Find ||
+			operation == CWorkloadRecorder::EOperation::Erase;
+	}
+}
+
+CWorkloadRecorder::CWorkloadRecorder(std::ostream& stream)
+	: m_stream(stream)
+{
+	m_buffer.reserve(kFlushSize + 32);
+	m_buffer.append(kTraceMagic, sizeof(kTraceMagic));
+	m_buffer.push_back(static_cast<char>(kTraceVersion));
+}
+
+CWorkloadRecorder::~CWorkloadRecorder()
+{
+	Flush();
+}
+
+void CWorkloadRecorder::Record(EOperation operation)
+{
+	assert(!IsPointOperation(operation));
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_buffer.push_back(static_cast<char>(operation));
+	if (m_buffer.size() >= kFlushSize)
+	{
+		m_stream.write(m_buffer.data(), m_buffer.size());
+		m_buffer.clear();
+	}
+}
+
+void CWorkloadRecorder::Record(EOperation operation, const CQuadTree::CCoordinate& point)
+{
+	assert(IsPointOperation(operation));
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_buffer.push_back(static_cast<char>(operation));
+	WriteVarint(m_buffer, ZigZagEncode(point.x - m_previousPoint.x));
+	WriteVarint(m_buffer, ZigZagEncode(point.y - m_previousPoint.y));
+	m_previousPoint = point;
+	if (m_buffer.size() >= kFlushSize)
+	{
+		m_stream.write(m_buffer.data(), m_buffer.size());
+		m_buffer.clear();
+	}
+}
+
+void CWorkloadRecorder::Flush()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stream.write(m_buffer.data(), m_buffer.size());
+	m_stream.flush();
+	m_buffer.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CWorkloadReplayer
+// Runs a recorded trace against any tree configuration, timing every operation
+class CWorkloadReplayer
+{
+public:
+	typedef CWorkloadRecorder::EOperation EOperation;
+
+	class CReport
+	{
+	public:
+		void Print(std::ostream& stream) const;
+
+		uint64_t operationCounts[static_cast<size_t>(EOperation::Count)] = {};
+		uint64_t latencyPercentilesNs[static_cast<size_t>(EOperation::Count)][3] = {}; // p50, p99, max
+		double elapsedSeconds = 0.0;
+	};
+
+	CQuadTree::ELoadResult Load(std::istream& stream);
+	CReport Replay(CQuadTree& quadTree) const;
+	size_t GetOperationCount() const { return m_operations.size(); }
+
+private:
+	std::vector<EOperation> m_operations;
+	std::vector<CQuadTree::CCoordinate> m_points; // one per point operation, in order
+};
+
+CQuadTree::ELoadResult CWorkloadReplayer::Load(std::istream& stream)
+{
+	const std::string bytes((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+	if (bytes.size() < sizeof(kTraceMagic) + 1)
+	{
+		return CQuadTree::ELoadResult::Truncated;
+	}
+
+	if (!std::equal(kTraceMagic, kTraceMagic + sizeof(kTraceMagic), bytes.data()) ||
+		static_cast<uint8_t>(bytes[sizeof(kTraceMagic)]) != kTraceVersion)
+	{
+		return CQuadTree::ELoadResult::InvalidFormat;
+	}
+
+	m_operations.clear();
+	m_points.clear();
+	const uint8_t* pCursor = reinterpret_cast<const uint8_t*>(bytes.data()) + sizeof(kTraceMagic) + 1;
+	const uint8_t* pEnd = reinterpret_cast<const uint8_t*>(bytes.data()) + bytes.size();
+	CQuadTree::CCoordinate previousPoint;
+	while (pCursor != pEnd)
+	{
+		const uint8_t operation = *pCursor++;
+		if (operation >= static_cast<uint8_t>(EOperation::Count))
+		{
+			return CQuadTree::ELoadResult::InvalidFormat;
+		}
+
+		m_operations.push_back(static_cast<EOperation>(operation));
+		if (IsPointOperation(m_operations.back()))
+		{
+			uint64_t deltaX = 0;
+			uint64_t deltaY = 0;
+			if (!ReadVarint(pCursor, pEnd, &deltaX) || !ReadVarint(pCursor, pEnd, &deltaY))
+			{
+				return CQuadTree::ELoadResult::Truncated;
+			}
+
+			previousPoint = CQuadTree::CCoordinate(previousPoint.x + ZigZagDecode(deltaX), previousPoint.y + ZigZagDecode(deltaY));
+			m_points.push_back(previousPoint);
+		}
+	}
+
+	return CQuadTree::ELoadResult::Success;
+}
+
+CWorkloadReplayer::CReport CWorkloadReplayer::Replay(CQuadTree& quadTree) const
+{
+	typedef std::chrono::steady_clock TClock;
+	const size_t operationTypeCount = static_cast<size_t>(EOperation::Count);
+	std::vector<uint32_t> latenciesNs[operationTypeCount];
+
+	CReport report;
+	size_t pointIndex = 0;
+	const TClock::time_point replayStart = TClock::now();
+	for (EOperation operation : m_operations)
+	{
+		const TClock::time_point operationStart = TClock::now();
+		switch (operation)
+		{
+		case EOperation::Insert:
+			quadTree.Insert(m_points[pointIndex++]);
+			break;
+		case EOperation::Find:
+			quadTree.Find(m_points[pointIndex++]);
+			break;
+		case EOperation::Erase:
+			quadTree.Erase(m_points[pointIndex++]);
+			break;
+		case EOperation::Reset:
+			quadTree.Reset();
+			break;
+		case EOperation::BeginBatch:
+			quadTree.BeginBatch();
+			break;
+		case EOperation::Commit:
+			quadTree.Commit();
+			break;
+		case EOperation::Abort:
+			quadTree.Abort();
+			break;
+		default:
+			assert(false);
+			break;
+		}
+
+		const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - operationStart).count();
+		latenciesNs[static_cast<size_t>(operation)].push_back(static_cast<uint32_t>(std::min<decltype(latency)>(latency, UINT32_MAX)));
+	}
+
+	report.elapsedSeconds = std::chrono::duration<double>(TClock::now() - replayStart).count();
+	for (size_t operation = 0; operation < operationTypeCount; ++operation)
+	{
+		std::vector<uint32_t>& latencies = latenciesNs[operation];
+		report.operationCounts[operation] = latencies.size();
+		if (latencies.empty())
+		{
+			continue;
+		}
+
+		std::sort(latencies.begin(), latencies.end());
+		report.latencyPercentilesNs[operation][0] = latencies[latencies.size() / 2];
+		report.latencyPercentilesNs[operation][1] = latencies[latencies.size() * 99 / 100];
+		report.latencyPercentilesNs[operation][2] = latencies.back();
+	}
+
+	return report;
+}
+
+void CWorkloadReplayer::CReport::Print(std::ostream& stream) const
+{
+	static const char* const operationNames[] = { "Insert", "Find", "Erase", "Reset", "BeginBatch", "Commit", "Abort" };
+	static_assert(sizeof(operationNames) / sizeof(operationNames[0]) == static_cast<size_t>(EOperation::Count), "Missing operation name");
+
+	uint64_t totalCount = 0;
+	for (uint64_t count : operationCounts)
+	{
+		totalCount += count;
+	}
+
+	stream << "replayed " << totalCount << " operations in " << elapsedSeconds << "s ("
+		<< (elapsedSeconds > 0.0 ? static_cast<double>(totalCount) / elapsedSeconds : 0.0) << " ops/s)\n";
+	for (size_t operation = 0; operation < static_cast<size_t>(EOperation::Count); ++operation)
+	{
+		if (operationCounts[operation] == 0)
+		{
+			continue;
+		}
+
+		stream << "  " << operationNames[operation] << ": " << operationCounts[operation]
+			<< " ops, p50 " << latencyPercentilesNs[operation][0]
+			<< "ns, p99 " << latencyPercentilesNs[operation][1]
+			<< "ns, max " << latencyPercentilesNs[operation][2] << "ns\n";
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CSpatialGenerator
+// Seeded generators for the distributions that stress depth and memory. Only the raw output of std::mt19937_64 is
+// used, the standard distributions are implementation defined, so a seed gives the same points with every
+// standard library (the Gaussian and curve generators are subject to the platform's libm rounding).
+class CSpatialGenerator
+{
+public:
+	typedef CQuadTree::TScalar TScalar;
+	typedef CQuadTree::CCoordinate CCoordinate;
+
+	explicit CSpatialGenerator(uint64_t seed);
+
+	std::vector<CCoordinate> Uniform(size_t count);
+	std::vector<CCoordinate> GaussianClusters(size_t count, size_t clusterCount, double standardDeviation);
+	std::vector<CCoordinate> PowerLawHotspots(size_t count, size_t hotspotCount, double exponent, double hotspotRadius);
+	std::vector<CCoordinate> Lines(size_t count, size_t lineCount);
+	std::vector<CCoordinate> Circles(size_t count, size_t circleCount, double maxRadius);
+	std::vector<CCoordinate> Lattice(size_t count, TScalar spacing);
+	std::vector<CCoordinate> NearDuplicates(size_t count, uint32_t sharedPrefixBits); // share the top bits of both axes
+
+private:
+	friend class CMovingObjectStream;
+
+	TScalar NextScalar();
+	double NextUnit(); // [0, 1)
+	double NextGaussian();
+	CCoordinate NextAround(const CCoordinate& center, double standardDeviation);
+	static TScalar ClampToScalar(double value);
+	static TScalar OffsetScalar(TScalar value, double offset);
+
+	std::mt19937_64 m_engine;
+	bool m_hasSpareGaussian;
+	double m_spareGaussian;
+};
+
+CSpatialGenerator::CSpatialGenerator(uint64_t seed)
+	: m_engine(seed)
+	, m_hasSpareGaussian(false)
+	, m_spareGaussian(0.0)
+{
+}
+
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::Uniform(size_t count)
+{
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const TScalar x = NextScalar();
+		points.emplace_back(x, NextScalar());
+	}
+
+	return points;
+}
+
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::GaussianClusters(size_t count, size_t clusterCount, double standardDeviation)
+{
+	assert(clusterCount > 0);
+	const std::vector<CCoordinate> centers = Uniform(clusterCount);
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		points.push_back(NextAround(centers[static_cast<size_t>(NextScalar() % clusterCount)], standardDeviation));
+	}
+
+	return points;
+}
+
+// Hotspot k is picked with probability proportional to 1 / (k + 1)^exponent
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::PowerLawHotspots(size_t count, size_t hotspotCount, double exponent, double hotspotRadius)
+{
+	assert(hotspotCount > 0);
+	const std::vector<CCoordinate> centers = Uniform(hotspotCount);
+	std::vector<double> cumulativeWeights(hotspotCount);
+	double totalWeight = 0.0;
+	for (size_t k = 0; k < hotspotCount; ++k)
+	{
+		totalWeight += 1.0 / std::pow(static_cast<double>(k + 1), exponent);
+		cumulativeWeights[k] = totalWeight;
+	}
+
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const double target = NextUnit() * totalWeight;
+		const size_t hotspot = std::min<size_t>(
+			std::upper_bound(cumulativeWeights.begin(), cumulativeWeights.end(), target) - cumulativeWeights.begin(), hotspotCount - 1);
+		points.push_back(NextAround(centers[hotspot], hotspotRadius));
+	}
+
+	return points;
+}
+
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::Lines(size_t count, size_t lineCount)
+{
+	assert(lineCount > 0);
+	const std::vector<CCoordinate> endpoints = Uniform(lineCount * 2);
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const size_t line = static_cast<size_t>(NextScalar() % lineCount);
+		const CCoordinate& from = endpoints[line * 2];
+		const CCoordinate& to = endpoints[line * 2 + 1];
+		const double t = NextUnit();
+		points.emplace_back(
+			OffsetScalar(from.x, t * (static_cast<double>(to.x) - static_cast<double>(from.x))),
+			OffsetScalar(from.y, t * (static_cast<double>(to.y) - static_cast<double>(from.y))));
+	}
+
+	return points;
+}
+
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::Circles(size_t count, size_t circleCount, double maxRadius)
+{
+	assert(circleCount > 0);
+	const std::vector<CCoordinate> centers = Uniform(circleCount);
+	std::vector<double> radii(circleCount);
+	for (double& radius : radii)
+	{
+		radius = NextUnit() * maxRadius;
+	}
+
+	const double twoPi = 6.283185307179586;
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const size_t circle = static_cast<size_t>(NextScalar() % circleCount);
+		const double angle = NextUnit() * twoPi;
+		points.emplace_back(
+			OffsetScalar(centers[circle].x, radii[circle] * std::cos(angle)),
+			OffsetScalar(centers[circle].y, radii[circle] * std::sin(angle)));
+	}
+
+	return points;
+}
+
+// A square block of lattice points starting at a random origin, every point is unique and evenly spaced
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::Lattice(size_t count, TScalar spacing)
+{
+	assert(spacing > 0);
+	const TScalar columns = std::max<TScalar>(1, static_cast<TScalar>(std::ceil(std::sqrt(static_cast<double>(count)))));
+	const TScalar extent = (columns - 1) * spacing;
+	const TScalar maxValue = std::numeric_limits<TScalar>::max();
+	assert(extent / spacing == columns - 1);
+	const TScalar originX = NextScalar() % (maxValue - extent);
+	const TScalar originY = NextScalar() % (maxValue - extent);
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		points.emplace_back(originX + (i % columns) * spacing, originY + (i / columns) * spacing);
+	}
+
+	return points;
+}
+
+// Adversarial input: every point shares its top bits with one base point, forcing the tree down to that depth
+std::vector<CSpatialGenerator::CCoordinate> CSpatialGenerator::NearDuplicates(size_t count, uint32_t sharedPrefixBits)
+{
+	assert(sharedPrefixBits <= 64);
+	const TScalar lowMask = sharedPrefixBits == 64 ? 0 : std::numeric_limits<TScalar>::max() >> sharedPrefixBits;
+	const TScalar baseX = NextScalar() & ~lowMask;
+	const TScalar baseY = NextScalar() & ~lowMask;
+	std::vector<CCoordinate> points;
+	points.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const TScalar x = baseX | (NextScalar() & lowMask);
+		points.emplace_back(x, baseY | (NextScalar() & lowMask));
+	}
+
+	return points;
+}
+
+CSpatialGenerator::TScalar CSpatialGenerator::NextScalar()
+{
+	return m_engine();
+}
+
+double CSpatialGenerator::NextUnit()
+{
+	return static_cast<double>(m_engine() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Box-Muller transform, the second value of each pair is kept for the next call
+double CSpatialGenerator::NextGaussian()
+{
+	if (m_hasSpareGaussian)
+	{
+		m_hasSpareGaussian = false;
+		return m_spareGaussian;
+	}
+
+	const double u1 = 1.0 - NextUnit(); // (0, 1], keeps log away from zero
+	const double u2 = NextUnit();
+	const double magnitude = std::sqrt(-2.0 * std::log(u1));
+	const double angle = 6.283185307179586 * u2;
+	m_spareGaussian = magnitude * std::sin(angle);
+	m_hasSpareGaussian = true;
+	return magnitude * std::cos(angle);
+}
+
+CSpatialGenerator::CCoordinate CSpatialGenerator::NextAround(const CCoordinate& center, double standardDeviation)
+{
+	const double offsetX = NextGaussian() * standardDeviation;
+	return CCoordinate(OffsetScalar(center.x, offsetX), OffsetScalar(center.y, NextGaussian() * standardDeviation));
+}
+
+CSpatialGenerator::TScalar CSpatialGenerator::ClampToScalar(double value)
+{
+	// 2^64 is the first double past the range, converting anything at or above it is undefined
+	if (!(value > 0.0))
+	{
+		return 0;
+	}
+
+	return value >= 18446744073709551616.0 ? std::numeric_limits<TScalar>::max() : static_cast<TScalar>(value);
+}
+
+// Applies the offset in integer space, so small offsets keep full precision far from the origin
+CSpatialGenerator::TScalar CSpatialGenerator::OffsetScalar(TScalar value, double offset)
+{
+	if (offset >= 0.0)
+	{
+		const TScalar magnitude = ClampToScalar(offset);
+		return magnitude > std::numeric_limits<TScalar>::max() - value ? std::numeric_limits<TScalar>::max() : value + magnitude;
+	}
+
+	const TScalar magnitude = ClampToScalar(-offset);
+	return magnitude > value ? 0 : value - magnitude;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CMovingObjectStream
+// Objects on independent random walks, each call to Next moves one object in turn and reports where it went
+class CMovingObjectStream
+{
+public:
+	typedef CQuadTree::TScalar TScalar;
+	typedef CQuadTree::CCoordinate CCoordinate;
+
+	class CMove
+	{
+	public:
+		size_t objectIndex;
+		CCoordinate from, to;
+	};
+
+	CMovingObjectStream(uint64_t seed, size_t objectCount, TScalar stepSize);
+
+	const std::vector<CCoordinate>& GetPositions() const { return m_positions; }
+	CMove Next();
+
+private:
+	static TScalar Step(TScalar value, TScalar step, bool positive);
+
+	CSpatialGenerator m_generator;
+	std::vector<CCoordinate> m_positions;
+	TScalar m_stepSize;
+	size_t m_nextObject;
+};
+
+CMovingObjectStream::CMovingObjectStream(uint64_t seed, size_t objectCount, TScalar stepSize)
+	: m_generator(seed)
+	, m_positions(m_generator.Uniform(objectCount))
+	, m_stepSize(stepSize)
+	, m_nextObject(0)
+{
+	assert(objectCount > 0);
+	assert(stepSize > 0);
+}
+
+CMovingObjectStream::CMove CMovingObjectStream::Next()
+{
+	CMove move;
+	move.objectIndex = m_nextObject;
+	move.from = m_positions[m_nextObject];
+	const TScalar random = m_generator.NextScalar();
+	const TScalar stepX = random % (m_stepSize + 1);
+	const TScalar stepY = (random >> 32) % (m_stepSize + 1);
+	move.to = CCoordinate(Step(move.from.x, stepX, (random & (1ull << 62)) != 0), Step(move.from.y, stepY, (random & (1ull << 63)) != 0));
+	m_positions[m_nextObject] = move.to;
+	m_nextObject = (m_nextObject + 1) % m_positions.size();
+	return move;
+}
+
+// Saturates at the edges of the coordinate space instead of wrapping around
+CMovingObjectStream::TScalar CMovingObjectStream::Step(TScalar value, TScalar step, bool positive)
+{
+	if (positive)
+	{
+		return value > std::numeric_limits<TScalar>::max() - step ? std::numeric_limits<TScalar>::max() : value + step;
+	}
+
+	return value < step ? 0 : value - step;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Benchmark baselines
+// Reference point indexes with the same Build / Contains / GetAllocatedBytes surface, for comparison only.
+// Allocated bytes of the standard containers are estimates from their element and bucket counts.
+namespace
+{
+	typedef CQuadTree::CCoordinate TBenchmarkPoint;
+
+	class CCoordinateHash
+	{
+	public:
+		size_t operator()(const TBenchmarkPoint& point) const
+		{
+			uint64_t hash = point.x * 0x9E3779B97F4A7C15ull ^ (point.y + 0x7F4A7C159E3779B9ull + (point.x << 6) + (point.x >> 2));
+			hash ^= hash >> 29;
+			return static_cast<size_t>(hash * 0xBF58476D1CE4E5B9ull);
+		}
+	};
+
+	class CQuadTreeIndex
+	{
+	public:
+		CQuadTreeIndex(bool useInsertBatch) : m_quadTree(32768), m_useInsertBatch(useInsertBatch) {}
+
+		void Build(const std::vector<TBenchmarkPoint>& points)
+		{
+			m_quadTree.Reset();
+			if (m_useInsertBatch)
+			{
+				m_quadTree.InsertBatch(points.data(), points.size());
+				return;
+			}
+
+			for (const TBenchmarkPoint& point : points)
+			{
+				m_quadTree.Insert(point);
+			}
+		}
+
+		bool Contains(const TBenchmarkPoint& point) { return m_quadTree.Find(point) == CQuadTree::EFindResult::Success; }
+		size_t GetAllocatedBytes() const { return m_quadTree.GetAllocatedBytes(); }
+
+	private:
+		CQuadTree m_quadTree;
+		bool m_useInsertBatch;
+	};
+
+	// Points sorted by Morton key, Contains is a binary search
+	class CSortedMortonIndex
+	{
+	public:
+		void Build(const std::vector<TBenchmarkPoint>& points)
+		{
+			m_keys.clear();
+			m_keys.reserve(points.size());
+			for (const TBenchmarkPoint& point : points)
+			{
+				m_keys.push_back(CQuadTree::CMortonKey::FromCoordinate(point));
+			}
+
+			std::sort(m_keys.begin(), m_keys.end());
+			m_keys.erase(std::unique(m_keys.begin(), m_keys.end()), m_keys.end());
+		}
+
+		bool Contains(const TBenchmarkPoint& point)
+		{
+			return std::binary_search(m_keys.begin(), m_keys.end(), CQuadTree::CMortonKey::FromCoordinate(point));
+		}
+
+		size_t GetAllocatedBytes() const { return m_keys.capacity() * sizeof(CQuadTree::CMortonKey); }
+
+	private:
+		std::vector<CQuadTree::CMortonKey> m_keys;
+	};
+
+	// Balanced 2-d tree stored implicitly, the median of each range is its root and the axis alternates per level
+	class CKdTree
+	{
+	public:
+		void Build(const std::vector<TBenchmarkPoint>& points)
+		{
+			m_points = points;
+			Build_Recursive(0, m_points.size(), 0);
+		}
+
+		bool Contains(const TBenchmarkPoint& point)
+		{
+			size_t begin = 0;
+			size_t end = m_points.size();
+			uint32_t axis = 0;
+			while (begin < end)
+			{
+				const size_t median = begin + (end - begin) / 2;
+				const TBenchmarkPoint& candidate = m_points[median];
+				if (candidate == point)
+				{
+					return true;
+				}
+
+				if (Less(point, candidate, axis))
+				{
+					end = median;
+				}
+				else
+				{
+					begin = median + 1;
+				}
+
+				axis ^= 1;
+			}
+
+			return false;
+		}
+
+		size_t GetAllocatedBytes() const { return m_points.capacity() * sizeof(TBenchmarkPoint); }
+
+	private:
+		// Ties on the split axis are broken by the other axis, so equal keys never straddle the median
+		static bool Less(const TBenchmarkPoint& lhs, const TBenchmarkPoint& rhs, uint32_t axis)
+		{
+			return axis == 0 ? (lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y)) : (lhs.y < rhs.y || (lhs.y == rhs.y && lhs.x < rhs.x));
+		}
+
+		void Build_Recursive(size_t begin, size_t end, uint32_t axis)
+		{
+			if (end - begin < 2)
+			{
+				return;
+			}
+
+			const size_t median = begin + (end - begin) / 2;
+			std::nth_element(m_points.begin() + begin, m_points.begin() + median, m_points.begin() + end,
+				[axis](const TBenchmarkPoint& lhs, const TBenchmarkPoint& rhs) { return Less(lhs, rhs, axis); });
+			Build_Recursive(begin, median, axis ^ 1);
+			Build_Recursive(median + 1, end, axis ^ 1);
+		}
+
+		std::vector<TBenchmarkPoint> m_points;
+	};
+
+	// Uniform grid sized for about one point per cell on uniform data, cells are hashed
+	class CUniformGridHash
+	{
+	public:
+		void Build(const std::vector<TBenchmarkPoint>& points)
+		{
+			uint32_t cellBits = 1;
+			while (cellBits < 32 && (1ull << (2 * cellBits)) < points.size())
+			{
+				++cellBits;
+			}
+
+			m_shift = 64 - cellBits;
+			m_cells.clear();
+			m_cells.reserve(points.size());
+			for (const TBenchmarkPoint& point : points)
+			{
+				m_cells[CellKey(point)].push_back(point);
+			}
+
+			// Clustered data piles many points into one cell, so cells are kept sorted rather than scanned
+			for (auto& cell : m_cells)
+			{
+				std::sort(cell.second.begin(), cell.second.end(), LessXY);
+				cell.second.erase(std::unique(cell.second.begin(), cell.second.end()), cell.second.end());
+			}
+		}
+
+		bool Contains(const TBenchmarkPoint& point)
+		{
+			const auto cell = m_cells.find(CellKey(point));
+			return cell != m_cells.end() && std::binary_search(cell->second.begin(), cell->second.end(), point, LessXY);
+		}
+
+		size_t GetAllocatedBytes() const
+		{
+			size_t allocatedBytes = m_cells.bucket_count() * sizeof(void*);
+			for (const auto& cell : m_cells)
+			{
+				allocatedBytes += sizeof(cell) + 2 * sizeof(void*) + cell.second.capacity() * sizeof(TBenchmarkPoint);
+			}
+
+			return allocatedBytes;
+		}
+
+	private:
+		static bool LessXY(const TBenchmarkPoint& lhs, const TBenchmarkPoint& rhs) { return lhs.x < rhs.x || (lhs.x == rhs.x && lhs.y < rhs.y); }
+		uint64_t CellKey(const TBenchmarkPoint& point) const { return ((point.x >> m_shift) << 32) | (point.y >> m_shift); }
+
+		uint32_t m_shift = 63;
+		std::unordered_map<uint64_t, std::vector<TBenchmarkPoint>> m_cells;
+	};
+
+	// Exact match only
+	class CHashSetIndex
+	{
+	public:
+		void Build(const std::vector<TBenchmarkPoint>& points)
+		{
+			m_points.clear();
+			m_points.reserve(points.size());
+			m_points.insert(points.begin(), points.end());
+		}
+
+		bool Contains(const TBenchmarkPoint& point) { return m_points.count(point) != 0; }
+
+		size_t GetAllocatedBytes() const
+		{
+			return m_points.bucket_count() * sizeof(void*) + m_points.size() * (sizeof(TBenchmarkPoint) + 2 * sizeof(void*));
+		}
+
+	private:
+		std::unordered_set<TBenchmarkPoint, CCoordinateHash> m_points;
+	};
+
+	// Times building the index from points, then looking up queries, half of which are misses
+	template<typename TIndex>
+	void RunBenchmark(const char* pIndexName, TIndex& index, const std::vector<TBenchmarkPoint>& points,
+		const std::vector<TBenchmarkPoint>& queries, std::ostream& stream)
+	{
+		typedef std::chrono::steady_clock TClock;
+		const TClock::time_point buildStart = TClock::now();
+		index.Build(points);
+		const double buildSeconds = std::chrono::duration<double>(TClock::now() - buildStart).count();
+
+		size_t foundCount = 0;
+		const TClock::time_point findStart = TClock::now();
+		for (const TBenchmarkPoint& query : queries)
+		{
+			foundCount += index.Contains(query) ? 1 : 0;
+		}
+
+		const double findSeconds = std::chrono::duration<double>(TClock::now() - findStart).count();
+		stream << "  " << std::left << std::setw(22) << pIndexName << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(12) << static_cast<double>(points.size()) / buildSeconds / 1e6
+			<< std::setw(12) << static_cast<double>(queries.size()) / findSeconds / 1e6
+			<< std::setw(14) << static_cast<double>(index.GetAllocatedBytes()) / static_cast<double>(points.size())
+			<< std::setw(12) << buildSeconds * 1e3
+			<< std::setw(10) << foundCount << "\n";
+		stream.unsetf(std::ios::floatfield);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// main
+// Replays a trace recorded with CWorkloadRecorder: QuadTree replay <trace> [pageSize] [writeBufferThreshold]
+int Replay(int argc, char* argv[])
+{
+	std::ifstream stream(argv[2], std::ios::binary);
+	CWorkloadReplayer replayer;
+	if (!stream || replayer.Load(stream) != CQuadTree::ELoadResult::Success)
+	{
+		std::cerr << "failed to load trace " << argv[2] << std::endl;
+		return 1;
+	}
+
+	const size_t pageSize = argc > 3 ? static_cast<size_t>(std::strtoull(argv[3], nullptr, 10)) : 32768;
+	const size_t writeBufferThreshold = argc > 4 ? static_cast<size_t>(std::strtoull(argv[4], nullptr, 10)) : 0;
+	if (pageSize == 0)
+	{
+		std::cerr << "page size must be positive" << std::endl;
+		return 1;
+	}
+
+	CQuadTree quadTree(pageSize);
+	if (writeBufferThreshold > 0)
+	{
+		quadTree.EnableWriteBuffer(writeBufferThreshold);
+	}
+
+	replayer.Replay(quadTree).Print(std::cout);
+	return 0;
+}
+
+namespace
+{
+	// Checks the tree holds every point, reporting the first one missing under the stress case's name
+	bool FindsAll(CQuadTree& quadTree, const std::vector<CQuadTree::CCoordinate>& points, const char* pCaseName)
+	{
+		for (size_t i = 0; i < points.size(); ++i)
+		{
+			if (quadTree.Find(points[i]) != CQuadTree::EFindResult::Success)
+			{
+				std::cerr << pCaseName << ": lost point " << i << std::endl;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Records are "x y" text lines, anything else is rejected
+	bool ParsePointRecord(const std::string& record, CQuadTree::CCoordinate* pPoint)
+	{
+		const char* pBegin = record.c_str();
+		char* pEnd = nullptr;
+		pPoint->x = std::strtoull(pBegin, &pEnd, 10);
+		if (pEnd == pBegin || *pEnd != ' ')
+		{
+			return false;
+		}
+
+		pBegin = pEnd + 1;
+		pPoint->y = std::strtoull(pBegin, &pEnd, 10);
+		return pEnd != pBegin && *pEnd == '\0';
+	}
+}
+
+// Runs each synthetic distribution through the tree and checks it: QuadTree stress [seed]
+int Stress(int argc, char* argv[])
+{
+	const uint64_t seed = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1;
+	const size_t count = 100000;
+	const size_t pageSize = 32768;
+	CSpatialGenerator generator(seed);
+	const std::pair<const char*, std::vector<CQuadTree::CCoordinate>> workloads[] = {
+		{ "uniform", generator.Uniform(count) },
+		{ "gaussian clusters", generator.GaussianClusters(count, 16, 1e6) },
+		{ "power law hotspots", generator.PowerLawHotspots(count, 64, 1.2, 1e4) },
+		{ "lines", generator.Lines(count, 8) },
+		{ "circles", generator.Circles(count, 8, 1e9) },
+		{ "lattice", generator.Lattice(count, 3) },
+		{ "near duplicates", generator.NearDuplicates(count, 48) },
+	};
+
+	CQuadTree quadTree(pageSize);
+	for (const auto& workload : workloads)
+	{
+		quadTree.Reset();
+		for (const CQuadTree::CCoordinate& point : workload.second)
+		{
+			quadTree.Insert(point);
+		}
+
+		quadTree.SanityCheck();
+		for (size_t i = 0; i < workload.second.size(); ++i)
+		{
+			if (quadTree.Find(workload.second[i]) != CQuadTree::EFindResult::Success)
+			{
+				std::cerr << workload.first << ": lost point " << i << std::endl;
+				return 1;
+			}
+		}
+
+		// Gaussian clusters, power law hotspots and near duplicates end in deep leaves, which pack further points into
+		// their buckets rather than split, so they take under a node per point where splitting took three
+		const size_t workloadIndex = &workload - workloads;
+		const uint64_t nodeCount = quadTree.GetMetrics().nodeCount;
+		if ((workloadIndex == 1 || workloadIndex == 2 || workloadIndex == 6) && nodeCount > workload.second.size())
+		{
+			std::cerr << workload.first << ": " << nodeCount << " nodes for " << workload.second.size() << " points" << std::endl;
+			return 1;
+		}
+
+		for (size_t i = 0; i < workload.second.size(); i += 2)
+		{
+			quadTree.Erase(workload.second[i]);
+		}
+
+		quadTree.SanityCheck();
+		std::cout << workload.first << ": ok" << std::endl;
+	}
+
+	CMovingObjectStream stream(seed, 1000, 1 << 20);
+	quadTree.Reset();
+	for (const CQuadTree::CCoordinate& position : stream.GetPositions())
+	{
+		quadTree.Insert(position);
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const CMovingObjectStream::CMove move = stream.Next();
+		quadTree.Erase(move.from);
+		quadTree.Insert(move.to);
+	}
+
+	quadTree.SanityCheck();
+	std::cout << "moving objects: ok" << std::endl;
+
+	// Compact the churned pool a bounded step at a time, the points must come through unchanged
+	std::vector<CQuadTree::CCoordinate> points;
+	quadTree.ForEachPoint([&points](const CQuadTree::CCoordinate& point) { points.push_back(point); });
+	const size_t allocatedBytes = quadTree.GetAllocatedBytes();
+	while (!quadTree.CompactPool(4096))
+	{
+	}
+
+	quadTree.SanityCheck();
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		if (quadTree.Find(points[i]) != CQuadTree::EFindResult::Success)
+		{
+			std::cerr << "compaction: lost point " << i << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "compaction: ok, " << allocatedBytes << " -> " << quadTree.GetAllocatedBytes() << " bytes" << std::endl;
+
+	// A unit spaced grid collapses into bitmap leaves, which expand again once thinned out to one point in sixteen
+	quadTree.Reset();
+	quadTree.SetBitmapLeafThreshold(16);
+	for (CQuadTree::TScalar y = 0; y < 256; ++y)
+	{
+		for (CQuadTree::TScalar x = 0; x < 256; ++x)
+		{
+			quadTree.Insert(CQuadTree::CCoordinate(x, y));
+		}
+	}
+
+	const uint64_t gridNodeCount = quadTree.GetMetrics().nodeCount;
+	for (CQuadTree::TScalar y = 0; y < 256; ++y)
+	{
+		for (CQuadTree::TScalar x = 0; x < 256; ++x)
+		{
+			if (x % 4 != 0 || y % 4 != 0)
+			{
+				quadTree.Erase(CQuadTree::CCoordinate(x, y));
+			}
+		}
+	}
+
+	quadTree.SanityCheck();
+	for (CQuadTree::TScalar i = 0; i < 256; ++i)
+	{
+		if ((quadTree.Find(CQuadTree::CCoordinate(i, i)) == CQuadTree::EFindResult::Success) != (i % 4 == 0))
+		{
+			std::cerr << "bitmap leaves: wrong answer for " << i << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "bitmap leaves: ok, " << gridNodeCount << " -> " << quadTree.GetMetrics().nodeCount << " nodes" << std::endl;
+	quadTree.SetBitmapLeafThreshold(0);
+
+	// Finds skewed nine to one toward a hundred points profile the tree, whose hot paths then move to the pool's front
+	const std::vector<CQuadTree::CCoordinate>& relayoutPoints = workloads[0].second;
+	quadTree.Reset();
+	for (const CQuadTree::CCoordinate& point : relayoutPoints)
+	{
+		quadTree.Insert(point);
+	}
+
+	std::mt19937_64 queryRandom(seed);
+	quadTree.BeginAccessProfile(4);
+	for (size_t i = 0; i < relayoutPoints.size(); ++i)
+	{
+		quadTree.Find(relayoutPoints[queryRandom() % (i % 10 != 0 ? 100 : relayoutPoints.size())]);
+	}
+
+	const size_t hotNodeCount = quadTree.RelayoutHotPaths(4096);
+	quadTree.SanityCheck();
+	for (size_t i = 0; i < relayoutPoints.size(); ++i)
+	{
+		if (quadTree.Find(relayoutPoints[i]) != CQuadTree::EFindResult::Success)
+		{
+			std::cerr << "hot path relayout: lost point " << i << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "hot path relayout: ok, " << hotNodeCount << " hot nodes" << std::endl;
+
+	// Repeated finds of a few hundred points must stay right through the erases and inserts that split and merge
+	// the leaves the cache holds
+	quadTree.EnableLeafCache(256);
+	for (size_t round = 0; round < 64; ++round)
+	{
+		for (size_t i = 0; i < 512; ++i)
+		{
+			const bool erased = i % 64 == round;
+			if (erased)
+			{
+				quadTree.Erase(relayoutPoints[i]);
+			}
+
+			if ((quadTree.Find(relayoutPoints[i]) == CQuadTree::EFindResult::Success) == erased)
+			{
+				std::cerr << "leaf cache: wrong answer for " << i << " in round " << round << std::endl;
+				return 1;
+			}
+
+			if (erased)
+			{
+				quadTree.Insert(relayoutPoints[i]);
+			}
+		}
+	}
+
+	// Sampled Finds count the same paths whether the cache answers them or not
+	quadTree.DisableLeafCache();
+	size_t profiledNodeCounts[2] = {};
+	for (size_t cached = 0; cached < 2; ++cached)
+	{
+		std::mt19937_64 profileRandom(seed);
+		quadTree.BeginAccessProfile(250);
+		for (size_t i = 0; i < 3000; ++i)
+		{
+			quadTree.Find(relayoutPoints[profileRandom() % 300]);
+		}
+
+		profiledNodeCounts[cached] = quadTree.RelayoutHotPaths(relayoutPoints.size());
+		if (cached == 0)
+		{
+			quadTree.EnableLeafCache(256);
+		}
+	}
+
+	if (profiledNodeCounts[0] != profiledNodeCounts[1])
+	{
+		std::cerr << "leaf cache: the profile saw " << profiledNodeCounts[1] << " nodes through the cache, "
+			<< profiledNodeCounts[0] << " without" << std::endl;
+		return 1;
+	}
+
+	// Readers on four threads share the cache's sets while batches commit, each commit replacing the leaves they cache
+	{
+		std::atomic<bool> readersDone(false);
+		std::atomic<size_t> wrongAnswers(0);
+		std::vector<std::thread> readers;
+		for (size_t reader = 0; reader < 4; ++reader)
+		{
+			readers.emplace_back([&, reader]()
+			{
+				while (!readersDone.load())
+				{
+					for (size_t i = reader; i < 512; i += 2)
+					{
+						if (quadTree.Find(relayoutPoints[i]) != CQuadTree::EFindResult::Success)
+						{
+							++wrongAnswers;
+						}
+					}
+				}
+			});
+		}
+
+		for (size_t round = 0; round < 64; ++round)
+		{
+			quadTree.BeginBatch();
+			for (size_t i = 0; i < 512; ++i)
+			{
+				const CQuadTree::CCoordinate neighbour(relayoutPoints[i].x ^ 1, relayoutPoints[i].y);
+				if (round % 2 == 0)
+				{
+					quadTree.Insert(neighbour);
+				}
+				else
+				{
+					quadTree.Erase(neighbour);
+				}
+			}
+
+			quadTree.Commit();
+		}
+
+		readersDone.store(true);
+		for (std::thread& reader : readers)
+		{
+			reader.join();
+		}
+
+		if (wrongAnswers.load() != 0)
+		{
+			std::cerr << "leaf cache: " << wrongAnswers.load() << " wrong answers under concurrent readers" << std::endl;
+			return 1;
+		}
+	}
+
+	quadTree.DisableLeafCache();
+	std::cout << "leaf cache: ok" << std::endl;
+
+	// The compile time tree must agree with the tree on its own points, their neighbours and ranges around them. The
+	// close pairs split deep, the far apart ones at the top.
+	static constexpr CQuadTree::CCoordinate kLandmarks[] = {
+		{ 0, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 }, { 1000, 1000 }, { 1001, 1000 }, { 1000, 1003 }, { 4096, 77 },
+		{ 0x8000000000000000ull, 0x7FFFFFFFFFFFFFFFull }, { 0x7FFFFFFFFFFFFFFFull, 0x8000000000000000ull },
+		{ 0xFFFFFFFFFFFFFFFFull, 0xFFFFFFFFFFFFFFFFull }, { 0xFFFFFFFFFFFFFFFEull, 0xFFFFFFFFFFFFFFFFull },
+		{ 0x123456789ABCDEFull, 0xFEDCBA987654321ull }, { 0x123456789ABCDF0ull, 0xFEDCBA987654321ull },
+		{ 1000, 1000 }, { 0x5555555555555555ull, 0xAAAAAAAAAAAAAAAAull },
+	};
+	static constexpr CStaticQuadTree<StaticQuadTreeNodeCount(kLandmarks)> landmarkTree(kLandmarks);
+	static_assert(landmarkTree.GetPointCount() == 15, "The duplicate landmark is kept once");
+	static_assert(landmarkTree.GetNodeCount() == StaticQuadTreeNodeCount(kLandmarks), "The node count is exact");
+	static_assert(landmarkTree.Find(CQuadTree::CCoordinate(1000, 1003)) == CQuadTree::EFindResult::Success, "Found at compile time");
+	static_assert(landmarkTree.CountInRange(CQuadTree::CCoordinate(0, 0), CQuadTree::CCoordinate(1001, 1001)) == 6, "Counted at compile time");
+
+	quadTree.Reset();
+	std::vector<CQuadTree::CCoordinate> landmarkQueries;
+	for (const CQuadTree::CCoordinate& landmark : kLandmarks)
+	{
+		quadTree.Insert(landmark);
+		for (CQuadTree::TScalar dy = 0; dy < 3; ++dy)
+		{
+			for (CQuadTree::TScalar dx = 0; dx < 3; ++dx)
+			{
+				landmarkQueries.emplace_back(landmark.x + dx - 1, landmark.y + dy - 1);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < landmarkQueries.size(); ++i)
+	{
+		const CQuadTree::CCoordinate& a = landmarkQueries[i];
+		const CQuadTree::CCoordinate& b = landmarkQueries[(i * 7919) % landmarkQueries.size()];
+		const CQuadTree::CCoordinate min(std::min(a.x, b.x), std::min(a.y, b.y));
+		const CQuadTree::CCoordinate max(std::max(a.x, b.x), std::max(a.y, b.y));
+		size_t inRange = 0;
+		quadTree.ForEachPoint([&](const CQuadTree::CCoordinate& point)
+		{
+			inRange += point.x >= min.x && point.x <= max.x && point.y >= min.y && point.y <= max.y;
+		});
+
+		size_t visited = 0;
+		landmarkTree.ForEachPointInRange(min, max, [&](const CQuadTree::CCoordinate&) { ++visited; });
+		if (landmarkTree.Find(a) != quadTree.Find(a) || landmarkTree.CountInRange(min, max) != inRange || visited != inRange)
+		{
+			std::cerr << "static tree: query " << i << " disagrees" << std::endl;
+			return 1;
+		}
+	}
+
+	// One node short of the points' needs is refused rather than written past the array
+	try
+	{
+		CStaticQuadTree<StaticQuadTreeNodeCount(kLandmarks) - 1> shortTree(kLandmarks);
+		std::cerr << "static tree: " << shortTree.GetNodeCount() << " nodes built in a tree too small for them" << std::endl;
+		return 1;
+	}
+	catch (const std::length_error&)
+	{
+	}
+
+	std::cout << "static tree: ok, " << landmarkTree.GetPointCount() << " points in " << landmarkTree.GetNodeCount() << " nodes" << std::endl;
+
+	// The bitmap pyramid must agree with the tree on a 4096 x 4096 grid, point by point and range by range
+	const uint32_t denseBits = 12;
+	const CQuadTree::TScalar denseMask = (CQuadTree::TScalar(1) << denseBits) - 1;
+	CDenseQuadTree denseTree(denseBits);
+	quadTree.Reset();
+	for (const CQuadTree::CCoordinate& point : workloads[0].second)
+	{
+		const CQuadTree::CCoordinate cell(point.x >> (64 - denseBits), point.y >> (64 - denseBits));
+		if (denseTree.Insert(cell) != quadTree.Insert(cell))
+		{
+			std::cerr << "dense pyramid: insert disagrees" << std::endl;
+			return 1;
+		}
+	}
+
+	std::mt19937_64 random(seed);
+	for (size_t i = 0; i < 1000; ++i)
+	{
+		const CQuadTree::CCoordinate a(random() & denseMask, random() & denseMask);
+		const CQuadTree::CCoordinate b(random() & denseMask, random() & denseMask);
+		const CQuadTree::CCoordinate min(std::min(a.x, b.x), std::min(a.y, b.y));
+		const CQuadTree::CCoordinate max(std::max(a.x, b.x), std::max(a.y, b.y));
+		size_t inRange = 0;
+		quadTree.ForEachPoint([&](const CQuadTree::CCoordinate& point)
+		{
+			inRange += point.x >= min.x && point.x <= max.x && point.y >= min.y && point.y <= max.y;
+		});
+
+		if (denseTree.CountInRange(min, max) != inRange || denseTree.Find(a) != quadTree.Find(a))
+		{
+			std::cerr << "dense pyramid: query " << i << " disagrees" << std::endl;
+			return 1;
+		}
+	}
+
+	// At 16 bits a 256 x 256 patch and a few scattered points only allocate the blocks they fall in, a full grid would
+	// take 700 MB, and erasing the points frees the blocks again
+	CDenseQuadTree wideTree(16);
+	const size_t emptyWideBytes = wideTree.GetAllocatedBytes();
+	std::vector<CQuadTree::CCoordinate> wideCells;
+	for (size_t i = 0; i < workloads[0].second.size(); ++i)
+	{
+		const CQuadTree::CCoordinate& point = workloads[0].second[i];
+		const CQuadTree::CCoordinate cell = i % 1000 == 0 ? CQuadTree::CCoordinate(point.x >> 48, point.y >> 48) :
+			CQuadTree::CCoordinate(0x4000 + (point.x >> 56), 0x8000 + (point.y >> 56));
+		if (wideTree.Insert(cell) == CQuadTree::EInsertResult::Success)
+		{
+			wideCells.push_back(cell);
+		}
+	}
+
+	const size_t wideBytes = wideTree.GetAllocatedBytes();
+	size_t wideFoundCount = 0;
+	for (const CQuadTree::CCoordinate& cell : wideCells)
+	{
+		wideFoundCount += wideTree.Find(cell) == CQuadTree::EFindResult::Success;
+	}
+
+	if (wideBytes > (8 << 20) || wideFoundCount != wideCells.size() || wideTree.CountInRange(CQuadTree::CCoordinate(0, 0),
+		CQuadTree::CCoordinate(0xFFFF, 0xFFFF)) != wideCells.size())
+	{
+		std::cerr << "dense pyramid: " << wideBytes << " bytes for " << wideCells.size() << " cells at 16 bits, " << wideFoundCount << " found" << std::endl;
+		return 1;
+	}
+
+	for (const CQuadTree::CCoordinate& cell : wideCells)
+	{
+		wideTree.Erase(cell);
+	}
+
+	if (wideTree.GetAllocatedBytes() != emptyWideBytes || wideTree.GetPointCount() != 0)
+	{
+		std::cerr << "dense pyramid: " << wideTree.GetAllocatedBytes() << " bytes left after erasing, " << emptyWideBytes << " empty" << std::endl;
+		return 1;
+	}
+
+	std::cout << "dense pyramid: ok, " << denseTree.GetPointCount() << " points in " << denseTree.GetAllocatedBytes() << " bytes, "
+		<< wideCells.size() << " cells in " << wideBytes << " bytes at 16 bits" << std::endl;
+
+	// Four producers push text records into a pipeline over a clustered workload, so the four insert threads get uneven
+	// quadrants. One record in a hundred is malformed and one in fifty is pushed twice.
+	{
+		const std::vector<CQuadTree::CCoordinate>& ingestPoints = workloads[1].second;
+		quadTree.Reset();
+		const uint64_t insertsBefore = quadTree.GetMetrics().operationCounts[static_cast<size_t>(CQuadTree::CMetrics::EOperation::Insert)];
+		CIngestPipeline<std::string> pipeline(quadTree, ParsePointRecord, 1024, 256);
+		std::vector<std::thread> producers;
+		const size_t producerCount = 4;
+		pipeline.Start();
+		for (size_t producer = 0; producer < producerCount; ++producer)
+		{
+			producers.emplace_back([&, producer]()
+			{
+				for (size_t i = producer; i < ingestPoints.size(); i += producerCount)
+				{
+					const std::string record = i % 100 == 0 ? "not a point" : std::to_string(ingestPoints[i].x) + " " + std::to_string(ingestPoints[i].y);
+					pipeline.Push(record);
+					if (i % 50 == 1)
+					{
+						pipeline.Push(record);
+					}
+				}
+			});
+		}
+
+		for (std::thread& producer : producers)
+		{
+			producer.join();
+		}
+
+		pipeline.Finish();
+		quadTree.SanityCheck();
+		std::vector<CQuadTree::CCoordinate> parsedPoints;
+		for (size_t i = 0; i < ingestPoints.size(); ++i)
+		{
+			if (i % 100 != 0)
+			{
+				parsedPoints.push_back(ingestPoints[i]);
+			}
+
+			if (i % 50 == 1)
+			{
+				parsedPoints.push_back(ingestPoints[i]);
+			}
+		}
+
+		if (!FindsAll(quadTree, parsedPoints, "ingest pipeline"))
+		{
+			return 1;
+		}
+
+		std::vector<CQuadTree::CCoordinate> uniquePoints = parsedPoints;
+		std::sort(uniquePoints.begin(), uniquePoints.end(), [](const CQuadTree::CCoordinate& lhs, const CQuadTree::CCoordinate& rhs)
+		{
+			return lhs.x != rhs.x ? lhs.x < rhs.x : lhs.y < rhs.y;
+		});
+		uniquePoints.erase(std::unique(uniquePoints.begin(), uniquePoints.end()), uniquePoints.end());
+		const CQuadTree::CMetrics metrics = quadTree.GetMetrics();
+		if (pipeline.GetParsedCount() != parsedPoints.size() || pipeline.GetRejectedCount() != (ingestPoints.size() + 99) / 100 ||
+			pipeline.GetInsertedCount() != uniquePoints.size() || pipeline.GetDuplicateCount() != parsedPoints.size() - uniquePoints.size() ||
+			metrics.pointCount != uniquePoints.size() ||
+			metrics.operationCounts[static_cast<size_t>(CQuadTree::CMetrics::EOperation::Insert)] - insertsBefore != parsedPoints.size())
+		{
+			std::cerr << "ingest pipeline: counts disagree" << std::endl;
+			return 1;
+		}
+
+		// The insert threads hand back what is left of their reserved chunks, so every pool slot is either in the tree or free
+		if (metrics.nodeCount + metrics.freeNodeCount + 1 != metrics.pageCount * pageSize)
+		{
+			std::cerr << "ingest pipeline: " << metrics.pageCount * pageSize - metrics.nodeCount - metrics.freeNodeCount - 1
+				<< " reserved nodes stranded" << std::endl;
+			return 1;
+		}
+
+		std::cout << "ingest pipeline: ok, " << pipeline.GetInsertedCount() << " inserted, " << pipeline.GetDuplicateCount()
+			<< " duplicates, " << pipeline.GetRejectedCount() << " rejected" << std::endl;
+	}
+
+	// Inserts collect in the write buffer and merge every hundred, while Find and Erase see the buffered points. Finding
+	// each buffered point at every buffer size covers the SIMD scan's blocks and its tail. A repeat is a duplicate
+	// whether the point is buffered, merged or was in the tree before.
+	{
+		const std::vector<CQuadTree::CCoordinate>& bufferPoints = workloads[0].second;
+		const size_t treePointCount = 20000;
+		const size_t bufferedPointCount = 5050;
+		quadTree.Reset();
+		quadTree.InsertBatch(bufferPoints.data(), treePointCount);
+		quadTree.EnableWriteBuffer(100);
+		for (size_t i = treePointCount; i < treePointCount + bufferedPointCount; ++i)
+		{
+			if (quadTree.Insert(bufferPoints[i]) != CQuadTree::EInsertResult::Success ||
+				quadTree.Insert(bufferPoints[i]) != CQuadTree::EInsertResult::DuplicateEntry ||
+				quadTree.Insert(bufferPoints[i - treePointCount]) != CQuadTree::EInsertResult::DuplicateEntry)
+			{
+				std::cerr << "write buffer: insert " << i << " not buffered" << std::endl;
+				return 1;
+			}
+
+			for (size_t j = i - (i - treePointCount) % 100; j <= i; ++j)
+			{
+				if (quadTree.Find(bufferPoints[j]) != CQuadTree::EFindResult::Success)
+				{
+					std::cerr << "write buffer: lost point " << j << " with " << i << " inserted" << std::endl;
+					return 1;
+				}
+			}
+		}
+
+		// Every third point goes, some from the tree, some merged from the buffer and some still buffered
+		std::vector<CQuadTree::CCoordinate> keptPoints;
+		for (size_t i = 0; i < treePointCount + bufferedPointCount; ++i)
+		{
+			if (i % 3 != 0)
+			{
+				keptPoints.push_back(bufferPoints[i]);
+			}
+			else if (quadTree.Erase(bufferPoints[i]) != CQuadTree::EEraseResult::Success || quadTree.Find(bufferPoints[i]) != CQuadTree::EFindResult::NoEntry)
+			{
+				std::cerr << "write buffer: erase " << i << " failed" << std::endl;
+				return 1;
+			}
+		}
+
+		const uint64_t bufferedCount = quadTree.GetMetrics().pointCount;
+		quadTree.DisableWriteBuffer();
+		quadTree.SanityCheck();
+		if (!FindsAll(quadTree, keptPoints, "write buffer"))
+		{
+			return 1;
+		}
+
+		if (bufferedCount != keptPoints.size() || quadTree.GetMetrics().pointCount != keptPoints.size())
+		{
+			std::cerr << "write buffer: point count " << quadTree.GetMetrics().pointCount << " for " << keptPoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		// Buffered points the budget refuses at the merge are counted by FlushWriteBuffer and reported to the pressure
+		// callback, and once under pressure inserts skip the buffer so OutOfMemory reaches the caller
+		const std::vector<CQuadTree::CCoordinate>& nearPoints = workloads[6].second;
+		const size_t budgetBytes = 1 << 20;
+		CQuadTree budgetTree(1024);
+		size_t pressureCallbackCount = 0;
+		budgetTree.SetMemoryBudget(budgetBytes, 0.5);
+		budgetTree.SetMemoryPressureCallback([&pressureCallbackCount](size_t, size_t) { ++pressureCallbackCount; });
+		budgetTree.Insert(nearPoints[0]);
+		budgetTree.EnableWriteBuffer(nearPoints.size());
+		const size_t nearPointCount = 20000;
+		for (size_t i = 1; i < nearPointCount; ++i)
+		{
+			if (budgetTree.Insert(nearPoints[i]) != CQuadTree::EInsertResult::Success)
+			{
+				std::cerr << "write buffer: insert " << i << " under the budget not buffered" << std::endl;
+				return 1;
+			}
+		}
+
+		const size_t refusedCount = budgetTree.FlushWriteBuffer();
+		size_t foundCount = 0;
+		for (size_t i = 0; i < nearPointCount; ++i)
+		{
+			foundCount += budgetTree.Find(nearPoints[i]) == CQuadTree::EFindResult::Success ? 1 : 0;
+		}
+
+		budgetTree.SanityCheck();
+		const CQuadTree::EInsertResult pressureResult = budgetTree.Insert(nearPoints[nearPointCount]);
+		if (refusedCount == 0 || foundCount + refusedCount != nearPointCount || pressureCallbackCount < refusedCount ||
+			budgetTree.GetMetrics().pointCount != foundCount || pressureResult != CQuadTree::EInsertResult::OutOfMemory)
+		{
+			std::cerr << "write buffer: " << refusedCount << " refused and " << foundCount << " found of " << nearPointCount << " points, "
+				<< pressureCallbackCount << " pressure callbacks" << std::endl;
+			return 1;
+		}
+
+		std::cout << "write buffer: ok, " << refusedCount << " of " << nearPointCount << " refused at the merge" << std::endl;
+	}
+
+	// Batches on a stable base of points: Commit publishes the batch's inserts and erases together, a reader running
+	// through the first batches keeps finding the base while the nodes commits replace are reused, hundreds of batches
+	// of churn after it leave the pool at its size after the first few, and Abort hands back every node the batch took.
+	// A reader preempted within a Find holds back reuse until it returns, so the pool is only measured once it stops.
+	{
+		const std::vector<CQuadTree::CCoordinate>& batchPoints = workloads[0].second;
+		const size_t basePointCount = 20000;
+		const size_t batchSize = 100;
+		const size_t readerBatchCount = 200;
+		const size_t warmupBatchCount = 20;
+		const size_t batchCount = 200;
+		CQuadTree batchTree(1024);
+		batchTree.InsertBatch(batchPoints.data(), basePointCount);
+
+		std::atomic<bool> stopReader(false);
+		std::atomic<size_t> readerMisses(0);
+		std::thread reader([&]()
+		{
+			for (size_t i = 0; !stopReader.load(std::memory_order_relaxed); i = (i + 1) % basePointCount)
+			{
+				if (batchTree.Find(batchPoints[i]) != CQuadTree::EFindResult::Success)
+				{
+					readerMisses.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		});
+
+		// Each batch inserts the next points and erases those inserted two batches before
+		size_t nextPoint = basePointCount;
+		size_t warmupPageCount = 0;
+		bool batchesOk = true;
+		const size_t totalBatchCount = readerBatchCount + warmupBatchCount + batchCount;
+		for (size_t batch = 0; batch < totalBatchCount && batchesOk; ++batch)
+		{
+			if (batch == readerBatchCount)
+			{
+				stopReader.store(true, std::memory_order_relaxed);
+				reader.join();
+			}
+
+			const size_t firstInserted = nextPoint;
+			const bool erases = batch >= 2;
+			const size_t firstErased = erases ? firstInserted - 2 * batchSize : 0;
+			batchTree.BeginBatch();
+			for (size_t i = 0; i < batchSize; ++i)
+			{
+				batchesOk &= batchTree.Insert(batchPoints[firstInserted + i]) == CQuadTree::EInsertResult::Success;
+				batchesOk &= !erases || batchTree.Erase(batchPoints[firstErased + i]) == CQuadTree::EEraseResult::Success;
+			}
+
+			nextPoint += batchSize;
+			batchesOk &= batchTree.Find(batchPoints[firstInserted]) == CQuadTree::EFindResult::NoEntry;
+			batchesOk &= batchTree.Find(batchPoints[firstErased]) == CQuadTree::EFindResult::Success;
+			batchTree.Commit();
+			batchesOk &= batchTree.Find(batchPoints[firstInserted]) == CQuadTree::EFindResult::Success;
+			batchesOk &= !erases || batchTree.Find(batchPoints[firstErased]) == CQuadTree::EFindResult::NoEntry;
+			if (batch + 1 == readerBatchCount + warmupBatchCount)
+			{
+				warmupPageCount = batchTree.GetMetrics().pageCount;
+			}
+		}
+
+		if (!stopReader.load())
+		{
+			stopReader.store(true, std::memory_order_relaxed);
+			reader.join();
+		}
+
+		if (!batchesOk || readerMisses.load() != 0)
+		{
+			std::cerr << "batches: commits not seen whole, " << readerMisses.load() << " points missed by the reader" << std::endl;
+			return 1;
+		}
+
+		const CQuadTree::CMetrics committedMetrics = batchTree.GetMetrics();
+		if (committedMetrics.pageCount > warmupPageCount + 1)
+		{
+			std::cerr << "batches: pool grew from " << warmupPageCount << " to " << committedMetrics.pageCount << " pages" << std::endl;
+			return 1;
+		}
+
+		// BeginBatch frees the nodes whose readers are gone, so the pool is compared from there
+		batchTree.BeginBatch();
+		const CQuadTree::CMetrics batchStartMetrics = batchTree.GetMetrics();
+		for (size_t i = 0; i < batchSize; ++i)
+		{
+			batchTree.Insert(batchPoints[nextPoint + i]);
+			batchTree.Erase(batchPoints[i]);
+		}
+
+		batchTree.Abort();
+		const CQuadTree::CMetrics abortedMetrics = batchTree.GetMetrics();
+		if (abortedMetrics.pageCount != batchStartMetrics.pageCount || abortedMetrics.freeNodeCount != batchStartMetrics.freeNodeCount ||
+			batchTree.Find(batchPoints[nextPoint]) != CQuadTree::EFindResult::NoEntry)
+		{
+			std::cerr << "batches: abort left " << abortedMetrics.freeNodeCount << " free nodes of " << batchStartMetrics.freeNodeCount << std::endl;
+			return 1;
+		}
+
+		batchTree.SanityCheck();
+		std::vector<CQuadTree::CCoordinate> livePoints(batchPoints.begin(), batchPoints.begin() + basePointCount);
+		livePoints.insert(livePoints.end(), batchPoints.begin() + (nextPoint - 2 * batchSize), batchPoints.begin() + nextPoint);
+		if (!FindsAll(batchTree, livePoints, "batches"))
+		{
+			return 1;
+		}
+
+		if (abortedMetrics.pointCount != livePoints.size())
+		{
+			std::cerr << "batches: point count " << abortedMetrics.pointCount << " for " << livePoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		std::cout << "batches: ok, " << committedMetrics.pageCount << " pages after " << totalBatchCount << " batches" << std::endl;
+	}
+
+	// Erase churn: a window sliding over the points erases the oldest and inserts as many new ones each round. The nodes
+	// erases and condensed blocks drop are retired and reused, so once the window is warm the pool stops growing.
+	for (const size_t workload : { size_t(1), size_t(5) })
+	{
+		const std::vector<CQuadTree::CCoordinate>& churnPoints = workloads[workload].second;
+		const size_t windowSize = 20000;
+		const size_t roundSize = 2000;
+		const size_t warmupRoundCount = 10;
+		CQuadTree churnTree(1024);
+		churnTree.SetBitmapLeafThreshold(workload == 5 ? 16 : 0);
+		churnTree.InsertBatch(churnPoints.data(), windowSize);
+		uint64_t warmPageCount = 0;
+		size_t windowBegin = 0;
+		for (size_t round = 0; windowBegin + windowSize + roundSize <= churnPoints.size(); ++round, windowBegin += roundSize)
+		{
+			for (size_t i = windowBegin; i < windowBegin + roundSize; ++i)
+			{
+				churnTree.Erase(churnPoints[i]);
+				churnTree.Insert(churnPoints[i + windowSize]);
+			}
+
+			if (round + 1 == warmupRoundCount)
+			{
+				warmPageCount = churnTree.GetMetrics().pageCount;
+			}
+		}
+
+		const std::vector<CQuadTree::CCoordinate> windowPoints(churnPoints.begin() + windowBegin, churnPoints.begin() + windowBegin + windowSize);
+		const CQuadTree::CMetrics churnMetrics = churnTree.GetMetrics();
+		churnTree.SanityCheck();
+		if (!FindsAll(churnTree, windowPoints, "erase churn") || churnMetrics.pointCount != windowPoints.size() ||
+			warmPageCount == 0 || churnMetrics.pageCount > warmPageCount + 1)
+		{
+			std::cerr << "erase churn: " << churnMetrics.pageCount << " pages after churn for " << warmPageCount << " when warm, "
+				<< churnMetrics.pointCount << " points" << std::endl;
+			return 1;
+		}
+
+		std::cout << "erase churn: ok, " << workloads[workload].first << ", " << churnMetrics.pageCount << " pages" << std::endl;
+	}
+
+	// Snapshots: every truncated or corrupt snapshot is refused and leaves the tree holding the points it had, while
+	// the whole snapshot restores every point. The corrupt ones declare a block far larger than its points can fill
+	// and repeat a point.
+	{
+		const std::vector<CQuadTree::CCoordinate>& snapshotPoints = workloads[1].second;
+		const std::vector<CQuadTree::CCoordinate> previousPoints(workloads[0].second.begin(), workloads[0].second.begin() + 1000);
+		quadTree.Reset();
+		quadTree.InsertBatch(snapshotPoints.data(), snapshotPoints.size());
+		std::stringstream snapshotStream;
+		quadTree.Serialize(snapshotStream);
+		const std::string snapshot = snapshotStream.str();
+
+		std::vector<std::string> badSnapshots;
+		for (size_t cut : { size_t(0), size_t(3), size_t(6), size_t(100), snapshot.size() / 2, snapshot.size() - 1 })
+		{
+			badSnapshots.push_back(snapshot.substr(0, cut));
+		}
+
+		std::string oversizedBlock(snapshot, 0, 5);
+		WriteVarint(oversizedBlock, 1);
+		WriteVarint(oversizedBlock, 4096);
+		WriteVarint(oversizedBlock, 1);
+		WriteVarint(oversizedBlock, uint64_t(1) << 40);
+		oversizedBlock.push_back(0);
+		badSnapshots.push_back(oversizedBlock);
+
+		std::string repeatedPoint(snapshot, 0, 5);
+		WriteVarint(repeatedPoint, 2);
+		WriteVarint(repeatedPoint, 4096);
+		WriteVarint(repeatedPoint, 2);
+		WriteVarint(repeatedPoint, 2);
+		repeatedPoint.push_back(0);
+		repeatedPoint.push_back(5);
+		repeatedPoint.push_back(0);
+		badSnapshots.push_back(repeatedPoint);
+
+		quadTree.Reset();
+		quadTree.InsertBatch(previousPoints.data(), previousPoints.size());
+		for (const std::string& badSnapshot : badSnapshots)
+		{
+			std::istringstream badStream(badSnapshot);
+			if (quadTree.Deserialize(badStream) == CQuadTree::ELoadResult::Success)
+			{
+				std::cerr << "snapshots: loaded a bad snapshot of " << badSnapshot.size() << " bytes" << std::endl;
+				return 1;
+			}
+
+			quadTree.SanityCheck();
+			if (!FindsAll(quadTree, previousPoints, "snapshots") || quadTree.GetMetrics().pointCount != previousPoints.size())
+			{
+				std::cerr << "snapshots: a bad snapshot of " << badSnapshot.size() << " bytes changed the tree" << std::endl;
+				return 1;
+			}
+		}
+
+		std::istringstream goodStream(snapshot);
+		if (quadTree.Deserialize(goodStream) != CQuadTree::ELoadResult::Success)
+		{
+			std::cerr << "snapshots: snapshot of " << snapshot.size() << " bytes refused" << std::endl;
+			return 1;
+		}
+
+		quadTree.SanityCheck();
+		if (!FindsAll(quadTree, snapshotPoints, "snapshots") || quadTree.GetMetrics().pointCount != snapshotPoints.size())
+		{
+			std::cerr << "snapshots: point count " << quadTree.GetMetrics().pointCount << " for " << snapshotPoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		// A snapshot larger than the memory budget is refused whole rather than loaded in part
+		CQuadTree budgetTree(1024);
+		budgetTree.InsertBatch(previousPoints.data(), previousPoints.size());
+		budgetTree.SetMemoryBudget(1 << 20);
+		std::istringstream largeStream(snapshot);
+		if (budgetTree.Deserialize(largeStream) != CQuadTree::ELoadResult::OutOfMemory)
+		{
+			std::cerr << "snapshots: loaded a snapshot larger than the memory budget" << std::endl;
+			return 1;
+		}
+
+		budgetTree.SanityCheck();
+		if (!FindsAll(budgetTree, previousPoints, "snapshots") || budgetTree.GetMetrics().pointCount != previousPoints.size())
+		{
+			std::cerr << "snapshots: a refused snapshot changed the tree" << std::endl;
+			return 1;
+		}
+
+		std::cout << "snapshots: ok, " << snapshot.size() << " bytes, " << badSnapshots.size() << " bad snapshots refused" << std::endl;
+	}
+
+	// Checkpoints: a replica refuses truncated checkpoints, one whose first page claims the largest page size, hand
+	// built ones whose links share a child, close a cycle through the root or through an overflow bucket, and a
+	// truncated incremental checkpoint, each time keeping the points it held. Whole checkpoints bring it up to date,
+	// and churn in one small region makes an incremental checkpoint a small fraction of the full one.
+	{
+		const std::vector<CQuadTree::CCoordinate>& checkpointPoints = workloads[2].second;
+		const std::vector<CQuadTree::CCoordinate> previousPoints(workloads[0].second.begin(), workloads[0].second.begin() + 1000);
+		const size_t fullPointCount = 20000;
+		const size_t incrementalPointCount = 1000;
+		CQuadTree source(1024);
+		source.InsertBatch(checkpointPoints.data(), fullPointCount);
+		std::stringstream fullStream;
+		source.Checkpoint(fullStream, true);
+		const std::string fullCheckpoint = fullStream.str();
+		source.InsertBatch(checkpointPoints.data() + fullPointCount, incrementalPointCount);
+		std::stringstream incrementalStream;
+		source.Checkpoint(incrementalStream, false);
+		const std::string incrementalCheckpoint = incrementalStream.str();
+
+		// Each checkpoint in turn with the points the replica holds after it, those it refuses leave the points unchanged
+		const std::vector<CQuadTree::CCoordinate> fullPoints(checkpointPoints.begin(), checkpointPoints.begin() + fullPointCount);
+		const std::vector<CQuadTree::CCoordinate> incrementalPoints(checkpointPoints.begin(), checkpointPoints.begin() + fullPointCount + incrementalPointCount);
+		std::vector<std::pair<std::string, const std::vector<CQuadTree::CCoordinate>*>> checkpoints;
+		for (size_t cut : { size_t(100), size_t(5000), size_t(40000) })
+		{
+			checkpoints.emplace_back(fullCheckpoint.substr(0, cut), &previousPoints);
+		}
+
+		// The page size table follows the header
+		std::string largestPageSize;
+		WriteFixed64(largestPageSize, 0xFFFFFFFF);
+		std::string oversizedPage = fullCheckpoint;
+		oversizedPage.replace(kCheckpointHeaderSize, largestPageSize.size(), largestPageSize);
+		checkpoints.emplace_back(oversizedPage, &previousPoints);
+
+		// One page of 16 slots: a region root at slot 0 with the given children, a leaf in each quadrant at slots 1
+		// to 4 holding handBuiltPoints, and with a bucket link a bucket node at slot 5 behind the first leaf, linked to
+		// the given slot. Records are type, bucket count and depth bytes, the corner, the point and the links as varints.
+		const uint64_t kNoSlot = ~uint64_t(0);
+		const CQuadTree::TScalar kHalf = CQuadTree::TScalar(1) << 63;
+		const std::vector<CQuadTree::CCoordinate> handBuiltPoints = { CQuadTree::CCoordinate(5, 7), CQuadTree::CCoordinate(kHalf + 5, 7),
+			CQuadTree::CCoordinate(kHalf + 5, kHalf + 7), CQuadTree::CCoordinate(5, kHalf + 7) };
+		auto HandBuiltCheckpoint = [&](std::initializer_list<uint64_t> rootChildren, uint64_t bucketLink)
+		{
+			std::string records;
+			uint64_t recordCount = 0;
+			auto AppendRecord = [&](uint64_t slot, uint8_t nodeType, uint8_t depth, const CQuadTree::CCoordinate& corner,
+				const CQuadTree::CCoordinate& point, std::vector<uint64_t> links)
+			{
+				WriteVarint(records, recordCount == 0 ? slot : 0);
+				records.push_back(static_cast<char>(nodeType));
+				records.push_back(0);
+				records.push_back(static_cast<char>(depth));
+				if (depth > 0)
+				{
+					WriteVarint(records, corner.x >> (64 - depth));
+					WriteVarint(records, corner.y >> (64 - depth));
+				}
+
+				WriteVarint(records, point.x);
+				WriteVarint(records, point.y);
+				links.resize(5, kNoSlot);
+				links.push_back(slot + 1 < 16 ? slot + 1 : kNoSlot);
+				for (uint64_t link : links)
+				{
+					WriteVarint(records, link == kNoSlot ? 0 : ZigZagEncode(link - slot) + 1);
+				}
+
+				++recordCount;
+			};
+
+			AppendRecord(0, 1, 0, CQuadTree::CCoordinate(), CQuadTree::CCoordinate(), rootChildren);
+			for (uint64_t slot = 1; slot <= 4; ++slot)
+			{
+				const CQuadTree::CCoordinate& point = handBuiltPoints[slot - 1];
+				const CQuadTree::CCoordinate corner(point.x & kHalf, point.y & kHalf);
+				const uint64_t overflowLink = slot == 1 && bucketLink != kNoSlot ? 5 : kNoSlot;
+				AppendRecord(slot, 0, 1, corner, point - corner, { kNoSlot, kNoSlot, kNoSlot, kNoSlot, overflowLink });
+			}
+
+			if (bucketLink != kNoSlot)
+			{
+				AppendRecord(5, 4, 1, CQuadTree::CCoordinate(), CQuadTree::CCoordinate(), { kNoSlot, kNoSlot, kNoSlot, kNoSlot, bucketLink });
+			}
+
+			std::string checkpoint(kCheckpointMagic, sizeof(kCheckpointMagic));
+			checkpoint.push_back(static_cast<char>(kCheckpointVersion));
+			checkpoint.push_back(static_cast<char>(kCheckpointFlagFull));
+			for (uint64_t field : { uint64_t(16), uint64_t(1), uint64_t(0), uint64_t(1), uint64_t(1), recordCount + 1, uint64_t(16) })
+			{
+				WriteFixed64(checkpoint, field);
+			}
+
+			WriteVarint(checkpoint, 0);
+			WriteVarint(checkpoint, recordCount);
+			WriteVarint(checkpoint, records.size());
+			return checkpoint + records;
+		};
+
+		checkpoints.emplace_back(HandBuiltCheckpoint({ 1, 1, 2, 3 }, kNoSlot), &previousPoints);
+		checkpoints.emplace_back(HandBuiltCheckpoint({ 1, 2, 3, 0 }, kNoSlot), &previousPoints);
+		checkpoints.emplace_back(HandBuiltCheckpoint({ 1, 2, 3, 4 }, 5), &previousPoints);
+		checkpoints.emplace_back(HandBuiltCheckpoint({ 1, 2, 3, 4 }, kNoSlot), &handBuiltPoints);
+		checkpoints.emplace_back(fullCheckpoint, &fullPoints);
+		checkpoints.emplace_back(incrementalCheckpoint.substr(0, incrementalCheckpoint.size() / 2), &fullPoints);
+		checkpoints.emplace_back(incrementalCheckpoint, &incrementalPoints);
+
+		// Points inserted and erased again around the first point, the tree only changes within that region
+		std::vector<CQuadTree::CCoordinate> churnPoints = incrementalPoints;
+		const CQuadTree::CCoordinate churnCenter = checkpointPoints.front();
+		for (CQuadTree::TScalar i = 0; i < 256; ++i)
+		{
+			const CQuadTree::CCoordinate point(churnCenter.x + 1 + (i & 15) * 3, churnCenter.y + 1 + (i >> 4) * 3);
+			if (source.Insert(point) == CQuadTree::EInsertResult::Success && (i % 4 != 0 || source.Erase(point) != CQuadTree::EEraseResult::Success))
+			{
+				churnPoints.push_back(point);
+			}
+		}
+
+		std::stringstream churnStream;
+		source.Checkpoint(churnStream, false);
+		const std::string churnCheckpoint = churnStream.str();
+		if (churnCheckpoint.size() * 20 > fullCheckpoint.size())
+		{
+			std::cerr << "checkpoints: " << churnCheckpoint.size() << " bytes after local churn for " << fullCheckpoint.size() << " bytes full" << std::endl;
+			return 1;
+		}
+
+		checkpoints.emplace_back(churnCheckpoint, &churnPoints);
+
+		CQuadTree replica(1024);
+		replica.InsertBatch(previousPoints.data(), previousPoints.size());
+		const std::vector<CQuadTree::CCoordinate>* pExpectedPoints = &previousPoints;
+		for (const auto& checkpoint : checkpoints)
+		{
+			const bool applies = checkpoint.second != pExpectedPoints;
+			std::istringstream checkpointStream(checkpoint.first);
+			if ((replica.ApplyCheckpoint(checkpointStream) == CQuadTree::ELoadResult::Success) != applies)
+			{
+				std::cerr << "checkpoints: checkpoint of " << checkpoint.first.size() << " bytes " << (applies ? "refused" : "applied") << std::endl;
+				return 1;
+			}
+
+			pExpectedPoints = checkpoint.second;
+			replica.SanityCheck();
+			if (!FindsAll(replica, *pExpectedPoints, "checkpoints") || replica.GetMetrics().pointCount != pExpectedPoints->size())
+			{
+				std::cerr << "checkpoints: point count " << replica.GetMetrics().pointCount << " for " << pExpectedPoints->size() << " points" << std::endl;
+				return 1;
+			}
+		}
+
+		std::cout << "checkpoints: ok, " << fullCheckpoint.size() << " bytes full, " << incrementalCheckpoint.size() << " bytes incremental, " <<
+			churnCheckpoint.size() << " bytes after local churn" << std::endl;
+	}
+
+	// Workload traces: inserts, finds, erases, a reset and a committed and an aborted batch are recorded and replayed
+	// into a second tree, which runs the same number of each operation and ends up holding the same points
+	{
+		typedef CWorkloadRecorder::EOperation EOperation;
+		const std::vector<CQuadTree::CCoordinate>& tracePoints = workloads[3].second;
+		uint64_t recordedCounts[static_cast<size_t>(EOperation::Count)] = {};
+		std::stringstream traceStream;
+		CQuadTree recordedTree(pageSize);
+		{
+			CWorkloadRecorder recorder(traceStream);
+			recordedTree.SetRecorder(&recorder);
+			for (size_t i = 0; i < 5000; ++i)
+			{
+				recordedTree.Insert(tracePoints[i]);
+			}
+
+			recordedTree.Reset();
+			recordedTree.InsertBatch(tracePoints.data(), 20000);
+			for (size_t i = 19500; i < 20500; ++i)
+			{
+				recordedTree.Find(tracePoints[i]);
+			}
+
+			for (size_t i = 0; i < 20000; i += 4)
+			{
+				recordedTree.Erase(tracePoints[i]);
+			}
+
+			recordedTree.BeginBatch();
+			for (size_t i = 20000; i < 21000; ++i)
+			{
+				recordedTree.Insert(tracePoints[i]);
+			}
+
+			recordedTree.Commit();
+			recordedTree.BeginBatch();
+			for (size_t i = 1; i < 2000; i += 4)
+			{
+				recordedTree.Erase(tracePoints[i]);
+			}
+
+			recordedTree.Abort();
+			recordedTree.SetRecorder(nullptr);
+			recordedCounts[static_cast<size_t>(EOperation::Insert)] = 5000 + 20000 + 1000;
+			recordedCounts[static_cast<size_t>(EOperation::Find)] = 1000;
+			recordedCounts[static_cast<size_t>(EOperation::Erase)] = 5000 + 500;
+			recordedCounts[static_cast<size_t>(EOperation::Reset)] = 1;
+			recordedCounts[static_cast<size_t>(EOperation::BeginBatch)] = 2;
+			recordedCounts[static_cast<size_t>(EOperation::Commit)] = 1;
+			recordedCounts[static_cast<size_t>(EOperation::Abort)] = 1;
+		}
+
+		CWorkloadReplayer replayer;
+		CQuadTree replayedTree(pageSize);
+		if (replayer.Load(traceStream) != CQuadTree::ELoadResult::Success)
+		{
+			std::cerr << "workload trace: trace refused" << std::endl;
+			return 1;
+		}
+
+		const CWorkloadReplayer::CReport report = replayer.Replay(replayedTree);
+		for (size_t operation = 0; operation < static_cast<size_t>(EOperation::Count); ++operation)
+		{
+			if (report.operationCounts[operation] != recordedCounts[operation])
+			{
+				std::cerr << "workload trace: operation " << operation << " replayed " << report.operationCounts[operation] << " times for " << recordedCounts[operation] << std::endl;
+				return 1;
+			}
+		}
+
+		std::vector<CQuadTree::CCoordinate> recordedPoints;
+		recordedTree.ForEachPoint([&recordedPoints](const CQuadTree::CCoordinate& point) { recordedPoints.push_back(point); });
+		replayedTree.SanityCheck();
+		if (!FindsAll(replayedTree, recordedPoints, "workload trace") || replayedTree.GetMetrics().pointCount != recordedPoints.size())
+		{
+			std::cerr << "workload trace: point count " << replayedTree.GetMetrics().pointCount << " for " << recordedPoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		std::cout << "workload trace: ok, " << replayer.GetOperationCount() << " operations, " << traceStream.str().size() << " bytes" << std::endl;
+	}
+
+	// Prometheus output: every sample follows its HELP and TYPE lines and parses, the gauges and operation counters
+	// match the metrics, and each latency histogram is cumulative up to a +Inf bucket equal to its count
+	{
+		const std::vector<CQuadTree::CCoordinate>& metricPoints = workloads[0].second;
+		const size_t insertCount = 20000;
+		const size_t findCount = 3000;
+		const size_t eraseCount = 1000;
+		CQuadTree metricTree(pageSize);
+		metricTree.EnableLatencyHistograms(true);
+		for (size_t i = 0; i < insertCount; ++i)
+		{
+			metricTree.Insert(metricPoints[i]);
+		}
+
+		for (size_t i = 0; i < findCount; ++i)
+		{
+			metricTree.Find(metricPoints[i * 7]);
+		}
+
+		for (size_t i = 0; i < eraseCount; ++i)
+		{
+			metricTree.Erase(metricPoints[i * 3]);
+		}
+
+		const CQuadTree::CMetrics metrics = metricTree.GetMetrics();
+		std::stringstream exposition;
+		metrics.WritePrometheus(exposition);
+		std::unordered_map<std::string, double> samples;
+		std::unordered_set<std::string> describedNames;
+		std::unordered_map<std::string, double> cumulativeCounts; // last bucket of each operation's histogram
+		std::string line;
+		while (std::getline(exposition, line))
+		{
+			if (line.compare(0, 7, "# TYPE ") == 0)
+			{
+				describedNames.insert(line.substr(7, line.find(' ', 7) - 7));
+				continue;
+			}
+
+			if (line.compare(0, 7, "# HELP ") == 0)
+			{
+				continue;
+			}
+
+			// Histogram samples are described under the name without their _bucket, _sum or _count suffix
+			const size_t valueStart = line.rfind(' ');
+			std::string name = line.substr(0, std::min(line.find('{'), valueStart));
+			for (const char* pSuffix : { "_bucket", "_sum", "_count" })
+			{
+				const size_t suffixLength = std::strlen(pSuffix);
+				if (describedNames.count(name) == 0 && name.size() > suffixLength && name.compare(name.size() - suffixLength, suffixLength, pSuffix) == 0)
+				{
+					name.resize(name.size() - suffixLength);
+				}
+			}
+
+			char* pValueEnd = nullptr;
+			const double value = valueStart == std::string::npos ? 0.0 : std::strtod(line.c_str() + valueStart + 1, &pValueEnd);
+			if (valueStart == std::string::npos || *pValueEnd != '\0' || describedNames.count(name) == 0)
+			{
+				std::cerr << "prometheus: bad sample line " << line << std::endl;
+				return 1;
+			}
+
+			if (line.compare(0, 38, "prqt_operation_latency_seconds_bucket{") == 0)
+			{
+				const std::string operation = line.substr(0, line.find(','));
+				if (cumulativeCounts.count(operation) != 0 && value < cumulativeCounts[operation])
+				{
+					std::cerr << "prometheus: histogram bucket below the one before, " << line << std::endl;
+					return 1;
+				}
+
+				cumulativeCounts[operation] = value;
+			}
+
+			samples[line.substr(0, valueStart)] = value;
+		}
+
+		const std::pair<const char*, uint64_t> expectedSamples[] = {
+			{ "prqt_points", metrics.pointCount },
+			{ "prqt_nodes", metrics.nodeCount },
+			{ "prqt_pages", metrics.pageCount },
+			{ "prqt_free_nodes", metrics.freeNodeCount },
+			{ "prqt_operations_total{operation=\"insert\"}", insertCount },
+			{ "prqt_operations_total{operation=\"find\"}", findCount },
+			{ "prqt_operations_total{operation=\"erase\"}", eraseCount },
+			{ "prqt_operation_latency_seconds_count{operation=\"insert\"}", insertCount },
+			{ "prqt_operation_latency_seconds_count{operation=\"find\"}", findCount },
+			{ "prqt_operation_latency_seconds_count{operation=\"erase\"}", eraseCount },
+			{ "prqt_operation_latency_seconds_bucket{operation=\"insert\",le=\"+Inf\"}", insertCount },
+			{ "prqt_operation_latency_seconds_bucket{operation=\"find\",le=\"+Inf\"}", findCount },
+			{ "prqt_operation_latency_seconds_bucket{operation=\"erase\",le=\"+Inf\"}", eraseCount },
+		};
+
+		for (const auto& expectedSample : expectedSamples)
+		{
+			const auto sample = samples.find(expectedSample.first);
+			if (sample == samples.end() || sample->second != static_cast<double>(expectedSample.second))
+			{
+				std::cerr << "prometheus: " << expectedSample.first << " is not " << expectedSample.second << std::endl;
+				return 1;
+			}
+		}
+
+		if (metrics.pointCount != insertCount - eraseCount)
+		{
+			std::cerr << "prometheus: point count " << metrics.pointCount << " for " << insertCount - eraseCount << " points" << std::endl;
+			return 1;
+		}
+
+		std::cout << "prometheus: ok, " << samples.size() << " samples" << std::endl;
+	}
+
+	// Memory budget: near duplicates need deep splits, so a 2 MiB budget refuses inserts with OutOfMemory while the
+	// pressure callback never sees the pool past the budget. With a degradation depth the same budget keeps taking
+	// points into overflow buckets, and erasing every other point empties buckets and merges leaves.
+	{
+		const std::vector<CQuadTree::CCoordinate>& budgetPoints = workloads[6].second;
+		const size_t budgetBytes = 2 << 20;
+		for (uint32_t degradationDepth : { 0u, 16u })
+		{
+			CQuadTree budgetTree(1024);
+			size_t pressureCallbacks = 0;
+			size_t maxPoolBytes = 0;
+			budgetTree.SetMemoryBudget(budgetBytes, 0.5);
+			budgetTree.SetDegradationDepth(degradationDepth);
+			budgetTree.SetMemoryPressureCallback([&](size_t poolBytes, size_t)
+			{
+				++pressureCallbacks;
+				maxPoolBytes = std::max(maxPoolBytes, poolBytes);
+			});
+
+			std::vector<CQuadTree::CCoordinate> insertedPoints;
+			std::unordered_set<size_t> refused;
+			for (size_t i = 0; i < budgetPoints.size(); ++i)
+			{
+				const CQuadTree::EInsertResult insertResult = budgetTree.Insert(budgetPoints[i]);
+				if (insertResult == CQuadTree::EInsertResult::Success)
+				{
+					insertedPoints.push_back(budgetPoints[i]);
+				}
+				else if (insertResult == CQuadTree::EInsertResult::OutOfMemory)
+				{
+					refused.insert(i);
+				}
+			}
+
+			const CQuadTree::CMetrics metrics = budgetTree.GetMetrics();
+			const bool degrades = degradationDepth != 0;
+			if (pressureCallbacks == 0 || maxPoolBytes > budgetBytes || (degrades ? metrics.overflowPointCount == 0 : refused.empty()))
+			{
+				std::cerr << "memory budget: depth " << degradationDepth << ", " << refused.size() << " refused, " << metrics.overflowPointCount
+					<< " in buckets, pool reached " << maxPoolBytes << " bytes" << std::endl;
+				return 1;
+			}
+
+			for (size_t i : refused)
+			{
+				if (budgetTree.Find(budgetPoints[i]) != CQuadTree::EFindResult::NoEntry)
+				{
+					std::cerr << "memory budget: refused point " << i << " found" << std::endl;
+					return 1;
+				}
+			}
+
+			budgetTree.SanityCheck();
+			if (!FindsAll(budgetTree, insertedPoints, "memory budget") || metrics.pointCount != insertedPoints.size())
+			{
+				std::cerr << "memory budget: point count " << metrics.pointCount << " for " << insertedPoints.size() << " points" << std::endl;
+				return 1;
+			}
+
+			std::vector<CQuadTree::CCoordinate> keptPoints;
+			for (size_t i = 0; i < insertedPoints.size(); ++i)
+			{
+				if (i % 2 == 0)
+				{
+					keptPoints.push_back(insertedPoints[i]);
+				}
+				else if (budgetTree.Erase(insertedPoints[i]) != CQuadTree::EEraseResult::Success)
+				{
+					std::cerr << "memory budget: erase " << i << " failed" << std::endl;
+					return 1;
+				}
+			}
+
+			budgetTree.SanityCheck();
+			if (!FindsAll(budgetTree, keptPoints, "memory budget") || budgetTree.GetMetrics().pointCount != keptPoints.size())
+			{
+				std::cerr << "memory budget: point count " << budgetTree.GetMetrics().pointCount << " for " << keptPoints.size() << " points" << std::endl;
+				return 1;
+			}
+
+			std::cout << "memory budget: ok, depth " << degradationDepth << ", " << insertedPoints.size() << " inserted, " << refused.size()
+				<< " refused, " << metrics.overflowPointCount << " in buckets" << std::endl;
+		}
+	}
+
+	// Page growth and Reserve: doubling pages up to 16384 nodes hold the tree in a fraction of the pages of 1024 nodes
+	// it would otherwise take. A reservation from a sample of clustered points covers most of the build without leaving
+	// more than a fifth of it free, the sample dense enough for its deep leaves to pack their points as the build's do.
+	{
+		const std::vector<CQuadTree::CCoordinate>& growthPoints = workloads[0].second;
+		CQuadTree growthTree(1024);
+		growthTree.SetPageGrowth(2, 16384);
+		growthTree.InsertBatch(growthPoints.data(), growthPoints.size());
+		const CQuadTree::CMetrics growthMetrics = growthTree.GetMetrics();
+		growthTree.SanityCheck();
+		if (!FindsAll(growthTree, growthPoints, "page growth") || growthMetrics.pointCount != growthPoints.size() ||
+			growthMetrics.pageCount * 1024 * 4 > growthMetrics.nodeCount)
+		{
+			std::cerr << "page growth: " << growthMetrics.pageCount << " pages for " << growthMetrics.nodeCount << " nodes" << std::endl;
+			return 1;
+		}
+
+		const std::vector<CQuadTree::CCoordinate> reservePoints(workloads[1].second.begin(), workloads[1].second.begin() + 50000);
+		std::vector<CQuadTree::CCoordinate> sample;
+		for (size_t i = 0; i < reservePoints.size(); i += 10)
+		{
+			sample.push_back(reservePoints[i]);
+		}
+
+		CQuadTree reserveTree(1024);
+		reserveTree.Reserve(reservePoints.size(), sample.data(), sample.size());
+		const CQuadTree::CMetrics reservedMetrics = reserveTree.GetMetrics();
+		reserveTree.InsertBatch(reservePoints.data(), reservePoints.size());
+		const CQuadTree::CMetrics reserveMetrics = reserveTree.GetMetrics();
+		reserveTree.SanityCheck();
+		if (!FindsAll(reserveTree, reservePoints, "reserve") || reserveMetrics.pointCount != reservePoints.size())
+		{
+			return 1;
+		}
+
+		const uint64_t toleranceNodes = reserveMetrics.nodeCount * 20 / 100;
+		if (reserveMetrics.freeNodeCount > toleranceNodes || (reserveMetrics.pageCount - reservedMetrics.pageCount) * 1024 > toleranceNodes)
+		{
+			std::cerr << "reserve: " << reservedMetrics.freeNodeCount << " nodes reserved for " << reserveMetrics.nodeCount << ", "
+				<< reserveMetrics.freeNodeCount << " left free, " << reserveMetrics.pageCount - reservedMetrics.pageCount << " pages added" << std::endl;
+			return 1;
+		}
+
+		std::cout << "page growth: ok, " << growthMetrics.pageCount << " pages, " << reservedMetrics.freeNodeCount << " nodes reserved for "
+			<< reserveMetrics.nodeCount << std::endl;
+	}
+
+	// Page refill: with growing pages taken from the refill thread, inserts build the same pool as without it, also
+	// after the thread is stopped and started again part way. Under a memory budget, queued pages that would break the
+	// budget are dropped rather than linked.
+	{
+		const std::vector<CQuadTree::CCoordinate>& refillPoints = workloads[4].second;
+		const size_t restartPoint = refillPoints.size() / 2;
+		CQuadTree referenceTree(1024);
+		CQuadTree refillTree(1024);
+		for (CQuadTree* pTree : { &referenceTree, &refillTree })
+		{
+			pTree->SetPageGrowth(2, 8192);
+		}
+
+		refillTree.EnablePageRefill(4);
+		for (size_t i = 0; i < refillPoints.size(); ++i)
+		{
+			if (i == restartPoint)
+			{
+				refillTree.DisablePageRefill();
+				refillTree.EnablePageRefill(2);
+			}
+
+			referenceTree.Insert(refillPoints[i]);
+			refillTree.Insert(refillPoints[i]);
+		}
+
+		const CQuadTree::CMetrics referenceMetrics = referenceTree.GetMetrics();
+		const CQuadTree::CMetrics refillMetrics = refillTree.GetMetrics();
+		refillTree.SanityCheck();
+		if (!FindsAll(refillTree, refillPoints, "page refill") || refillMetrics.pointCount != referenceMetrics.pointCount ||
+			refillMetrics.pageCount != referenceMetrics.pageCount || refillMetrics.allocatedBytes != referenceMetrics.allocatedBytes)
+		{
+			std::cerr << "page refill: " << refillMetrics.pageCount << " pages and " << refillMetrics.allocatedBytes << " bytes for "
+				<< referenceMetrics.pageCount << " pages and " << referenceMetrics.allocatedBytes << " bytes" << std::endl;
+			return 1;
+		}
+
+		refillTree.DisablePageRefill();
+		const size_t budgetBytes = 1 << 20;
+		CQuadTree budgetTree(1024);
+		size_t maxPoolBytes = 0;
+		budgetTree.SetMemoryBudget(budgetBytes);
+		budgetTree.SetMemoryPressureCallback([&maxPoolBytes](size_t poolBytes, size_t) { maxPoolBytes = std::max(maxPoolBytes, poolBytes); });
+		budgetTree.EnablePageRefill(4);
+		std::vector<CQuadTree::CCoordinate> insertedPoints;
+		for (const CQuadTree::CCoordinate& point : refillPoints)
+		{
+			if (budgetTree.Insert(point) == CQuadTree::EInsertResult::Success)
+			{
+				insertedPoints.push_back(point);
+			}
+		}
+
+		budgetTree.DisablePageRefill();
+		budgetTree.SanityCheck();
+		if (maxPoolBytes == 0 || maxPoolBytes > budgetBytes || !FindsAll(budgetTree, insertedPoints, "page refill") ||
+			budgetTree.GetMetrics().pointCount != insertedPoints.size())
+		{
+			std::cerr << "page refill: pool reached " << maxPoolBytes << " bytes of a " << budgetBytes << " byte budget" << std::endl;
+			return 1;
+		}
+
+		std::cout << "page refill: ok, " << refillMetrics.pageCount << " pages" << std::endl;
+	}
+
+	// Inline mode: up to the inline capacity the points sit in the flat array without a node pool, also after erases
+	// make room again. The next point, a batch of more points than fit, or BeginBatch builds the tree with the points
+	// kept, and a Reset of a built tree keeps it built.
+	{
+		const size_t inlineCapacity = 64;
+		const std::vector<CQuadTree::CCoordinate>& allPoints = workloads[0].second;
+		const std::vector<CQuadTree::CCoordinate> inlinePoints(allPoints.begin(), allPoints.begin() + inlineCapacity);
+		CQuadTree inlineTree(1024, inlineCapacity);
+		for (const CQuadTree::CCoordinate& point : inlinePoints)
+		{
+			if (inlineTree.Insert(point) != CQuadTree::EInsertResult::Success || inlineTree.Insert(point) != CQuadTree::EInsertResult::DuplicateEntry)
+			{
+				std::cerr << "inline mode: insert failed" << std::endl;
+				return 1;
+			}
+		}
+
+		for (size_t i = 0; i < inlinePoints.size(); i += 2)
+		{
+			if (inlineTree.Erase(inlinePoints[i]) != CQuadTree::EEraseResult::Success || inlineTree.Find(inlinePoints[i]) != CQuadTree::EFindResult::NoEntry ||
+				inlineTree.Erase(inlinePoints[i]) != CQuadTree::EEraseResult::NoEntry || inlineTree.Insert(inlinePoints[i]) != CQuadTree::EInsertResult::Success)
+			{
+				std::cerr << "inline mode: erase " << i << " failed" << std::endl;
+				return 1;
+			}
+		}
+
+		inlineTree.SanityCheck();
+		const CQuadTree::CMetrics inlineMetrics = inlineTree.GetMetrics();
+		if (!FindsAll(inlineTree, inlinePoints, "inline mode") || inlineTree.Find(allPoints[inlineCapacity]) != CQuadTree::EFindResult::NoEntry ||
+			inlineMetrics.pageCount != 0 || inlineMetrics.pointCount != inlinePoints.size())
+		{
+			std::cerr << "inline mode: " << inlineMetrics.pageCount << " pages for " << inlineMetrics.pointCount << " inline points" << std::endl;
+			return 1;
+		}
+
+		const std::vector<CQuadTree::CCoordinate> builtPoints(allPoints.begin(), allPoints.begin() + 20000);
+		if (inlineTree.Insert(allPoints[inlineCapacity]) != CQuadTree::EInsertResult::Success || inlineTree.GetMetrics().pageCount == 0)
+		{
+			std::cerr << "inline mode: the tree was not built past the inline capacity" << std::endl;
+			return 1;
+		}
+
+		inlineTree.InsertBatch(builtPoints.data() + inlineCapacity + 1, builtPoints.size() - inlineCapacity - 1);
+		inlineTree.SanityCheck();
+		if (!FindsAll(inlineTree, builtPoints, "inline mode") || inlineTree.GetMetrics().pointCount != builtPoints.size())
+		{
+			std::cerr << "inline mode: point count " << inlineTree.GetMetrics().pointCount << " for " << builtPoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		const uint64_t builtPageCount = inlineTree.GetMetrics().pageCount;
+		inlineTree.Reset();
+		inlineTree.SanityCheck();
+		if (inlineTree.GetMetrics().pageCount != builtPageCount || inlineTree.GetMetrics().pointCount != 0 ||
+			inlineTree.Find(builtPoints[0]) != CQuadTree::EFindResult::NoEntry)
+		{
+			std::cerr << "inline mode: reset left " << inlineTree.GetMetrics().pointCount << " points" << std::endl;
+			return 1;
+		}
+
+		CQuadTree batchInsertTree(1024, inlineCapacity);
+		batchInsertTree.InsertBatch(inlinePoints.data(), inlinePoints.size() / 2);
+		const uint64_t halfPageCount = batchInsertTree.GetMetrics().pageCount;
+		batchInsertTree.InsertBatch(builtPoints.data() + inlinePoints.size() / 2, builtPoints.size() - inlinePoints.size() / 2);
+		batchInsertTree.SanityCheck();
+		if (halfPageCount != 0 || !FindsAll(batchInsertTree, builtPoints, "inline mode") || batchInsertTree.GetMetrics().pointCount != builtPoints.size())
+		{
+			std::cerr << "inline mode: batch insert kept " << batchInsertTree.GetMetrics().pointCount << " of " << builtPoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		CQuadTree batchTree(1024, inlineCapacity);
+		batchTree.InsertBatch(inlinePoints.data(), 10);
+		batchTree.BeginBatch();
+		for (size_t i = 10; i < inlinePoints.size(); ++i)
+		{
+			batchTree.Insert(inlinePoints[i]);
+		}
+
+		const bool hiddenBeforeCommit = batchTree.Find(inlinePoints.back()) == CQuadTree::EFindResult::NoEntry;
+		batchTree.Commit();
+		batchTree.SanityCheck();
+		if (!hiddenBeforeCommit || batchTree.GetMetrics().pageCount == 0 || !FindsAll(batchTree, inlinePoints, "inline mode") ||
+			batchTree.GetMetrics().pointCount != inlinePoints.size())
+		{
+			std::cerr << "inline mode: batch left " << batchTree.GetMetrics().pointCount << " of " << inlinePoints.size() << " points" << std::endl;
+			return 1;
+		}
+
+		std::cout << "inline mode: ok, " << inlineMetrics.allocatedBytes << " bytes inline" << std::endl;
+	}
+
+	// Forest: the pages of a destroyed tree go to the forest's pool and the next trees build from them, pooled pages
+	// and runs come back cleared so no tree sees another's points, and compaction hands its released pages to the pool
+	// too. Small trees share slabs, 256 trees of a few points each fit in a handful of pages, and once destroyed
+	// their runs serve the next 256 trees.
+	{
+		const std::vector<CQuadTree::CCoordinate> firstPoints(workloads[1].second.begin(), workloads[1].second.begin() + 20000);
+		const std::vector<CQuadTree::CCoordinate> secondPoints(workloads[2].second.begin(), workloads[2].second.begin() + 20000);
+		CQuadTreeForest forest(1024, 16);
+		const CQuadTreeForest::TTreeId firstId = forest.CreateTree();
+		forest.GetTree(firstId).InsertBatch(firstPoints.data(), firstPoints.size());
+		const size_t firstPageCount = forest.GetPageCount();
+		forest.DestroyTree(firstId);
+		if (forest.GetPageCount() != firstPageCount || forest.GetPooledPageCount() == 0 || forest.GetTreeCount() != 0)
+		{
+			std::cerr << "forest: " << forest.GetPageCount() << " pages of " << firstPageCount << " kept, " << forest.GetPooledPageCount() << " pooled" << std::endl;
+			return 1;
+		}
+
+		std::vector<CQuadTreeForest::TTreeId> treeIds;
+		for (size_t i = 0; i < 4; ++i)
+		{
+			treeIds.push_back(forest.CreateTree());
+		}
+
+		for (size_t i = 0; i < secondPoints.size(); ++i)
+		{
+			forest.GetTree(treeIds[i % treeIds.size()]).Insert(secondPoints[i]);
+		}
+
+		uint64_t treePageCount = 0;
+		for (size_t treeIndex = 0; treeIndex < treeIds.size(); ++treeIndex)
+		{
+			CQuadTree& tree = forest.GetTree(treeIds[treeIndex]);
+			std::vector<CQuadTree::CCoordinate> treePoints;
+			for (size_t i = treeIndex; i < secondPoints.size(); i += treeIds.size())
+			{
+				treePoints.push_back(secondPoints[i]);
+			}
+
+			tree.SanityCheck();
+			if (!FindsAll(tree, treePoints, "forest") || tree.GetMetrics().pointCount != treePoints.size() ||
+				tree.Find(firstPoints[treeIndex]) != CQuadTree::EFindResult::NoEntry)
+			{
+				std::cerr << "forest: tree " << treeIndex << " holds " << tree.GetMetrics().pointCount << " points for " << treePoints.size() << std::endl;
+				return 1;
+			}
+
+			treePageCount += tree.GetMetrics().pageCount;
+		}
+
+		// Trees only build pages once the pool is empty
+		const size_t pooledPageCount = forest.GetPooledPageCount();
+		const size_t pageCount = forest.GetPageCount();
+		if (pooledPageCount != 0 && pageCount != firstPageCount)
+		{
+			std::cerr << "forest: " << pageCount << " pages for " << firstPageCount << " with " << pooledPageCount << " pooled" << std::endl;
+			return 1;
+		}
+
+		CQuadTree& compactedTree = forest.GetTree(treeIds[0]);
+		std::vector<CQuadTree::CCoordinate> keptPoints;
+		for (size_t i = 0; i < secondPoints.size(); i += treeIds.size())
+		{
+			if (i % (2 * treeIds.size()) == 0)
+			{
+				keptPoints.push_back(secondPoints[i]);
+			}
+			else
+			{
+				compactedTree.Erase(secondPoints[i]);
+			}
+		}
+
+		const uint64_t uncompactedPageCount = compactedTree.GetMetrics().pageCount;
+		while (!compactedTree.CompactPool(1 << 16))
+		{
+		}
+
+		const uint64_t compactedPageCount = compactedTree.GetMetrics().pageCount;
+		compactedTree.SanityCheck();
+		if (compactedPageCount >= uncompactedPageCount || forest.GetPooledPageCount() <= pooledPageCount || forest.GetPageCount() != pageCount ||
+			!FindsAll(compactedTree, keptPoints, "forest") || compactedTree.GetMetrics().pointCount != keptPoints.size())
+		{
+			std::cerr << "forest: compaction left " << compactedPageCount << " of " << uncompactedPageCount << " pages, "
+				<< forest.GetPooledPageCount() << " pooled" << std::endl;
+			return 1;
+		}
+
+		forest.ReleasePooledPages();
+		if (forest.GetPooledPageCount() != 0 || forest.GetTreeCount() != treeIds.size())
+		{
+			std::cerr << "forest: " << forest.GetPooledPageCount() << " pages pooled after release" << std::endl;
+			return 1;
+		}
+
+		CQuadTreeForest smallForest(1024);
+		const size_t smallTreeCount = 256;
+		const size_t smallTreePointCount = 8;
+		size_t smallPageCount = 0;
+		for (size_t round = 0; round < 2; ++round)
+		{
+			std::vector<CQuadTreeForest::TTreeId> smallTreeIds;
+			for (size_t treeIndex = 0; treeIndex < smallTreeCount; ++treeIndex)
+			{
+				smallTreeIds.push_back(smallForest.CreateTree());
+				const CQuadTree::CCoordinate* pTreePoints = workloads[0].second.data() + treeIndex * smallTreePointCount;
+				smallForest.GetTree(smallTreeIds.back()).InsertBatch(pTreePoints, smallTreePointCount);
+			}
+
+			for (size_t treeIndex = 0; treeIndex < smallTreeCount; ++treeIndex)
+			{
+				CQuadTree& tree = smallForest.GetTree(smallTreeIds[treeIndex]);
+				const std::vector<CQuadTree::CCoordinate> treePoints(workloads[0].second.begin() + treeIndex * smallTreePointCount,
+					workloads[0].second.begin() + (treeIndex + 1) * smallTreePointCount);
+				tree.SanityCheck();
+				if (!FindsAll(tree, treePoints, "forest") || tree.GetMetrics().pointCount != smallTreePointCount)
+				{
+					std::cerr << "forest: small tree " << treeIndex << " holds " << tree.GetMetrics().pointCount << " points" << std::endl;
+					return 1;
+				}
+			}
+
+			if (smallForest.GetPageCount() * 8 > smallTreeCount || (round > 0 && smallForest.GetPageCount() != smallPageCount))
+			{
+				std::cerr << "forest: " << smallForest.GetPageCount() << " pages for " << smallTreeCount << " small trees" << std::endl;
+				return 1;
+			}
+
+			smallPageCount = smallForest.GetPageCount();
+			for (CQuadTreeForest::TTreeId treeId : smallTreeIds)
+			{
+				smallForest.DestroyTree(treeId);
+			}
+		}
+
+		std::cout << "forest: ok, " << firstPageCount << " pages, " << treePageCount << " taken by " << treeIds.size() << " trees, " <<
+			smallPageCount << " pages for " << smallTreeCount << " small trees" << std::endl;
+	}
+
+	return 0;
+}
+
+// Runs the same workloads against CQuadTree and the reference indexes: QuadTree bench [count] [seed]
+int Bench(int argc, char* argv[])
+{
+	const size_t count = argc > 2 ? static_cast<size_t>(std::strtoull(argv[2], nullptr, 10)) : 1000000;
+	const uint64_t seed = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1;
+	if (count == 0)
+	{
+		std::cerr << "count must be positive" << std::endl;
+		return 1;
+	}
+
+	CSpatialGenerator generator(seed);
+	const std::pair<const char*, std::vector<CQuadTree::CCoordinate>> workloads[] = {
+		{ "uniform", generator.Uniform(count) },
+		{ "gaussian clusters", generator.GaussianClusters(count, 64, 1e7) },
+		{ "power law hotspots", generator.PowerLawHotspots(count, 256, 1.2, 1e5) },
+		{ "near duplicates", generator.NearDuplicates(count, 40) },
+	};
+
+	CQuadTreeIndex quadTree(false);
+	CQuadTreeIndex quadTreeBatch(true);
+	CSortedMortonIndex sortedMorton;
+	CKdTree kdTree;
+	CUniformGridHash gridHash;
+	CHashSetIndex hashSet;
+	for (const auto& workload : workloads)
+	{
+		// Every stored point once, plus as many points that are mostly absent
+		std::vector<CQuadTree::CCoordinate> queries = workload.second;
+		const std::vector<CQuadTree::CCoordinate> misses = generator.Uniform(count);
+		queries.insert(queries.end(), misses.begin(), misses.end());
+		std::shuffle(queries.begin(), queries.end(), std::mt19937_64(seed));
+
+		std::cout << workload.first << " (" << count << " points)\n"
+			<< "  index                  build Mpt/s  find Mop/s  bytes/point    build ms     found\n";
+		RunBenchmark("CQuadTree", quadTree, workload.second, queries, std::cout);
+		RunBenchmark("CQuadTree InsertBatch", quadTreeBatch, workload.second, queries, std::cout);
+		RunBenchmark("sorted Morton vector", sortedMorton, workload.second, queries, std::cout);
+		RunBenchmark("k-d tree", kdTree, workload.second, queries, std::cout);
+		RunBenchmark("uniform grid hash", gridHash, workload.second, queries, std::cout);
+		RunBenchmark("unordered_set", hashSet, workload.second, queries, std::cout);
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && std::strcmp(argv[1], "bench") == 0)
+	{
+		return Bench(argc, argv);
+	}
+
+	if (argc > 2 && std::strcmp(argv[1], "replay") == 0)
+	{
+		return Replay(argc, argv);
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "stress") == 0)
+	{
+		return Stress(argc, argv);
+	}
+
 	constexpr CQuadTree::TScalar min = std::numeric_limits<CQuadTree::TScalar>::min();
 	constexpr CQuadTree::TScalar max = std::numeric_limits<CQuadTree::TScalar>::max();
 	std::default_random_engine generator;